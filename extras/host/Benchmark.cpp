@@ -0,0 +1,414 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+/*
+Benchmarks for MHGroveBLE, running against the emulated module on the
+simulated clock. The results only depend on the library and the emulator, not
+on the speed of the host, so they can be compared between versions.
+*/
+
+#include <MHGroveBLE.h>
+#include <stdio.h>
+
+#include "GroveBLEEmulator.h"
+
+/** Time the application spends between two `runOnce()` calls during
+ initialization and in the latency benchmark, in microseconds.
+ */
+static const unsigned long kFastLoopPeriod = 100;
+/** Maximum time for the initialization, in microseconds. */
+static const unsigned long kMaxInitDuration = 30000000;
+/** Receive buffer sizes for the throughput benchmark. */
+static const unsigned int kRxBufferSizes[] = { 16, 32, 64, 128, 256 };
+/** Time the application spends between two `runOnce()` calls in the
+ throughput benchmark, in microseconds.
+ */
+static const unsigned long kSlowLoopPeriods[] = { 1000, 5000, 10000 };
+/** Duration of the throughput benchmark, in microseconds. */
+static const unsigned long kThroughputDuration = 2000000;
+
+/** Time the last delivery happened. */
+static unsigned long long deliveryTime;
+/** Bytes passed to the handler. */
+static unsigned long deliveredBytes;
+
+/** Run the object for the given time. */
+static void run(MHGroveBLE & ble, unsigned long duration, unsigned long loopPeriod)
+{
+  unsigned long long end = hostTime() + duration;
+  while (hostTime() < end) {
+    hostAdvance(loopPeriod);
+    ble.runOnce();
+  }
+}
+
+/** Run the object until it's waiting for a connection.
+
+ @return Whether that state has been reached.
+ */
+static bool runUntilReady(MHGroveBLE & ble)
+{
+  unsigned long long end = hostTime() + kMaxInitDuration;
+  while (hostTime() < end) {
+    hostAdvance(kFastLoopPeriod);
+    ble.runOnce();
+    if (ble.getState() == MHGroveBLE::State::waitingForConnection) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/** Record deliveries. */
+static void onBytesReceived(const uint8_t *, size_t length)
+{
+  deliveryTime = hostTime();
+  deliveredBytes += length;
+}
+
+/** Fingerprint storage for the warm boot benchmark, like an EEPROM. */
+static uint32_t storedFingerprint = 0;
+
+static uint32_t loadFingerprint()
+{
+  return storedFingerprint;
+}
+
+static void storeFingerprint(uint32_t fingerprint)
+{
+  storedFingerprint = fingerprint;
+}
+
+/** Print the time to ready for one configuration. */
+static void printTimeToReady(
+  const char * title,
+  GroveBLEEmulator & module,
+  bool fastBoot,
+  unsigned long baud,
+  bool fingerprint = false
+)
+{
+  MHGroveBLE ble(module, "Bench");
+  ble.setPIN("123456");
+  ble.setFastBoot(fastBoot);
+  ble.setBaudRate(baud);
+  if (fingerprint) {
+    ble.setFingerprintStorage(loadFingerprint, storeFingerprint);
+  }
+
+  if (runUntilReady(ble)) {
+    printf("  %-40s %6lu ms, %2u commands\n",
+      title,
+      (unsigned long)ble.getStats().initDuration,
+      (unsigned int)module.commands.size());
+  } else {
+    printf("  %-40s failed\n", title);
+  }
+  module.commands.clear();
+}
+
+static void benchmarkTimeToReady()
+{
+  printf("Time to ready\n");
+
+  GroveBLEEmulator module;
+  printTimeToReady("default", module, false, 0);
+  printTimeToReady("baud rate known", module, false, 9600);
+  printTimeToReady("fast boot, configured module", module, true, 9600);
+
+  GroveBLEEmulator freshModule;
+  printTimeToReady("fast boot, module with factory defaults", freshModule, true, 9600);
+
+  GroveBLEEmulator warmModule;
+  printTimeToReady("fingerprint, first start", warmModule, false, 9600, true);
+  printTimeToReady("fingerprint, warm boot", warmModule, false, 9600, true);
+  printf("\n");
+}
+
+/** Print the receive latency for one configuration. */
+static void printLatency(const char * title, int delimiter, unsigned long baud)
+{
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Bench");
+  ble.setBaudRate(baud);
+  ble.setDelimiter(delimiter);
+  ble.setOnBytesReceived(onBytesReceived);
+
+  if (!runUntilReady(ble)) {
+    printf("  %-40s failed\n", title);
+    return;
+  }
+  module.peerConnect();
+  run(ble, 100000, kFastLoopPeriod);
+
+  const int messageCount = 20;
+  unsigned long long total = 0;
+  unsigned long long maximum = 0;
+  int received = 0;
+
+  for (int i = 0; i < messageCount; ++i) {
+    deliveryTime = 0;
+    unsigned long long arrival = module.peerSend("message " + std::to_string(10 + i) + "\n");
+    run(ble, 200000, kFastLoopPeriod);
+    if (deliveryTime >= arrival) {
+      unsigned long long latency = deliveryTime - arrival;
+      total += latency;
+      maximum = latency > maximum ? latency : maximum;
+      ++received;
+    }
+  }
+
+  if (received > 0) {
+    printf("  %-40s mean %6.2f ms, max %6.2f ms, %d/%d messages\n",
+      title,
+      total / 1000.0 / received,
+      maximum / 1000.0,
+      received,
+      messageCount);
+  } else {
+    printf("  %-40s no messages\n", title);
+  }
+}
+
+static void benchmarkLatency()
+{
+  printf("Receive latency (12 byte messages, from the last byte to the handler)\n");
+  printLatency("idle timeout, baud rate unknown", -1, 0);
+  printLatency("idle timeout, 9600 baud", -1, 9600);
+  printLatency("delimiter", '\n', 9600);
+  printf("\n");
+}
+
+/** Print the throughput for one configuration. */
+static void printThroughput(
+  unsigned int rxBufferSize,
+  unsigned long loopPeriod,
+  MHGroveBLE::OverflowPolicy policy
+)
+{
+  GroveBLEEmulator module;
+  module.baudRateIndex = 4;
+  module.pendingBaudRateIndex = 4;
+  module.setHostBaudRate(115200);
+
+  MHGroveBLE ble(module, "Bench", rxBufferSize);
+  ble.setBaudRate(115200);
+  ble.setFastBoot(true);
+  ble.setOnBytesReceived(onBytesReceived);
+  ble.setOverflowPolicy(policy);
+
+  if (!runUntilReady(ble)) {
+    printf("  %5u %8lu   failed\n", rxBufferSize, loopPeriod);
+    return;
+  }
+  module.peerConnect();
+  run(ble, 100000, kFastLoopPeriod);
+  ble.resetStats();
+  deliveredBytes = 0;
+  // Like the receive buffer of a HardwareSerial.
+  module.hostBufferSize = 64;
+
+  // Send as fast as the serial port allows.
+  unsigned long long start = hostTime();
+  std::string data;
+  for (unsigned long i = 0; i < kThroughputDuration / 87; ++i) {
+    data += (char)('a' + i % 26);
+  }
+  module.peerSend(data);
+  run(ble, kThroughputDuration + 100000, loopPeriod);
+
+  const MHGroveBLE::Stats & stats = ble.getStats();
+  double seconds = (deliveryTime - start) / 1000000.0;
+  unsigned long dropped = stats.bytesDropped + module.hostBufferOverflows;
+  printf("  %5u %8lu %10.0f %9.2f%% %8lu\n",
+    rxBufferSize,
+    loopPeriod,
+    seconds > 0 ? deliveredBytes / seconds : 0.0,
+    100.0 * dropped / data.size(),
+    (unsigned long)stats.flushes);
+}
+
+/** Print the throughput for all configurations with one overflow policy. */
+static void printThroughputTable(const char * title, MHGroveBLE::OverflowPolicy policy)
+{
+  printf("Receive throughput at 115200 baud, %s\n", title);
+  printf("  rxBuf loop(us)  bytes/s   dropped  flushes\n");
+  for (unsigned int rxBufferSize : kRxBufferSizes) {
+    for (unsigned long loopPeriod : kSlowLoopPeriods) {
+      printThroughput(rxBufferSize, loopPeriod, policy);
+    }
+  }
+  printf("\n");
+}
+
+static void benchmarkThroughput()
+{
+  // Dropped bytes include those lost in the 64 byte receive buffer of the
+  // stream.
+  printThroughputTable("overwrite", MHGroveBLE::OverflowPolicy::overwrite);
+  printThroughputTable("stop reading", MHGroveBLE::OverflowPolicy::stopReading);
+}
+
+/** Print the stream calls per received byte for one reader. */
+static void printStreamCalls(const char * title, MHGroveBLE::Reader reader)
+{
+  GroveBLEEmulator module;
+  module.baudRateIndex = 4;
+  module.pendingBaudRateIndex = 4;
+  module.setHostBaudRate(115200);
+
+  MHGroveBLE ble(module, "Bench", 128);
+  ble.setBaudRate(115200);
+  ble.setFastBoot(true);
+  ble.setOnBytesReceived(onBytesReceived);
+  ble.setReader(reader);
+
+  if (!runUntilReady(ble)) {
+    printf("  %-40s failed\n", title);
+    return;
+  }
+  module.peerConnect();
+  run(ble, 100000, kFastLoopPeriod);
+  ble.resetStats();
+  module.streamCalls = 0;
+
+  // Polled every 5ms, so about 57 bytes wait in the stream on each call.
+  std::string data(kThroughputDuration / 87, 'x');
+  module.peerSend(data);
+  run(ble, kThroughputDuration + 100000, 5000);
+
+  const MHGroveBLE::Stats & stats = ble.getStats();
+  printf("  %-40s %6.2f calls per byte\n",
+    title,
+    stats.bytesReceived > 0 ? (double)module.streamCalls / stats.bytesReceived : 0.0);
+}
+
+static void benchmarkStreamCalls()
+{
+  printf("Stream calls while receiving at 115200 baud\n");
+  printStreamCalls("byte by byte", nullptr);
+  printStreamCalls("readAvailableBytes", MHGroveBLE::readAvailableBytes);
+  printf("\n");
+}
+
+/** Print the time from `recover()` to ready after the module restarted. */
+static void printRecovery(const char * title, unsigned long delay)
+{
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Bench");
+
+  if (!runUntilReady(ble)) {
+    printf("  %-40s failed\n", title);
+    return;
+  }
+  module.restart();
+  run(ble, delay, kFastLoopPeriod);
+  unsigned int commandCount = module.commands.size();
+
+  unsigned long long start = hostTime();
+  ble.recover();
+  if (!runUntilReady(ble)) {
+    printf("  %-40s failed\n", title);
+    return;
+  }
+  printf("  %-40s %6.1f ms, %2u commands\n",
+    title,
+    (hostTime() - start) / 1000.0,
+    (unsigned int)(module.commands.size() - commandCount));
+}
+
+static void benchmarkRecovery()
+{
+  printf("Time to ready after recover(), the module restarts in 300ms\n");
+  printRecovery("module has restarted", 1000000);
+  printRecovery("module is restarting", 0);
+  printf("\n");
+}
+
+/** Print the time from a disconnect to the next connection as a central. */
+static void printCentralReconnect(const char * title, bool knownPeer)
+{
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Bench");
+  ble.setRole(MHGroveBLE::Role::central);
+  if (knownPeer) {
+    ble.setPeerAddress(module.peers.back().c_str());
+  }
+
+  unsigned long long start = hostTime();
+  while (ble.getState() != MHGroveBLE::State::connected) {
+    if (hostTime() - start > 60000000) {
+      printf("  %-40s failed\n", title);
+      return;
+    }
+    hostAdvance(kFastLoopPeriod);
+    ble.runOnce();
+  }
+  module.peerDisconnect();
+  if (!knownPeer) {
+    // Forget the peer, so it has to be discovered again.
+    ble.setPeerAddress(nullptr);
+    module.lastPeer.clear();
+  }
+  while (ble.getState() == MHGroveBLE::State::connected) {
+    hostAdvance(kFastLoopPeriod);
+    ble.runOnce();
+  }
+  unsigned int commandCount = module.commands.size();
+
+  start = hostTime();
+  while (ble.getState() != MHGroveBLE::State::connected) {
+    if (hostTime() - start > 60000000) {
+      printf("  %-40s failed\n", title);
+      return;
+    }
+    hostAdvance(kFastLoopPeriod);
+    ble.runOnce();
+  }
+  printf("  %-40s %6.1f ms, %2u commands\n",
+    title,
+    (hostTime() - start) / 1000.0,
+    (unsigned int)(module.commands.size() - commandCount));
+}
+
+static void benchmarkCentralReconnect()
+{
+  printf("Time to reconnect as a central, discovery takes 3s\n");
+  printCentralReconnect("known peer address", true);
+  printCentralReconnect("unknown peer", false);
+  printf("\n");
+}
+
+int main()
+{
+  benchmarkTimeToReady();
+  benchmarkLatency();
+  benchmarkThroughput();
+  benchmarkStreamCalls();
+  benchmarkRecovery();
+  benchmarkCentralReconnect();
+  return 0;
+}
@@ -0,0 +1,35 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+/*
+Has a symbol as large as an `MHGroveBLE` object for the configuration it's
+built with, see `footprint.sh`. The size is read from the symbol table, so this
+works when compiling for AVR as well, where the program can't be run.
+*/
+
+#include <MHGroveBLE.h>
+
+extern "C" const unsigned char mhGroveBLEObjectSize[sizeof(MHGroveBLE)];
+const unsigned char mhGroveBLEObjectSize[sizeof(MHGroveBLE)] = { 0 };
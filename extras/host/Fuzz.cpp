@@ -0,0 +1,448 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+/*
+Fuzz and stress test for receiving data while connected, running against the
+emulated module on the simulated clock.
+
+Each iteration picks a random configuration (receive buffer size, delimiter,
+watermark, overflow policy, reader, baud rate and loop timing) and runs a few
+connections. Before each connection, the module outputs random garbage. While
+connected, the peer sends random data in bursts with random gaps, mixed with
+parts of "OK+LOST" and "OK+CONN". The test checks that:
+
+- every connection and disconnection is detected,
+- no data is lost, except for bytes counted as dropped,
+- nothing else is passed on: no garbage from before the connection and no
+  part of the real "OK+LOST", unless the buffer ran full in the middle of it.
+
+Some iterations also let the peer send complete "OK+LOST" sentinels, always
+followed by more data in the same burst. The module doesn't send anything
+after a real "OK+LOST", so a disconnect at one of them is a failure.
+
+The time `runOnce()` takes per received byte is measured on the real clock.
+
+Usage: ./fuzz [iterations [seed]]. A failing iteration is reproduced with
+`./fuzz 1 <seed>`.
+*/
+
+#include <MHGroveBLE.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+
+#include "GroveBLEEmulator.h"
+
+/** The disconnect notification. */
+static const std::string kLost = "OK+LOST";
+/** The connect notification. */
+static const std::string kConnect = "OK+CONN";
+/** Maximum time for the initialization, in microseconds. */
+static const unsigned long kMaxInitDuration = 30000000;
+/** Maximum time to detect a connect or disconnect, in microseconds. */
+static const unsigned long kMaxNotificationDelay = 1000000;
+
+/** A configuration under test, picked at random for each iteration. */
+struct Config {
+  unsigned int rxBufferSize;
+  int delimiter;
+  unsigned int watermark;
+  MHGroveBLE::OverflowPolicy policy;
+  bool reader;
+  unsigned long baud;
+  /** Time between two `runOnce()` calls, in microseconds. */
+  unsigned long loopPeriod;
+  /** Random extra time between two calls, in microseconds. */
+  unsigned long loopJitter;
+  /** Whether the peer sends complete "OK+LOST" sentinels. */
+  bool peerSentinels;
+};
+
+/** Results of all iterations. */
+struct Totals {
+  unsigned long connections;
+  unsigned long bytesSent;
+  unsigned long bytesDelivered;
+  unsigned long bytesDropped;
+  /** Complete "OK+LOST" sentinels sent by the peer. */
+  unsigned long peerSentinels;
+  /** Real disconnects that passed on part of the sentinel. */
+  unsigned long leakedSentinels;
+  unsigned long failures;
+  /** Longest time from the disconnect to detecting it, in microseconds. */
+  unsigned long long maxDisconnectDelay;
+  /** `runOnce()` calls that read data. */
+  unsigned long readingCalls;
+  /** Bytes read by those calls. */
+  unsigned long long bytesRead;
+  /** Time spent in those calls, in nanoseconds. */
+  unsigned long long readingTime;
+  /** Worst time per byte of a single call, in nanoseconds. */
+  double maxTimePerByte;
+};
+
+/** The module of the current iteration. */
+static GroveBLEEmulator * currentModule;
+/** Data passed to the handler. */
+static std::string delivered;
+static Totals totals;
+
+static void onBaudRateChange(unsigned long baud)
+{
+  currentModule->setHostBaudRate(baud);
+}
+
+static void onBytesReceived(const uint8_t * data, size_t length)
+{
+  delivered.append(reinterpret_cast<const char *>(data), length);
+}
+
+/** Call `runOnce()` once after the loop period and measure it. */
+static void step(MHGroveBLE & ble, const Config & config, std::mt19937 & random)
+{
+  hostAdvance(config.loopPeriod + (config.loopJitter > 0 ? random() % config.loopJitter : 0));
+
+  uint32_t bytesBefore = ble.getStats().bytesReceived;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  ble.runOnce();
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  uint32_t bytes = ble.getStats().bytesReceived - bytesBefore;
+
+  if (bytes > 0 && ble.getState() == MHGroveBLE::State::connected) {
+    unsigned long long nanoseconds =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    ++totals.readingCalls;
+    totals.bytesRead += bytes;
+    totals.readingTime += nanoseconds;
+    if ((double)nanoseconds / bytes > totals.maxTimePerByte) {
+      totals.maxTimePerByte = (double)nanoseconds / bytes;
+    }
+  }
+}
+
+/** Run the object until it is in `state`, for at most `duration`.
+
+ @return Whether the state has been reached.
+ */
+static bool runUntilState(
+  MHGroveBLE & ble,
+  const Config & config,
+  std::mt19937 & random,
+  MHGroveBLE::State state,
+  unsigned long duration
+)
+{
+  unsigned long long end = hostTime() + duration;
+  while (ble.getState() != state) {
+    if (hostTime() >= end) {
+      return false;
+    }
+    step(ble, config, random);
+  }
+  return true;
+}
+
+/** Run the object until `end`. */
+static void runUntil(MHGroveBLE & ble, const Config & config, std::mt19937 & random, unsigned long long end)
+{
+  while (hostTime() < end) {
+    step(ble, config, random);
+  }
+}
+
+/** Run the object until `end`, or until it leaves the connected state. */
+static void runWhileConnected(
+  MHGroveBLE & ble,
+  const Config & config,
+  std::mt19937 & random,
+  unsigned long long end
+)
+{
+  while (hostTime() < end && ble.getState() == MHGroveBLE::State::connected) {
+    step(ble, config, random);
+  }
+}
+
+static Config randomConfig(std::mt19937 & random)
+{
+  static const unsigned int kRxBufferSizes[] = { 8, 16, 64, 256 };
+  static const unsigned long kLoopPeriods[] = { 20, 100, 1000, 5000 };
+
+  Config config;
+  config.rxBufferSize = kRxBufferSizes[random() % 4];
+  config.delimiter = random() % 2 ? '\n' : -1;
+  config.watermark = random() % 2 ? 1 + random() % config.rxBufferSize : 0;
+  config.policy =
+    random() % 2 ? MHGroveBLE::OverflowPolicy::stopReading : MHGroveBLE::OverflowPolicy::overwrite;
+  config.reader = random() % 2;
+  config.baud = random() % 2 ? 115200 : 9600;
+  config.loopPeriod = kLoopPeriods[random() % 4];
+  config.loopJitter = random() % 2 ? config.loopPeriod : 0;
+  config.peerSentinels = random() % 4 == 0;
+  return config;
+}
+
+static void printConfig(const Config & config)
+{
+  printf("    rx buffer %u, delimiter %d, watermark %u, %s, reader %d, %lu baud,\n",
+    config.rxBufferSize,
+    config.delimiter,
+    config.watermark,
+    config.policy == MHGroveBLE::OverflowPolicy::stopReading ? "stop reading" : "overwrite",
+    (int)config.reader,
+    config.baud);
+  printf("    loop %lu+%lu us, peer sentinels %d\n",
+    config.loopPeriod,
+    config.loopJitter,
+    (int)config.peerSentinels);
+}
+
+/** Replace the first byte of each occurrence of `text` in `data`. */
+static void breakOccurrences(std::string & data, const std::string & text, size_t limit)
+{
+  for (size_t i = data.find(text); i < limit; i = data.find(text, i)) {
+    data[i] = 'x';
+  }
+}
+
+/** Random bytes with parts of the notifications mixed in. */
+static std::string randomBytes(std::mt19937 & random, size_t length, bool sentinels)
+{
+  std::string data;
+  while (data.size() < length) {
+    switch (random() % 16) {
+      case 0:
+        data += kLost.substr(0, 1 + random() % (kLost.size() - 1));
+        break;
+      case 1:
+        data += kConnect.substr(0, 1 + random() % kConnect.size());
+        break;
+      case 2:
+        if (sentinels) {
+          data += kLost;
+        }
+        break;
+      case 3:
+        data += '\n';
+        break;
+      default:
+        data += (char)(random() % 256);
+        break;
+    }
+  }
+  if (!sentinels) {
+    breakOccurrences(data, kLost, data.size());
+  } else if (data.size() >= kLost.size() && data.compare(data.size() - kLost.size(), kLost.size(), kLost) == 0) {
+    // A sentinel at the end would look just like the real one.
+    data += 'x';
+  }
+  return data;
+}
+
+/** Number of occurrences of `text` in `data`. */
+static unsigned long countOccurrences(const std::string & data, const std::string & text)
+{
+  unsigned long count = 0;
+  for (size_t i = data.find(text); i != std::string::npos; i = data.find(text, i + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+/** Report a failed check. */
+static void fail(uint32_t seed, const Config & config, unsigned int connection, const char * text)
+{
+  ++totals.failures;
+  printf("  FAIL seed %lu, connection %u: %s\n", (unsigned long)seed, connection, text);
+  printConfig(config);
+}
+
+/** Run one iteration.
+
+ @return Whether all checks passed.
+ */
+static bool runIteration(uint32_t seed)
+{
+  std::mt19937 random(seed);
+  Config config = randomConfig(random);
+  unsigned long failuresBefore = totals.failures;
+
+  GroveBLEEmulator module;
+  currentModule = &module;
+  MHGroveBLE ble(module, "Fuzz", config.rxBufferSize);
+  ble.setBaudRate(9600);
+  ble.setTargetBaudRate(config.baud);
+  ble.setOnBaudRateChange(onBaudRateChange);
+  ble.setDelimiter(config.delimiter);
+  ble.setHighWatermark(config.watermark);
+  ble.setOverflowPolicy(config.policy);
+  if (config.reader) {
+    ble.setReader(MHGroveBLE::readAvailableBytes);
+  }
+  ble.setOnBytesReceived(onBytesReceived);
+
+  Config initConfig = config;
+  initConfig.loopPeriod = 1000;
+  if (!runUntilState(ble, initConfig, random, MHGroveBLE::State::waitingForConnection, kMaxInitDuration)) {
+    fail(seed, config, 0, "initialization didn't complete");
+    return false;
+  }
+
+  unsigned int connectionCount = 1 + random() % 3;
+  for (unsigned int connection = 1; connection <= connectionCount; ++connection) {
+    // Garbage before the connection must not be passed on, and must not
+    // contain the first "OK+CONN".
+    std::string garbage = randomBytes(random, random() % 40, true);
+    std::string beforeConnect = garbage + kConnect;
+    for (size_t i = beforeConnect.find(kConnect); i < garbage.size(); i = beforeConnect.find(kConnect)) {
+      beforeConnect[i] = garbage[i] = 'x';
+    }
+    module.noise(garbage);
+    runUntilState(ble, config, random, MHGroveBLE::State::connected, random() % 20000);
+
+    delivered.clear();
+    uint32_t droppedBefore = ble.getStats().bytesDropped;
+    uint32_t fullFlushesBefore = ble.getStats().flushesOnBufferFull;
+    module.peerConnect();
+    if (!runUntilState(ble, config, random, MHGroveBLE::State::connected, kMaxNotificationDelay)) {
+      fail(seed, config, connection, "connect not detected");
+      return false;
+    }
+    ++totals.connections;
+
+    // The data of the whole connection, so that no sentinel forms across
+    // bursts.
+    std::string sent = randomBytes(random, 1 + random() % 1500, config.peerSentinels);
+    bool disconnected = false;
+    unsigned long long arrival = 0;
+    for (size_t offset = 0; offset < sent.size();) {
+      size_t length = 1 + random() % 300;
+      if (
+        offset + length < sent.size()
+        && offset + length >= kLost.size()
+        && sent.compare(offset + length - kLost.size(), kLost.size(), kLost) == 0
+      ) {
+        // Keep the byte after a sentinel in the same burst.
+        ++length;
+      }
+      arrival = module.peerSend(sent.substr(offset, length));
+      offset += length;
+      runWhileConnected(ble, config, random, arrival + random() % 100000);
+      if (ble.getState() != MHGroveBLE::State::connected) {
+        disconnected = true;
+        break;
+      }
+    }
+    // With a small buffer that stops reading, the data may still be waiting
+    // in the stream. The time to detect the disconnect starts once it's read.
+    while (!disconnected && module.available() > 0) {
+      step(ble, config, random);
+      disconnected = ble.getState() != MHGroveBLE::State::connected;
+    }
+
+    totals.bytesSent += sent.size();
+    totals.peerSentinels += countOccurrences(sent, kLost);
+    if (disconnected) {
+      fail(
+        seed,
+        config,
+        connection,
+        config.peerSentinels ? "disconnect at a sentinel sent by the peer" : "disconnect without \"OK+LOST\""
+      );
+      // Let the rest of the burst arrive before the real "OK+LOST", as it may
+      // contain "OK+CONN".
+      runUntil(ble, config, random, arrival);
+      module.peerDisconnect();
+      runUntil(ble, config, random, hostTime() + kMaxNotificationDelay);
+      continue;
+    }
+
+    unsigned long long disconnectTime = hostTime();
+    module.peerDisconnect();
+    if (!runUntilState(ble, config, random, MHGroveBLE::State::waitingForConnection, kMaxNotificationDelay)) {
+      fail(seed, config, connection, "disconnect not detected");
+      return false;
+    }
+    if (hostTime() - disconnectTime > totals.maxDisconnectDelay) {
+      totals.maxDisconnectDelay = hostTime() - disconnectTime;
+    }
+    // "OK+LOST" may push data out of a full buffer as well.
+    uint32_t dropped = ble.getStats().bytesDropped - droppedBefore;
+    totals.bytesDropped += dropped;
+    bool ranFull = dropped > 0 || ble.getStats().flushesOnBufferFull != fullFlushesBefore;
+    // Nothing must be passed on after the disconnect.
+    std::string deliveredAtDisconnect = delivered;
+    runUntilState(ble, config, random, MHGroveBLE::State::connected, 100000);
+    if (delivered != deliveredAtDisconnect) {
+      fail(seed, config, connection, "data passed on after the disconnect");
+    }
+    totals.bytesDelivered += delivered.size();
+
+    // A part of the sentinel may only have been passed on if the buffer ran
+    // full before the rest arrived.
+    size_t extra = delivered.size() + dropped - sent.size();
+    if (delivered.size() + dropped < sent.size()) {
+      fail(seed, config, connection, "data lost");
+    } else if (extra >= kLost.size()) {
+      fail(seed, config, connection, "too much data passed on");
+    } else if (extra > 0 && !ranFull) {
+      fail(seed, config, connection, "part of \"OK+LOST\" passed on");
+    } else if (extra > 0 && delivered.compare(delivered.size() - extra, extra, kLost, 0, extra) != 0) {
+      fail(seed, config, connection, "data passed on isn't a part of \"OK+LOST\"");
+    } else if (dropped == 0 && delivered.compare(0, sent.size(), sent) != 0) {
+      fail(seed, config, connection, "data corrupted");
+    } else if (extra > 0) {
+      ++totals.leakedSentinels;
+    }
+  }
+  return totals.failures == failuresBefore;
+}
+
+int main(int argc, char ** argv)
+{
+  unsigned long iterations = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200;
+  uint32_t seed = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1;
+
+  printf("Fuzzing %lu iterations from seed %lu\n", iterations, (unsigned long)seed);
+  for (unsigned long i = 0; i < iterations; ++i) {
+    runIteration(seed + i);
+  }
+
+  printf("  %-40s %10lu\n", "connections", totals.connections);
+  printf("  %-40s %10lu\n", "bytes sent", totals.bytesSent);
+  printf("  %-40s %10lu\n", "bytes passed on", totals.bytesDelivered);
+  printf("  %-40s %10lu\n", "bytes dropped, buffer full", totals.bytesDropped);
+  printf("  %-40s %10lu\n", "sentinels sent by the peer", totals.peerSentinels);
+  printf("  %-40s %10lu\n", "disconnects passing on part of OK+LOST", totals.leakedSentinels);
+  printf("  %-40s %10.1f ms\n", "longest time to detect a disconnect", totals.maxDisconnectDelay / 1000.0);
+  printf("  %-40s %10.1f ns\n", "mean time per byte read",
+    totals.bytesRead > 0 ? (double)totals.readingTime / totals.bytesRead : 0.0);
+  printf("  %-40s %10.1f ns\n", "worst time per byte of one call", totals.maxTimePerByte);
+  printf("  %-40s %10lu\n", "failures", totals.failures);
+  return totals.failures > 0 ? 1 : 0;
+}
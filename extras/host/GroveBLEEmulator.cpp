@@ -0,0 +1,375 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#include "GroveBLEEmulator.h"
+
+/** Baud rates by the parameter of "AT+BAUD". */
+static const unsigned long kBaudRates[] = {
+  9600, 19200, 38400, 57600, 115200, 4800, 2400, 1200, 230400
+};
+static const int kBaudRateCount = sizeof(kBaudRates) / sizeof(kBaudRates[0]);
+
+/** Whether a string starts with a prefix. */
+static bool startsWith(const std::string & text, const char * prefix)
+{
+  return text.compare(0, strlen(prefix), prefix) == 0;
+}
+
+GroveBLEEmulator::GroveBLEEmulator() :
+  name("HMSoft"),
+  pin("000000"),
+  authType(0),
+  notification(0),
+  role(0),
+  baudRateIndex(0),
+  pendingBaudRateIndex(0),
+  firmwareVersion(540),
+  connected(false),
+  renewDuration(700000),
+  resetDuration(300000),
+  commandGap(3000),
+  peers({ "0017EA0A0A0A", "0017EA0B0B0B" }),
+  discoveryDuration(3000000),
+  discoveryHangs(false),
+  connectDuration(400000),
+  hostBufferSize(0),
+  hostBufferOverflows(0),
+  streamCalls(0),
+  inputTime(0),
+  busyUntil(0),
+  outputTime(0),
+  eventTime(0),
+  hostBaudRate(9600)
+{
+}
+
+void GroveBLEEmulator::setHostBaudRate(unsigned long baud)
+{
+  hostBaudRate = baud;
+}
+
+unsigned long GroveBLEEmulator::getBaudRate() const
+{
+  return kBaudRates[baudRateIndex];
+}
+
+int GroveBLEEmulator::available()
+{
+  ++streamCalls;
+  process();
+  discardOverflow();
+
+  unsigned long long now = hostTime();
+  int count = 0;
+  for (const PendingByte & pending : output) {
+    if (pending.time > now) {
+      break;
+    }
+    ++count;
+  }
+  return count;
+}
+
+int GroveBLEEmulator::read()
+{
+  ++streamCalls;
+  int value = peek();
+  if (value >= 0) {
+    output.pop_front();
+  }
+  return value;
+}
+
+size_t GroveBLEEmulator::readBytes(uint8_t * buffer, size_t length)
+{
+  ++streamCalls;
+  process();
+  discardOverflow();
+
+  unsigned long long now = hostTime();
+  size_t count = 0;
+  while (count < length && !output.empty() && output.front().time <= now) {
+    buffer[count++] = output.front().value;
+    output.pop_front();
+  }
+  return count;
+}
+
+int GroveBLEEmulator::peek()
+{
+  process();
+  discardOverflow();
+
+  if (output.empty() || output.front().time > hostTime()) {
+    return -1;
+  }
+  return output.front().value;
+}
+
+size_t GroveBLEEmulator::write(uint8_t value)
+{
+  process();
+
+  unsigned long long now = hostTime();
+  if (hostBaudRate != getBaudRate() || now < busyUntil) {
+    // Garbage, or the module is restarting.
+    return 1;
+  }
+
+  if (connected) {
+    sentToPeer += (char)value;
+  } else {
+    input += (char)value;
+    inputTime = now;
+  }
+  return 1;
+}
+
+void GroveBLEEmulator::peerConnect()
+{
+  eventTime = hostTime();
+  connected = true;
+  input.clear();
+  if (notification) {
+    emit("OK+CONN");
+  }
+}
+
+void GroveBLEEmulator::peerDisconnect()
+{
+  eventTime = hostTime();
+  connected = false;
+  if (notification) {
+    emit("OK+LOST");
+  }
+}
+
+void GroveBLEEmulator::restart()
+{
+  connected = false;
+  input.clear();
+  baudRateIndex = pendingBaudRateIndex;
+  busyUntil = hostTime() + resetDuration;
+}
+
+unsigned long long GroveBLEEmulator::peerSend(const std::string & data)
+{
+  eventTime = hostTime();
+  emit(data);
+  return outputTime;
+}
+
+void GroveBLEEmulator::noise(const std::string & bytes)
+{
+  eventTime = hostTime();
+  emit(bytes);
+}
+
+/*******************************************************************************
+ * Private section
+ */
+
+void GroveBLEEmulator::connectTo(const std::string & address)
+{
+  eventTime = outputTime + connectDuration;
+  for (const std::string & peer : peers) {
+    if (peer == address) {
+      connected = true;
+      lastPeer = address;
+      emit("OK+CONN");
+      return;
+    }
+  }
+  emit("OK+CONNF");
+}
+
+unsigned long GroveBLEEmulator::byteDuration() const
+{
+  // One start bit, eight data bits, one stop bit.
+  return 10000000UL / getBaudRate();
+}
+
+void GroveBLEEmulator::emit(const std::string & text)
+{
+  unsigned long long time = outputTime > eventTime ? outputTime : eventTime;
+
+  for (char value : text) {
+    time += byteDuration();
+    output.push_back(PendingByte { time, (uint8_t)value });
+  }
+  outputTime = time;
+}
+
+void GroveBLEEmulator::discardOverflow()
+{
+  if (hostBufferSize == 0) {
+    return;
+  }
+
+  // Nothing is read between two calls, so everything that arrived after the
+  // buffer was full is lost.
+  unsigned long long now = hostTime();
+  while (
+    output.size() > hostBufferSize
+    && output[hostBufferSize].time <= now
+  ) {
+    output.erase(output.begin() + hostBufferSize);
+    ++hostBufferOverflows;
+  }
+}
+
+void GroveBLEEmulator::process()
+{
+  if (input.empty() || hostTime() - inputTime < commandGap) {
+    return;
+  }
+
+  // The module responds as soon as the command is complete, even if nobody
+  // looked in the meantime.
+  eventTime = inputTime + commandGap;
+
+  std::string command;
+  command.swap(input);
+  commands.push_back(command);
+  handleCommand(command);
+}
+
+void GroveBLEEmulator::handleCommand(const std::string & command)
+{
+  if (command == "AT") {
+    emit("OK");
+    return;
+  }
+  if (!startsWith(command, "AT+")) {
+    return;
+  }
+
+  if (command == "AT+RENEW") {
+    emit("OK+RENEW");
+    name = "HMSoft";
+    pin = "000000";
+    authType = 0;
+    notification = 0;
+    role = 0;
+    lastPeer.clear();
+    settings.clear();
+    baudRateIndex = 0;
+    pendingBaudRateIndex = 0;
+    busyUntil = outputTime + renewDuration;
+    return;
+  }
+  if (command == "AT+RESET") {
+    emit("OK+RESET");
+    baudRateIndex = pendingBaudRateIndex;
+    busyUntil = outputTime + resetDuration;
+    return;
+  }
+  if (command == "AT+VERS?") {
+    emit("HMSoft V" + std::to_string(firmwareVersion));
+    return;
+  }
+  if (command == "AT+ADDR?") {
+    emit("OK+ADDR:0017EA090909");
+    return;
+  }
+  if (command == "AT+RSSI?") {
+    emit("OK+RSSI:-63");
+    return;
+  }
+  if (command == "AT+DISC?" && role == 1) {
+    emit("OK+DISCS");
+    if (discoveryHangs) {
+      return;
+    }
+    eventTime = outputTime + discoveryDuration;
+    for (size_t i = 0; i < peers.size(); ++i) {
+      emit("OK+DIS" + std::to_string(i) + ":" + peers[i]);
+    }
+    emit("OK+DISCE");
+    return;
+  }
+  if (command == "AT+CONNL" && role == 1) {
+    if (lastPeer.empty()) {
+      emit("OK+CONNN");
+      return;
+    }
+    emit("OK+CONNL");
+    connectTo(lastPeer);
+    return;
+  }
+  if (startsWith(command, "AT+CON") && command.size() == 18 && role == 1) {
+    emit("OK+CONNA");
+    connectTo(command.substr(6));
+    return;
+  }
+  if (command.size() < 7) {
+    return;
+  }
+
+  // All other commands have a name of four letters, followed by "?" for
+  // queries or the new value.
+  std::string key = command.substr(3, 4);
+  std::string value = command.substr(7);
+  bool isQuery = value == "?";
+
+  if (key == "NAME") {
+    if (isQuery) {
+      emit("OK+NAME:" + name);
+    } else {
+      name = value;
+      emit("OK+Set:" + value);
+    }
+  } else if (key == "PASS") {
+    if (isQuery) {
+      emit("OK+Get:" + pin);
+    } else {
+      pin = value;
+      emit("OK+Set:" + value);
+    }
+  } else if (key == "TYPE" || key == "NOTI" || key == "ROLE") {
+    int & setting = key == "TYPE" ? authType : key == "NOTI" ? notification : role;
+    if (isQuery) {
+      emit("OK+Get:" + std::to_string(setting));
+    } else {
+      setting = atoi(value.c_str());
+      emit("OK+Set:" + value);
+    }
+  } else if (key == "BAUD") {
+    int index = atoi(value.c_str());
+    if (isQuery) {
+      emit("OK+Get:" + std::to_string(pendingBaudRateIndex));
+    } else if (index >= 0 && index < kBaudRateCount) {
+      pendingBaudRateIndex = index;
+      emit("OK+Set:" + value);
+    }
+  } else if (isQuery) {
+    std::map<std::string, std::string>::const_iterator it = settings.find(key);
+    emit("OK+Get:" + (it != settings.end() ? it->second : std::string("0")));
+  } else {
+    settings[key] = value;
+    emit("OK+Set:" + value);
+  }
+}
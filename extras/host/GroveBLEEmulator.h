@@ -0,0 +1,196 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#ifndef GROVEBLEEMULATOR_H
+#define GROVEBLEEMULATOR_H
+
+#include <MHGroveBLEHal.h>
+
+#include "HostClock.h"
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+/** Emulates a Grove BLE module with HMSoft firmware, as seen through its
+ serial port.
+
+ Like the real module, the emulator doesn't terminate its responses: a command
+ is complete once no more bytes have arrived for a short while. All output is
+ paced at the baud rate of the module. Bytes written at another baud rate or
+ while the module restarts after "AT+RENEW" or "AT+RESET" are lost.
+
+ The emulator uses the simulated clock, see `hostAdvance`.
+ */
+class GroveBLEEmulator : public Stream {
+
+public:
+  /** Constructor. The module starts with its factory defaults. */
+  GroveBLEEmulator();
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  /** Reads all requested bytes that are available in one call. */
+  size_t readBytes(uint8_t * buffer, size_t length) override;
+  size_t write(uint8_t value) override;
+  using Print::write;
+
+  /** Set the baud rate the host uses for the serial port. If it doesn't
+   match the baud rate of the module, the module receives garbage.
+   */
+  void setHostBaudRate(unsigned long baud);
+
+  /** The baud rate the module currently uses. */
+  unsigned long getBaudRate() const;
+
+  /** A peer connects. */
+  void peerConnect();
+
+  /** The peer disconnects. */
+  void peerDisconnect();
+
+  /** The module restarts unexpectedly, e.g. after a brown-out. A connection
+   is dropped without "OK+LOST", and the module is unresponsive for
+   `resetDuration`.
+   */
+  void restart();
+
+  /** The peer sends data.
+
+   @return The simulated time at which the last byte has been received by
+    the host, in microseconds.
+   */
+  unsigned long long peerSend(const std::string & data);
+
+  /** The module outputs bytes on its own, e.g. line noise or a stale
+   notification, paced like all output.
+   */
+  void noise(const std::string & bytes);
+
+  /** Bluetooth name. */
+  std::string name;
+  /** Bluetooth PIN. */
+  std::string pin;
+  /** Authentication type, 0 is none. */
+  int authType;
+  /** Whether connection notifications are enabled. */
+  int notification;
+  /** Role, 0 is peripheral. */
+  int role;
+  /** Index of the current baud rate. */
+  int baudRateIndex;
+  /** Index of the baud rate used after the next reset. */
+  int pendingBaudRateIndex;
+  /** Firmware version reported by "AT+VERS?". */
+  long firmwareVersion;
+  /** Whether a peer is connected. */
+  bool connected;
+  /** Time the module is unresponsive after "AT+RENEW", in microseconds. */
+  unsigned long renewDuration;
+  /** Time the module is unresponsive after "AT+RESET", in microseconds. */
+  unsigned long resetDuration;
+  /** Time without input after which a command is complete, in
+   microseconds.
+   */
+  unsigned long commandGap;
+  /** Addresses of the peripherals in range, found by "AT+DISC?" in the
+   central role.
+   */
+  std::vector<std::string> peers;
+  /** Address of the last peer connected to, used by "AT+CONNL". */
+  std::string lastPeer;
+  /** Time a discovery takes, in microseconds. */
+  unsigned long discoveryDuration;
+  /** Whether a discovery never ends, like on a module whose firmware has hung
+   in it. The module still responds to other commands.
+   */
+  bool discoveryHangs;
+  /** Time a connection takes to be set up in the central role, in
+   microseconds.
+   */
+  unsigned long connectDuration;
+  /** Other settings, by their four letter name, e.g. "ADVI". */
+  std::map<std::string, std::string> settings;
+  /** Size of the host's receive buffer, like the 64 bytes of a
+   HardwareSerial on AVR, or 0 for unlimited. Bytes that arrive while it is
+   full are lost.
+   */
+  unsigned int hostBufferSize;
+  /** Number of bytes lost because the host's receive buffer was full. */
+  unsigned long hostBufferOverflows;
+  /** Number of calls of `available()`, `read()` and `readBytes()`. */
+  unsigned long streamCalls;
+  /** All commands received, in order. */
+  std::vector<std::string> commands;
+  /** All data sent to the peer. */
+  std::string sentToPeer;
+
+private:
+  /** A byte of output and the time it has been fully transmitted. */
+  struct PendingByte {
+    unsigned long long time;
+    uint8_t value;
+  };
+
+  /** Output that hasn't been read yet. */
+  std::deque<PendingByte> output;
+  /** The command being received. */
+  std::string input;
+  /** Time the last byte of `input` was received. */
+  unsigned long long inputTime;
+  /** Time until which the module doesn't respond. */
+  unsigned long long busyUntil;
+  /** Time the last byte of output has been fully transmitted. */
+  unsigned long long outputTime;
+  /** Time of the event that causes the next output. */
+  unsigned long long eventTime;
+
+  /** Central role: connect to `address` if it's in range. */
+  void connectTo(const std::string & address);
+  /** Baud rate used by the host. */
+  unsigned long hostBaudRate;
+
+  /** Queue output, paced at the current baud rate. Transmission starts at
+   `eventTime` or when the previous output is done.
+   */
+  void emit(const std::string & text);
+
+  /** Discard bytes that arrived while the host's buffer was full. */
+  void discardOverflow();
+
+  /** Handle a complete command, if any. */
+  void process();
+
+  /** Respond to a command. */
+  void handleCommand(const std::string & command);
+
+  /** Time to transmit a byte at the current baud rate, in microseconds. */
+  unsigned long byteDuration() const;
+};
+
+#endif
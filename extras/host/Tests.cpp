@@ -0,0 +1,1825 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+
+/*
+Tests for MHGroveBLE, running against the emulated module on the simulated
+clock. Each test sets up a situation, either one that once went wrong or an
+edge of a feature like framing or the transmit buffer, and checks the outcome.
+The exit code is the number of failed checks.
+*/
+
+#include <MHGroveBLE.h>
+#include <MHGroveBLEScheduler.h>
+#include <MHNotificationMatcher.h>
+#include <MHRingBuffer.h>
+#include <algorithm>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "GroveBLEEmulator.h"
+
+#if MHGROVEBLE_TRACE_SIZE != 8 || MHGROVEBLE_HISTOGRAM_SIZE != 20 \
+  || MHGROVEBLE_LOG_LEVEL != MHGROVEBLE_LOG_INFO
+#error "The tests expect the settings of TEST_FEATURES in the Makefile and CMakeLists.txt"
+#endif
+
+/** Time the application spends between two `runOnce()` calls, in
+ microseconds.
+ */
+static const unsigned long kLoopPeriod = 100;
+/** Maximum time for the initialization, in microseconds. */
+static const unsigned long kMaxInitDuration = 30000000;
+
+/** Number of failed checks. */
+static unsigned int failures;
+
+/** Report a failed check, see `CHECK`. */
+static bool check(bool condition, const char * text, int line)
+{
+  if (!condition) {
+    ++failures;
+    printf("    FAIL line %d: %s\n", line, text);
+  }
+  return condition;
+}
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+/** Number of heap allocations so far. */
+static unsigned long allocations;
+
+void * operator new(size_t size)
+{
+  ++allocations;
+  void * memory = malloc(size > 0 ? size : 1);
+  if (!memory) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void operator delete(void * memory) noexcept
+{
+  free(memory);
+}
+
+/** Run the object for the given time. */
+static void run(MHGroveBLE & ble, unsigned long duration)
+{
+  unsigned long long end = hostTime() + duration;
+  while (hostTime() < end) {
+    hostAdvance(kLoopPeriod);
+    ble.runOnce();
+  }
+}
+
+/** Run the object until it's waiting for a connection.
+
+ @return Whether that state has been reached.
+ */
+static bool runUntilReady(MHGroveBLE & ble)
+{
+  unsigned long long end = hostTime() + kMaxInitDuration;
+  while (hostTime() < end) {
+    hostAdvance(kLoopPeriod);
+    ble.runOnce();
+    if (ble.getState() == MHGroveBLE::State::waitingForConnection) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/** Number of `onReady` calls. */
+static unsigned int readyCount;
+
+static void onReady()
+{
+  ++readyCount;
+}
+
+/** What the command handlers saw. */
+static unsigned int handlerCount;
+static bool recoverResult;
+static uint8_t queuedInHandler;
+static MHGroveBLE::CommandResult lastResult;
+static std::string lastResponse;
+
+static void recoverInHandler(
+  MHGroveBLE & ble,
+  MHGroveBLE::CommandResult result,
+  const uint8_t *,
+  size_t
+)
+{
+  ++handlerCount;
+  lastResult = result;
+  recoverResult = ble.recover();
+  queuedInHandler = ble.getQueuedCommandCount();
+}
+
+static void recordResponse(
+  MHGroveBLE &,
+  MHGroveBLE::CommandResult result,
+  const uint8_t * response,
+  size_t length
+)
+{
+  ++handlerCount;
+  lastResult = result;
+  lastResponse.assign(reinterpret_cast<const char *>(response), length);
+}
+
+/** Run the object until the command handlers have been called `count`
+ times, for at most `duration`.
+ */
+static void runUntilHandled(MHGroveBLE & ble, unsigned int count, unsigned long duration)
+{
+  unsigned long long end = hostTime() + duration;
+  while (handlerCount < count && hostTime() < end) {
+    hostAdvance(kLoopPeriod);
+    ble.runOnce();
+  }
+}
+
+/** `recover()` from the handler of a command that timed out, with another
+ command queued: the other command must neither be cancelled nor be lost, and
+ the object must only be ready once the module has answered.
+ */
+static void testRecoverFromTimedOutCommand()
+{
+  printf("  recover() from the handler of a timed out command\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  ble.setOnReady(onReady);
+  if (!CHECK(runUntilReady(ble))) {
+    return;
+  }
+
+  readyCount = 0;
+  handlerCount = 0;
+  // The module doesn't answer anything but AT commands.
+  ble.enqueueCommand("XX", recoverInHandler, 100);
+  ble.enqueueCommand(F("AT+ADDR?"), recordResponse);
+  runUntilHandled(ble, 1, 1000000);
+  CHECK(handlerCount == 1);
+  CHECK(lastResult == MHGroveBLE::CommandResult::timedOut);
+  CHECK(recoverResult);
+  CHECK(queuedInHandler == 1);
+  CHECK(ble.getState() == MHGroveBLE::State::initializing);
+  CHECK(readyCount == 0);
+  CHECK(ble.getStats().recoveries == 0);
+
+  CHECK(runUntilReady(ble));
+  CHECK(readyCount == 1);
+  CHECK(ble.getStats().recoveries == 1);
+  CHECK(module.commands.back() == "AT");
+
+  runUntilHandled(ble, 2, 2000000);
+  CHECK(handlerCount == 2);
+  CHECK(lastResult == MHGroveBLE::CommandResult::success);
+  CHECK(lastResponse == "OK+ADDR:0017EA090909");
+  CHECK(ble.getQueuedCommandCount() == 0);
+}
+
+/** `recover()` from the handler of the only queued command, which once made
+ the queue length wrap around.
+ */
+static void testRecoverFromLastCommand()
+{
+  printf("  recover() from the handler of the last queued command\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  ble.setOnReady(onReady);
+  if (!CHECK(runUntilReady(ble))) {
+    return;
+  }
+
+  readyCount = 0;
+  handlerCount = 0;
+  ble.enqueueCommand(F("AT+ADDR?"), recoverInHandler);
+  runUntilHandled(ble, 1, 2000000);
+  CHECK(handlerCount == 1);
+  CHECK(lastResult == MHGroveBLE::CommandResult::success);
+  CHECK(recoverResult);
+  CHECK(queuedInHandler == 0);
+
+  CHECK(runUntilReady(ble));
+  CHECK(readyCount == 1);
+  CHECK(ble.getQueuedCommandCount() == 0);
+  run(ble, 1000000);
+  CHECK(handlerCount == 1);
+  CHECK(ble.getState() == MHGroveBLE::State::waitingForConnection);
+}
+
+/** `recover()` from the handler of a command that a connect interrupted must
+ fail: the module would pass "AT" on to the peer.
+ */
+static void testRecoverFromInterruptedCommand()
+{
+  printf("  recover() from the handler of a command interrupted by a connect\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  if (!CHECK(runUntilReady(ble))) {
+    return;
+  }
+
+  handlerCount = 0;
+  recoverResult = true;
+  // The module doesn't answer, so the command is still running.
+  ble.enqueueCommand("XX", recoverInHandler, 1000);
+  run(ble, 10000);
+  module.peerConnect();
+  runUntilHandled(ble, 1, 100000);
+  CHECK(handlerCount == 1);
+  CHECK(lastResult == MHGroveBLE::CommandResult::cancelled);
+  CHECK(!recoverResult);
+  run(ble, 1000000);
+  CHECK(ble.getState() == MHGroveBLE::State::connected);
+  CHECK(module.sentToPeer.empty());
+}
+
+/** A command interrupted by a connect in the middle of its response must be
+ cancelled, without passing on the partial response.
+ */
+static void testCommandInterruptedMidResponse()
+{
+  printf("  connect in the middle of a response\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  if (!CHECK(runUntilReady(ble))) {
+    return;
+  }
+
+  handlerCount = 0;
+  lastResponse = "unset";
+  // The module doesn't answer, so the command is still running when part of
+  // a response and the notification arrive.
+  ble.enqueueCommand("XX", recordResponse, 1000);
+  run(ble, 10000);
+  module.noise("OK+RSSI:-");
+  module.peerConnect();
+  runUntilHandled(ble, 1, 100000);
+  CHECK(handlerCount == 1);
+  CHECK(lastResult == MHGroveBLE::CommandResult::cancelled);
+  CHECK(lastResponse.empty());
+  run(ble, 100000);
+  CHECK(ble.getState() == MHGroveBLE::State::connected);
+}
+
+/** Results of all command handler calls, in order. */
+static std::vector<MHGroveBLE::CommandResult> results;
+
+static void recordResult(
+  MHGroveBLE &,
+  MHGroveBLE::CommandResult result,
+  const uint8_t *,
+  size_t
+)
+{
+  ++handlerCount;
+  results.push_back(result);
+}
+
+/** A chain step that fails must cancel the steps after it, but not the
+ commands queued after the chain.
+ */
+static void testChainCancellation()
+{
+  printf("  cancelling the rest of a command chain\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  if (!CHECK(runUntilReady(ble))) {
+    return;
+  }
+
+  handlerCount = 0;
+  results.clear();
+  size_t commandCount = module.commands.size();
+  // The module doesn't answer anything but AT commands.
+  CHECK(ble.command("XX", recordResult, 100)
+    .then(F("AT+ADDR?"), recordResult)
+    .then(F("AT+NAME?"), recordResult)
+    .isQueued());
+  ble.enqueueCommand(F("AT+ADDR?"), recordResponse);
+  runUntilHandled(ble, 4, 2000000);
+  CHECK(handlerCount == 4);
+  CHECK(results.size() == 3);
+  CHECK(results[0] == MHGroveBLE::CommandResult::timedOut);
+  CHECK(results[1] == MHGroveBLE::CommandResult::cancelled);
+  CHECK(results[2] == MHGroveBLE::CommandResult::cancelled);
+  CHECK(lastResult == MHGroveBLE::CommandResult::success);
+  CHECK(module.commands.size() == commandCount + 2);
+  CHECK(module.commands.back() == "AT+ADDR?");
+  CHECK(ble.getQueuedCommandCount() == 0);
+}
+
+/** Emulated module that counts the bytes written to it. */
+class CountingEmulator : public GroveBLEEmulator {
+public:
+  size_t write(uint8_t value) override
+  {
+    ++bytesWritten;
+    return GroveBLEEmulator::write(value);
+  }
+  using Print::write;
+
+  unsigned long bytesWritten = 0;
+};
+
+/** Once a chain step has been answered, the next step must be sent within the
+ same `runOnce()` call.
+ */
+static void testChainStepsBackToBack()
+{
+  printf("  command chain steps back to back\n");
+  CountingEmulator module;
+  MHGroveBLE ble(module, "Test");
+  if (!CHECK(runUntilReady(ble))) {
+    return;
+  }
+
+  handlerCount = 0;
+  results.clear();
+  CHECK(ble.command(F("AT+ADDR?"), recordResult)
+    .then(F("AT+NAME?"), recordResult)
+    .isQueued());
+  unsigned long long end = hostTime() + 2000000;
+  while (handlerCount == 0 && hostTime() < end) {
+    hostAdvance(kLoopPeriod);
+    module.bytesWritten = 0;
+    ble.runOnce();
+  }
+  CHECK(handlerCount == 1);
+  CHECK(module.bytesWritten == strlen("AT+NAME?"));
+
+  runUntilHandled(ble, 2, 2000000);
+  CHECK(results.size() == 2);
+  CHECK(results[0] == MHGroveBLE::CommandResult::success);
+  CHECK(results[1] == MHGroveBLE::CommandResult::success);
+  CHECK(module.commands.back() == "AT+NAME?");
+}
+
+/** The module of the current test, for `onBaudRateChange`. */
+static GroveBLEEmulator * currentModule;
+
+static void onBaudRateChange(unsigned long baud)
+{
+  currentModule->setHostBaudRate(baud);
+}
+
+/** Fingerprint storage, like an EEPROM. */
+static uint32_t storedFingerprint;
+
+static uint32_t loadFingerprint()
+{
+  return storedFingerprint;
+}
+
+static void storeFingerprint(uint32_t fingerprint)
+{
+  storedFingerprint = fingerprint;
+}
+
+/** A warm boot after changing the target baud rate must switch the module to
+ the new one instead of matching the stored fingerprint.
+ */
+static void testWarmBootWithNewTargetBaudRate()
+{
+  printf("  warm boot after changing the target baud rate\n");
+  GroveBLEEmulator module;
+  currentModule = &module;
+  storedFingerprint = 0;
+  {
+    MHGroveBLE ble(module, "Test");
+    ble.setBaudRate(9600);
+    ble.setTargetBaudRate(115200);
+    ble.setOnBaudRateChange(onBaudRateChange);
+    ble.setFingerprintStorage(loadFingerprint, storeFingerprint);
+    if (!CHECK(runUntilReady(ble))) {
+      return;
+    }
+    CHECK(module.getBaudRate() == 115200);
+    CHECK(storedFingerprint != 0);
+  }
+
+  MHGroveBLE ble(module, "Test");
+  ble.setBaudRate(115200);
+  ble.setTargetBaudRate(57600);
+  ble.setOnBaudRateChange(onBaudRateChange);
+  ble.setFingerprintStorage(loadFingerprint, storeFingerprint);
+  CHECK(runUntilReady(ble));
+  CHECK(module.getBaudRate() == 57600);
+}
+
+/** Data passed to the data handler. */
+static std::string received;
+
+static void onBytesReceived(const uint8_t * data, size_t length)
+{
+  received.append(reinterpret_cast<const char *>(data), length);
+}
+
+/** Run a central until the module has connected to the peer.
+
+ @return Whether that has happened.
+ */
+static bool runUntilConnectedToPeer(MHGroveBLE & ble, GroveBLEEmulator & module)
+{
+  if (!runUntilReady(ble)) {
+    return false;
+  }
+  unsigned long long end = hostTime() + 5000000;
+  while (!module.connected && hostTime() < end) {
+    hostAdvance(kLoopPeriod);
+    ble.runOnce();
+  }
+  return module.connected;
+}
+
+/** In the central role, data the peer sends right after the connection has
+ been set up arrives together with the response to "AT+CON". It must be
+ passed on like any other data, even if it starts like a status of the
+ response, e.g. "N" of "OK+CONNN" or "F" of "OK+CONNF".
+ */
+static void testDataRightAfterConnectingToPeer()
+{
+  printf("  data right after connecting to a peer\n");
+  const char * payloads[] = { "Hello", "Nope", "Apple", "Lemon", "Fine", "E" };
+
+  for (const char * payload : payloads) {
+    GroveBLEEmulator module;
+    MHGroveBLE ble(module, "Test");
+    ble.setRole(MHGroveBLE::Role::central);
+    ble.setPeerAddress("0017EA0A0A0A");
+    ble.setOnBytesReceived(onBytesReceived);
+    received.clear();
+    if (!CHECK(runUntilConnectedToPeer(ble, module))) {
+      continue;
+    }
+
+    size_t commandCount = module.commands.size();
+    module.peerSend(payload);
+    run(ble, 3000000);
+    CHECK(ble.getState() == MHGroveBLE::State::connected);
+    CHECK(received == payload);
+    CHECK(module.commands.size() == commandCount);
+    CHECK(module.sentToPeer.empty());
+  }
+}
+
+/** A peer that starts streaming right after connecting must not hide the
+ connect notification, however much it sends.
+ */
+static void testStreamingPeer()
+{
+  printf("  peer streaming right after connecting\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  ble.setRole(MHGroveBLE::Role::central);
+  ble.setPeerAddress("0017EA0A0A0A");
+  ble.setOnBytesReceived(onBytesReceived);
+  received.clear();
+  if (!CHECK(runUntilConnectedToPeer(ble, module))) {
+    return;
+  }
+
+  std::string data;
+  for (int i = 0; i < 600; ++i) {
+    data += (char)('a' + i % 26);
+  }
+  module.peerSend(data);
+  run(ble, 3000000);
+  CHECK(ble.getState() == MHGroveBLE::State::connected);
+  CHECK(module.connected);
+  CHECK(received == data);
+  CHECK(ble.getStats().connects == 1);
+}
+
+/** "OK+CONNF" after "OK+CONNA" is a failed connection attempt, which is
+ retried.
+ */
+static void testConnectingToMissingPeer()
+{
+  printf("  connecting to a peer that isn't in range\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  ble.setRole(MHGroveBLE::Role::central);
+  ble.setPeerAddress("0017EA0C0C0C");
+  if (!CHECK(runUntilReady(ble))) {
+    return;
+  }
+
+  size_t commandCount = module.commands.size();
+  run(ble, 3000000);
+  CHECK(ble.getState() == MHGroveBLE::State::waitingForConnection);
+  CHECK(!module.connected);
+  CHECK(module.commands.size() >= commandCount + 2);
+  CHECK(module.commands.back() == "AT+CON0017EA0C0C0C");
+  CHECK(ble.getStats().connects == 0);
+}
+
+/** A discovery that hangs must be cancelled by `recover()`, and the object
+ must look for peers again once the module responds.
+ */
+static void testRecoverFromHungDiscovery()
+{
+  printf("  recovering from a hung discovery\n");
+  GroveBLEEmulator module;
+  module.discoveryHangs = true;
+  MHGroveBLE ble(module, "Test");
+  ble.setRole(MHGroveBLE::Role::central);
+  if (!CHECK(runUntilReady(ble))) {
+    return;
+  }
+
+  run(ble, 1000000);
+  if (!CHECK(!module.commands.empty() && module.commands.back() == "AT+DISC?")) {
+    return;
+  }
+  CHECK(ble.getState() == MHGroveBLE::State::waitingForConnection);
+
+  size_t commandCount = module.commands.size();
+  module.discoveryHangs = false;
+  CHECK(ble.recover());
+  run(ble, 500000);
+  CHECK(module.commands.size() > commandCount && module.commands[commandCount] == "AT");
+  CHECK(ble.getStats().recoveries == 1);
+  CHECK(ble.getState() == MHGroveBLE::State::waitingForConnection);
+
+  run(ble, 10000000);
+  CHECK(ble.getState() == MHGroveBLE::State::connected);
+  CHECK(module.connected);
+}
+
+/** Frames passed to the frame handler. */
+static std::vector<std::string> frames;
+
+static void onFrameReceived(const uint8_t * data, size_t length)
+{
+  frames.push_back(std::string(reinterpret_cast<const char *>(data), length));
+}
+
+/** Run the object until a peer has connected.
+
+ @return Whether that state has been reached.
+ */
+static bool runUntilConnected(MHGroveBLE & ble, GroveBLEEmulator & module)
+{
+  if (!runUntilReady(ble)) {
+    return false;
+  }
+  module.peerConnect();
+  run(ble, 100000);
+  return ble.getState() == MHGroveBLE::State::connected;
+}
+
+/** Send a frame to the emulated peer and have the peer send the encoded bytes
+ back.
+
+ @return Whether the frame came back unchanged.
+ */
+static bool roundTrip(MHGroveBLE & ble, GroveBLEEmulator & module, const std::string & frame)
+{
+  module.sentToPeer.clear();
+  frames.clear();
+  if (!ble.sendFrame(reinterpret_cast<const uint8_t *>(frame.data()), frame.size())) {
+    return false;
+  }
+  run(ble, 100000);
+  module.peerSend(module.sentToPeer);
+  run(ble, 1000000);
+  return frames.size() == 1 && frames[0] == frame;
+}
+
+/** COBS frames at the edges of the encoding: empty, made of zeros and exactly
+ one or just over one full block long.
+ */
+static void testCobsRoundTrip()
+{
+  printf("  COBS round trip\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test", 300);
+  ble.setFraming(MHGroveBLE::Framing::cobs);
+  ble.setOnFrameReceived(onFrameReceived);
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+
+  CHECK(roundTrip(ble, module, ""));
+  CHECK(module.sentToPeer == std::string("\x01\0", 2));
+  CHECK(roundTrip(ble, module, std::string("\0", 1)));
+  CHECK(roundTrip(ble, module, std::string("a\0\0b\0", 5)));
+  CHECK(roundTrip(ble, module, std::string(254, 'x')));
+  CHECK(module.sentToPeer.size() == 256);
+  CHECK(roundTrip(ble, module, std::string(255, 'x')));
+  CHECK(module.sentToPeer.size() == 258);
+  CHECK(roundTrip(ble, module, std::string(254, 'x') + std::string("\0", 1)));
+  CHECK(ble.getStats().framesDropped == 0);
+}
+
+/** A COBS block cut short by the delimiter must be dropped, and the next frame
+ must be received.
+ */
+static void testCobsTruncatedBlock()
+{
+  printf("  COBS frame with a truncated block\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  ble.setFraming(MHGroveBLE::Framing::cobs);
+  ble.setOnFrameReceived(onFrameReceived);
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+
+  frames.clear();
+  module.peerSend(std::string("\x05" "ab\0", 4));
+  run(ble, 1000000);
+  CHECK(frames.empty());
+  CHECK(ble.getStats().framesDropped == 1);
+
+  module.peerSend(std::string("\x03" "ab\0", 4));
+  run(ble, 1000000);
+  CHECK(frames.size() == 1 && frames[0] == "ab");
+}
+
+/** Length-prefixed frames: empty ones are skipped, oversize ones are dropped
+ and counted, and a frame may arrive in pieces.
+ */
+static void testLengthPrefixedFrames()
+{
+  printf("  length-prefixed frames\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test", 16);
+  ble.setFraming(MHGroveBLE::Framing::lengthPrefixed);
+  ble.setOnFrameReceived(onFrameReceived);
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+
+  frames.clear();
+  module.peerSend(std::string("\0", 1));
+  run(ble, 1000000);
+  CHECK(frames.empty());
+  CHECK(ble.getStats().framesDropped == 0);
+
+  module.peerSend(std::string("\x14") + std::string(20, 'x'));
+  run(ble, 1000000);
+  CHECK(frames.empty());
+  CHECK(ble.getStats().framesDropped == 1);
+
+  module.peerSend("\x05" "ab");
+  run(ble, 1000000);
+  CHECK(frames.empty());
+  module.peerSend("cde");
+  run(ble, 1000000);
+  CHECK(frames.size() == 1 && frames[0] == "abcde");
+  CHECK(ble.getStats().framesReceived == 1);
+
+  CHECK(roundTrip(ble, module, std::string(16, '\0')));
+}
+
+/** Frames that end in "OK+LOST" are payload, also when the line goes quiet
+ after them or before the COBS terminator. Only a frame cut off by "OK+LOST"
+ ends the connection.
+ */
+static void testFramesEndingInLost()
+{
+  printf("  frames ending in OK+LOST\n");
+  {
+    GroveBLEEmulator module;
+    MHGroveBLE ble(module, "Test");
+    ble.setFraming(MHGroveBLE::Framing::lengthPrefixed);
+    ble.setOnFrameReceived(onFrameReceived);
+    if (!CHECK(runUntilConnected(ble, module))) {
+      return;
+    }
+
+    frames.clear();
+    module.peerSend("\x0b" "dataOK+LOST");
+    run(ble, 1000000);
+    CHECK(frames.size() == 1 && frames[0] == "dataOK+LOST");
+    CHECK(ble.getState() == MHGroveBLE::State::connected);
+
+    // The module cuts a frame off when the peer disconnects.
+    frames.clear();
+    module.peerSend("\x14" "abc");
+    run(ble, 100000);
+    module.peerDisconnect();
+    run(ble, 2000000);
+    CHECK(frames.empty());
+    CHECK(ble.getState() == MHGroveBLE::State::waitingForConnection);
+  }
+  {
+    GroveBLEEmulator module;
+    MHGroveBLE ble(module, "Test");
+    ble.setFraming(MHGroveBLE::Framing::cobs);
+    ble.setOnFrameReceived(onFrameReceived);
+    if (!CHECK(runUntilConnected(ble, module))) {
+      return;
+    }
+
+    frames.clear();
+    module.peerSend("\x0c" "dataOK+LOST");
+    run(ble, 200000);
+    module.peerSend(std::string("\0", 1));
+    run(ble, 1000000);
+    CHECK(frames.size() == 1 && frames[0] == "dataOK+LOST");
+    CHECK(ble.getState() == MHGroveBLE::State::connected);
+  }
+}
+
+/** Prints "x=" and a value in two writes, and counts how often it's printed. */
+class Reading : public Printable {
+public:
+  Reading(int value) : value(value), printCount(0) {}
+
+  size_t printTo(Print & output) const override
+  {
+    ++printCount;
+    return output.print("x=") + output.print(value);
+  }
+
+  int value;
+  mutable unsigned int printCount;
+};
+
+/** Bytes, including zeros, must go to the peer unchanged, straight away or
+ through the transmit buffer, and nothing must be sent while not connected.
+ */
+static void testSendBytes()
+{
+  printf("  bytes\n");
+  const uint8_t bytes[] = { 'a', 0, 'b', 0xff };
+  const std::string expected(reinterpret_cast<const char *>(bytes), sizeof(bytes));
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  if (!CHECK(runUntilReady(ble))) {
+    return;
+  }
+
+  size_t commandCount = module.commands.size();
+  CHECK(!ble.send(bytes, sizeof(bytes)));
+  run(ble, 100000);
+  CHECK(module.commands.size() == commandCount);
+  CHECK(ble.getStats().bytesSent == 0);
+
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+  module.sentToPeer.clear();
+  CHECK(ble.send(bytes, sizeof(bytes)));
+  CHECK(ble.send(bytes, 0));
+  run(ble, 100000);
+  CHECK(module.sentToPeer == expected);
+  CHECK(ble.getStats().bytesSent == sizeof(bytes));
+
+  GroveBLEEmulator bufferedModule;
+  MHGroveBLE buffered(bufferedModule, "Test");
+  uint8_t storage[8];
+  buffered.setTxBuffer(storage, sizeof(storage));
+  if (!CHECK(runUntilConnected(buffered, bufferedModule))) {
+    return;
+  }
+  bufferedModule.sentToPeer.clear();
+  CHECK(buffered.send(bytes, sizeof(bytes)));
+  CHECK(buffered.getTxBufferFree() == 4);
+  CHECK(!buffered.send(bytes, 5));
+  CHECK(buffered.getTxBufferFree() == 4);
+  run(buffered, 100000);
+  CHECK(bufferedModule.sentToPeer == expected);
+}
+
+/** A `Printable` must be printed to the peer straight away, or queued whole
+ or not at all, and not be printed while not connected.
+ */
+static void testSendPrintable()
+{
+  printf("  printable objects\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  if (!CHECK(runUntilReady(ble))) {
+    return;
+  }
+
+  Reading reading(42);
+  size_t commandCount = module.commands.size();
+  CHECK(!ble.send(reading));
+  CHECK(reading.printCount == 0);
+  run(ble, 100000);
+  CHECK(module.commands.size() == commandCount);
+
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+  module.sentToPeer.clear();
+  CHECK(ble.send(reading));
+  CHECK(reading.printCount == 1);
+  run(ble, 100000);
+  CHECK(module.sentToPeer == "x=42");
+  CHECK(ble.getStats().bytesSent == 4);
+
+  GroveBLEEmulator bufferedModule;
+  MHGroveBLE buffered(bufferedModule, "Test");
+  uint8_t storage[8];
+  buffered.setTxBuffer(storage, sizeof(storage));
+  if (!CHECK(runUntilConnected(buffered, bufferedModule))) {
+    return;
+  }
+  bufferedModule.sentToPeer.clear();
+  CHECK(buffered.send(reading));
+  CHECK(buffered.getTxBufferFree() == 4);
+  Reading tooLong(12345);
+  CHECK(!buffered.send(tooLong));
+  CHECK(buffered.getTxBufferFree() == 4);
+  run(buffered, 100000);
+  CHECK(bufferedModule.sentToPeer == "x=42");
+}
+
+/** Data queued in the transmit buffer goes out in chunks of 20 bytes, one
+ chunk per interval. `send()` refuses data that doesn't fit, without queueing
+ any of it.
+ */
+static void testTxBufferChunks()
+{
+  printf("  chunks and backpressure\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  uint8_t storage[64];
+  ble.setTxBuffer(storage, sizeof(storage));
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+
+  std::string data;
+  for (int i = 0; i < 50; ++i) {
+    data += (char)('a' + i % 26);
+  }
+  module.sentToPeer.clear();
+  CHECK(ble.send(data.c_str()));
+  CHECK(module.sentToPeer.empty());
+  CHECK(ble.getTxBufferFree() == 14);
+  CHECK(!ble.send("twenty bytes of data"));
+  CHECK(ble.getTxBufferFree() == 14);
+
+  hostAdvance(kLoopPeriod);
+  ble.runOnce();
+  CHECK(module.sentToPeer == data.substr(0, 20));
+  CHECK(ble.send("twenty bytes of data"));
+  CHECK(ble.getTxBufferFree() == 14);
+
+  run(ble, 10000);
+  CHECK(module.sentToPeer.size() == 20);
+  run(ble, 15000);
+  CHECK(module.sentToPeer.size() == 40);
+  run(ble, 100000);
+  CHECK(module.sentToPeer == data + "twenty bytes of data");
+  CHECK(ble.getTxBufferFree() == 64);
+}
+
+/** Text stored in flash is queued like text in RAM. */
+static void testTxBufferFlashText()
+{
+  printf("  text from flash\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  uint8_t storage[32];
+  ble.setTxBuffer(storage, sizeof(storage));
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+
+  module.sentToPeer.clear();
+  CHECK(ble.send(F("Hello from flash, in two chunks")));
+  CHECK(ble.getTxBufferFree() == 1);
+  CHECK(!ble.send(F("No")));
+  run(ble, 100000);
+  CHECK(module.sentToPeer == "Hello from flash, in two chunks");
+}
+
+/** Fill a ring buffer of capacity 8 so that its content starts at `head`
+ and is `length` bytes long: "abcdefgh" cut to `length`.
+ */
+static void fillWrapped(MHRingBuffer & buffer, unsigned int head, unsigned int length)
+{
+  buffer.clear();
+  for (unsigned int i = 0; i < head; ++i) {
+    buffer.push('-');
+  }
+  buffer.removeFirst(head);
+  for (unsigned int i = 0; i < length; ++i) {
+    buffer.push('a' + i);
+  }
+}
+
+/** Content that wraps around the end of the storage must read, match and
+ linearize like content that doesn't, for every position and length.
+ */
+static void testRingBufferWrap()
+{
+  printf("  wrap around and linearize()\n");
+  uint8_t storage[8];
+  MHRingBuffer buffer(storage, sizeof(storage));
+  const std::string text = "abcdefgh";
+
+  for (unsigned int head = 0; head < 8; ++head) {
+    for (unsigned int length = 0; length <= 8; ++length) {
+      fillWrapped(buffer, head, length);
+      std::string content;
+      for (unsigned int i = 0; i < buffer.length(); ++i) {
+        content += (char)buffer[i];
+      }
+      CHECK(content == text.substr(0, length));
+      CHECK(std::string(reinterpret_cast<const char *>(buffer.linearize()), buffer.length())
+        == text.substr(0, length));
+      CHECK(buffer.freeSpace() == 8 - length);
+    }
+  }
+
+  fillWrapped(buffer, 5, 7);
+  CHECK(buffer.startsWith(F("abcd")));
+  CHECK(buffer.endsWith(F("defg")));
+  CHECK(buffer.indexOf(F("cde")) == 2);
+  CHECK(buffer.indexOf(F("gh")) == -1);
+  buffer.removeLast(4);
+  CHECK(buffer.length() == 3);
+  CHECK(buffer.endsWith(F("abc")));
+
+  // Overwriting the oldest byte while wrapped.
+  fillWrapped(buffer, 6, 8);
+  CHECK(buffer.isFull());
+  CHECK(buffer.push('i'));
+  CHECK(std::string(reinterpret_cast<const char *>(buffer.linearize()), buffer.length())
+    == "bcdefghi");
+  CHECK(buffer.length() == 8);
+}
+
+/** Feed the text to a new matcher.
+
+ @return The notifications found, as "C" for connected and "L" for lost
+  followed by the index of the byte that completed them, e.g. "C6 L13 ".
+ */
+static std::string notificationsIn(const std::string & text)
+{
+  MHNotificationMatcher matcher;
+  std::string found;
+  for (size_t i = 0; i < text.size(); ++i) {
+    switch (matcher.feed((uint8_t)text[i])) {
+      case MHNotificationMatcher::Notification::none:
+        continue;
+      case MHNotificationMatcher::Notification::connected:
+        found += "C";
+        break;
+      case MHNotificationMatcher::Notification::lost:
+        found += "L";
+        break;
+    }
+    found += std::to_string(i) + " ";
+  }
+  return found;
+}
+
+/** A partial notification that breaks off must fall back to any notification
+ that starts within it, instead of losing the bytes matched so far.
+ */
+static void testMatcherFallBack()
+{
+  printf("  fall back from partial notifications\n");
+  CHECK(notificationsIn("OK+CONN") == "C6 ");
+  CHECK(notificationsIn("OK+CONNOK+LOST") == "C6 L13 ");
+  CHECK(notificationsIn("OOK+CONN") == "C7 ");
+  CHECK(notificationsIn("OK+OK+CONN") == "C9 ");
+  CHECK(notificationsIn("OKOK+LOST") == "L8 ");
+  CHECK(notificationsIn("OK+COK+LOST") == "L10 ");
+  CHECK(notificationsIn("OK+CONOK+CONN") == "C12 ");
+  CHECK(notificationsIn("OK+LOOK+LOST") == "L11 ");
+  CHECK(notificationsIn("OK+LOSOK+CONN") == "C12 ");
+  CHECK(notificationsIn("OK+CONX OK+LOSX OK+ OK") == "");
+
+  MHNotificationMatcher matcher;
+  const char * text = "xOK+";
+  for (const char * c = text; *c; ++c) {
+    matcher.feed(*c);
+  }
+  CHECK(matcher.matchedLength(MHNotificationMatcher::Notification::connected) == 3);
+  CHECK(matcher.matchedLength(MHNotificationMatcher::Notification::lost) == 3);
+  matcher.feed('C');
+  CHECK(matcher.matchedLength(MHNotificationMatcher::Notification::connected) == 4);
+  CHECK(matcher.matchedLength(MHNotificationMatcher::Notification::lost) == 0);
+  matcher.feed('O');
+  matcher.reset();
+  CHECK(matcher.feed('N') == MHNotificationMatcher::Notification::none);
+  CHECK(matcher.feed('N') == MHNotificationMatcher::Notification::none);
+  CHECK(matcher.matchedLength(MHNotificationMatcher::Notification::connected) == 0);
+}
+
+/** `MHGroveBLEStatic` keeps its buffers in the object: constructing it must
+ not allocate, and the buffers must have the given sizes.
+ */
+static void testStaticBuffers()
+{
+  printf("  buffers inside the object\n");
+  GroveBLEEmulator module;
+  unsigned long allocationsBefore = allocations;
+  MHGroveBLEStatic<32, 40> ble(module, "Test");
+  CHECK(allocations == allocationsBefore);
+  ble.setFraming(MHGroveBLE::Framing::lengthPrefixed);
+  ble.setOnFrameReceived(onFrameReceived);
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+
+  CHECK(ble.getTxBufferFree() == 40);
+  module.sentToPeer.clear();
+  CHECK(ble.send("queued"));
+  CHECK(ble.getTxBufferFree() == 34);
+  run(ble, 100000);
+  CHECK(module.sentToPeer == "queued");
+
+  frames.clear();
+  module.peerSend(std::string("\x21") + std::string(33, 'x'));
+  module.peerSend(std::string("\x20") + std::string(32, 'y'));
+  run(ble, 1000000);
+  CHECK(frames.size() == 1 && frames[0] == std::string(32, 'y'));
+  CHECK(ble.getStats().framesDropped == 1);
+}
+
+/** Without receive buffer memory, as after a failed allocation, the object
+ must fail the initialization instead of writing through a null pointer.
+ */
+static void testMissingRxStorage()
+{
+  printf("  no memory for the receive buffer\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test", nullptr, 128);
+  run(ble, 10000000);
+  CHECK(ble.getState() == MHGroveBLE::State::panicked);
+}
+
+/** Run the object like an application that sleeps until the time returned by
+ `millisUntilNextEvent()` has passed or data has arrived.
+
+ @return The number of `runOnce()` calls.
+ */
+static unsigned long runOnEvents(MHGroveBLE & ble, GroveBLEEmulator & module, unsigned long duration)
+{
+  unsigned long calls = 0;
+  unsigned long long end = hostTime() + duration;
+  while (hostTime() < end) {
+    unsigned long delay = ble.millisUntilNextEvent();
+    unsigned long long wakeUp = delay == MHGroveBLE::kNoDeadline
+      ? end
+      : hostTime() + delay * 1000ULL;
+    while (hostTime() < wakeUp && hostTime() < end && module.available() == 0) {
+      hostAdvance(kLoopPeriod);
+    }
+    if (hostTime() >= end) {
+      break;
+    }
+    ble.runOnce();
+    ++calls;
+  }
+  return calls;
+}
+
+/** An application that only calls `runOnce()` when `millisUntilNextEvent()`
+ says so, or when data has arrived, must work like one that calls it
+ continuously, and sleep most of the time.
+ */
+static void testSleepUntilNextEvent()
+{
+  printf("  sleeping until the next event\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  uint8_t storage[64];
+  ble.setTxBuffer(storage, sizeof(storage));
+  ble.setOnBytesReceived(onBytesReceived);
+  ble.setOnReady(onReady);
+  readyCount = 0;
+  // Polling would take 100000 calls.
+  CHECK(runOnEvents(ble, module, 10000000) < 10000);
+  CHECK(readyCount == 1);
+  CHECK(ble.getState() == MHGroveBLE::State::waitingForConnection);
+  CHECK(ble.millisUntilNextEvent() == MHGroveBLE::kNoDeadline);
+  CHECK(runOnEvents(ble, module, 1000000) == 0);
+
+  module.peerConnect();
+  runOnEvents(ble, module, 1000000);
+  CHECK(ble.getState() == MHGroveBLE::State::connected);
+
+  received.clear();
+  module.peerSend("Hello");
+  CHECK(runOnEvents(ble, module, 1000000) < 100);
+  CHECK(received == "Hello");
+  CHECK(ble.millisUntilNextEvent() == MHGroveBLE::kNoDeadline);
+
+  module.sentToPeer.clear();
+  CHECK(ble.send("forty bytes of data, in two BLE packets"));
+  CHECK(runOnEvents(ble, module, 1000000) < 10);
+  CHECK(module.sentToPeer == "forty bytes of data, in two BLE packets");
+}
+
+/** Whether the command has been sent to the module. */
+static bool wasSent(const GroveBLEEmulator & module, const char * command)
+{
+  for (const std::string & sent : module.commands) {
+    if (sent == command) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/** Each profile must write its row of the table in the documentation of
+ `setProfile`, and keep the module out of the sleep mode.
+ */
+static void testProfileSettings()
+{
+  printf("  profile settings\n");
+  const MHGroveBLE::Profile profiles[] = {
+    MHGroveBLE::Profile::lowLatency,
+    MHGroveBLE::Profile::highThroughput,
+    MHGroveBLE::Profile::lowPower,
+  };
+  const char * expected[][3] = {
+    { "0", "2", "0" },
+    { "3", "3", "2" },
+    { "9", "1", "8" },
+  };
+
+  for (int i = 0; i < 3; ++i) {
+    GroveBLEEmulator module;
+    module.settings["PWRM"] = "0";
+    MHGroveBLE ble(module, "Test");
+    ble.setProfile(profiles[i]);
+    if (!CHECK(runUntilReady(ble))) {
+      continue;
+    }
+    CHECK(module.settings["ADVI"] == expected[i][0]);
+    CHECK(module.settings["POWE"] == expected[i][1]);
+    CHECK(module.settings["COMI"] == expected[i][2]);
+    CHECK(module.settings["PWRM"] == "1");
+  }
+}
+
+/** Without a profile the link settings are left alone. Setup commands run
+ after the profile and override it, and firmware without "AT+COMI" doesn't get
+ one.
+ */
+static void testProfileOverrides()
+{
+  printf("  no profile, setup commands and old firmware\n");
+  {
+    GroveBLEEmulator module;
+    MHGroveBLE ble(module, "Test");
+    CHECK(runUntilReady(ble));
+    CHECK(!wasSent(module, "AT+ADVI0"));
+    CHECK(!wasSent(module, "AT+PWRM1"));
+    CHECK(module.settings.count("ADVI") == 0);
+  }
+  {
+    GroveBLEEmulator module;
+    module.firmwareVersion = 537;
+    MHGroveBLE ble(module, "Test");
+    ble.setProfile(MHGroveBLE::Profile::lowPower);
+    ble.setSetupCommands(F("AT+POWE0"));
+    CHECK(runUntilReady(ble));
+    CHECK(module.settings["ADVI"] == "9");
+    CHECK(module.settings["POWE"] == "0");
+    CHECK(module.settings.count("COMI") == 0);
+  }
+}
+
+/** The commands sent to the module since the first `from` that change a
+ setting, separated by spaces. Queries and "AT" aren't included.
+ */
+static std::string writesSince(const GroveBLEEmulator & module, size_t from)
+{
+  std::string writes;
+  for (size_t i = from; i < module.commands.size(); ++i) {
+    const std::string & command = module.commands[i];
+    if (command == "AT" || command[command.size() - 1] == '?') {
+      continue;
+    }
+    writes += command + " ";
+  }
+  return writes;
+}
+
+/** Fast boot must only write the settings that differ from the ones the
+ module has, and only reset the module if anything was written.
+ */
+static void testFastBootWritesDifferences()
+{
+  printf("  only the settings that differ are written\n");
+  GroveBLEEmulator module;
+  {
+    MHGroveBLE ble(module, "Test");
+    ble.setFastBoot(true);
+    CHECK(runUntilReady(ble));
+    CHECK(writesSince(module, 0) == "AT+NAMETest AT+NOTI1 AT+RESET ");
+  }
+
+  module.restart();
+  size_t commandCount = module.commands.size();
+  {
+    MHGroveBLE ble(module, "Test");
+    ble.setFastBoot(true);
+    CHECK(runUntilReady(ble));
+    CHECK(writesSince(module, commandCount) == "");
+  }
+
+  module.restart();
+  commandCount = module.commands.size();
+  {
+    MHGroveBLE ble(module, "Test");
+    ble.setFastBoot(true);
+    ble.setPIN("123456");
+    CHECK(runUntilReady(ble));
+    CHECK(writesSince(module, commandCount) == "AT+PASS123456 AT+TYPE2 AT+RESET ");
+    CHECK(module.pin == "123456");
+    CHECK(module.name == "Test");
+  }
+}
+
+/** Number of calls of the data dropped handler. */
+static unsigned int droppedCalls;
+/** Sum of the counts passed to the data dropped handler. */
+static size_t droppedTotal;
+
+static void onDataDropped(size_t count)
+{
+  ++droppedCalls;
+  droppedTotal += count;
+}
+
+/** Data that doesn't fit into the receive buffer must overwrite the oldest
+ bytes, and the handler must be called once with their count.
+ */
+static void testDroppedData()
+{
+  printf("  dropped data on overflow\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test", 16);
+  ble.setOnBytesReceived(onBytesReceived);
+  ble.setOnDataDropped(onDataDropped);
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+
+  received.clear();
+  droppedCalls = 0;
+  droppedTotal = 0;
+  std::string data = "abcdefghijklmnopqrstuvwxyz0123456789abcd";
+  module.peerSend(data);
+  hostAdvance(100000);
+  CHECK(module.available() == 40);
+
+  ble.runOnce();
+  CHECK(droppedCalls == 1);
+  CHECK(droppedTotal == 24);
+  CHECK(ble.getStats().bytesDropped == 24);
+  CHECK(received == data.substr(24));
+
+  run(ble, 1000000);
+  CHECK(droppedCalls == 1);
+  CHECK(received == data.substr(24));
+}
+
+/** Data must be passed on as soon as the watermark is reached, and the rest
+ once nothing more arrives.
+ */
+static void testHighWatermark()
+{
+  printf("  high watermark\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  ble.setOnBytesReceived(onBytesReceived);
+  ble.setHighWatermark(8);
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+
+  received.clear();
+  std::string data = "0123456789abcdefghij";
+  unsigned long long end = module.peerSend(data);
+  while (received.empty() && hostTime() < end) {
+    hostAdvance(kLoopPeriod);
+    ble.runOnce();
+  }
+  CHECK(received == "01234567");
+  while (received.size() == 8 && hostTime() < end) {
+    hostAdvance(kLoopPeriod);
+    ble.runOnce();
+  }
+  CHECK(received == "0123456789abcdef");
+
+  run(ble, 1000000);
+  CHECK(received == data);
+  CHECK(ble.getStats().flushesOnWatermark == 2);
+  CHECK(ble.getStats().flushesOnTimeout == 1);
+}
+
+/** With `OverflowPolicy::stopReading`, data that doesn't fit must stay in the
+ stream, and reading must resume once the buffer has been passed on.
+ */
+static void testStopReading()
+{
+  printf("  stop reading while the buffer is full\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test", 16);
+  ble.setOnBytesReceived(onBytesReceived);
+  ble.setOnDataDropped(onDataDropped);
+  ble.setOverflowPolicy(MHGroveBLE::OverflowPolicy::stopReading);
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+
+  received.clear();
+  droppedCalls = 0;
+  std::string data = "abcdefghijklmnopqrstuvwxyz0123456789abcd";
+  module.peerSend(data);
+  hostAdvance(100000);
+
+  ble.runOnce();
+  CHECK(module.available() == 24);
+  CHECK(received == data.substr(0, 16));
+  ble.runOnce();
+  CHECK(module.available() == 8);
+  CHECK(received == data.substr(0, 32));
+
+  run(ble, 1000000);
+  CHECK(received == data);
+  CHECK(droppedCalls == 0);
+  CHECK(ble.getStats().bytesDropped == 0);
+  CHECK(ble.getStats().flushesOnBufferFull == 2);
+}
+
+/** With more input waiting than the byte budget allows, `runOnce()` must
+ read one budget per call and return true until the input is drained.
+ */
+static void testReadBudget()
+{
+  printf("  byte budget per runOnce() call\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  ble.setOnBytesReceived(onBytesReceived);
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+
+  received.clear();
+  ble.setReadBudget(16);
+  std::string data(50, 'x');
+  module.peerSend(data);
+  hostAdvance(100000);
+  CHECK(module.available() == 50);
+
+  CHECK(ble.runOnce());
+  CHECK(module.available() == 34);
+  CHECK(ble.runOnce());
+  CHECK(ble.runOnce());
+  CHECK(module.available() == 2);
+  CHECK(!ble.runOnce());
+  CHECK(module.available() == 0);
+  CHECK(ble.getStats().budgetExhausted == 3);
+  CHECK(ble.getStats().bytesReceived >= 50);
+
+  run(ble, 1000000);
+  CHECK(received == data);
+  CHECK(ble.getStats().budgetExhausted == 3);
+}
+
+/** Emulated module that logs when it's read from, see `moduleLog`. */
+class LoggingEmulator : public GroveBLEEmulator {
+public:
+  LoggingEmulator(char id) : id(id) {}
+
+  int available() override
+  {
+    if (moduleLog.empty() || moduleLog.back() != id) {
+      moduleLog += id;
+    }
+    return GroveBLEEmulator::available();
+  }
+
+  /** The ids of the modules in the order they were read from. Repeated reads
+   from the same module are logged once.
+   */
+  static std::string moduleLog;
+
+private:
+  char id;
+};
+
+std::string LoggingEmulator::moduleLog;
+
+/** What a module of the scheduler test saw, set as its context. */
+struct ScheduledModule {
+  unsigned int readyCount;
+  std::string received;
+};
+
+static void onScheduledReady(MHGroveBLE & ble)
+{
+  ++static_cast<ScheduledModule *>(ble.getContext())->readyCount;
+}
+
+/** Takes a millisecond per record, which uses up the time budget. */
+static void onScheduledBytes(MHGroveBLE & ble, const uint8_t * data, size_t length)
+{
+  static_cast<ScheduledModule *>(ble.getContext())->received.append(
+    reinterpret_cast<const char *>(data), length
+  );
+  hostAdvance(1000);
+}
+
+/** The scheduler must run the modules in turns, stop each one once its
+ budget is used up without starving the other one, and pass the context to the
+ instance handlers.
+ */
+static void testScheduler()
+{
+  printf("  two modules in turns, each with its own budget\n");
+  LoggingEmulator module1('1');
+  LoggingEmulator module2('2');
+  MHGroveBLE ble1(module1, "One");
+  MHGroveBLE ble2(module2, "Two");
+  ScheduledModule left = ScheduledModule();
+  ScheduledModule right = ScheduledModule();
+  MHGroveBLE * modules[] = { &ble1, &ble2 };
+  for (MHGroveBLE * ble : modules) {
+    ble->setOnReady(onScheduledReady);
+    ble->setOnBytesReceived(onScheduledBytes);
+    ble->setDelimiter('\n');
+  }
+  // Replaced by the scheduler's budget.
+  ble1.setReadBudget(1);
+
+  MHGroveBLEScheduler<2> scheduler;
+  CHECK(scheduler.add(ble1, &left));
+  CHECK(scheduler.add(ble2, &right));
+  CHECK(!scheduler.add(ble1));
+  CHECK(scheduler.getCount() == 2);
+  CHECK(&scheduler[1] == &ble2);
+  CHECK(ble2.getContext() == &right);
+  // Without a context, the one set by the application stays.
+  MHGroveBLEScheduler<1> other;
+  CHECK(other.add(ble1));
+  CHECK(ble1.getContext() == &left);
+
+  unsigned long long end = hostTime() + kMaxInitDuration;
+  while (
+    (left.readyCount == 0 || right.readyCount == 0)
+    && hostTime() < end
+  ) {
+    hostAdvance(kLoopPeriod);
+    scheduler.runOnce();
+  }
+  CHECK(left.readyCount == 1);
+  CHECK(right.readyCount == 1);
+
+  module1.peerConnect();
+  module2.peerConnect();
+  for (int i = 0; i < 1000; ++i) {
+    hostAdvance(kLoopPeriod);
+    scheduler.runOnce();
+  }
+  if (
+    !CHECK(ble1.getState() == MHGroveBLE::State::connected)
+    || !CHECK(ble2.getState() == MHGroveBLE::State::connected)
+  ) {
+    return;
+  }
+
+  LoggingEmulator::moduleLog.clear();
+  scheduler.runOnce();
+  std::string first = LoggingEmulator::moduleLog;
+  LoggingEmulator::moduleLog.clear();
+  scheduler.runOnce();
+  std::string second = LoggingEmulator::moduleLog;
+  CHECK(first == "12" || first == "21");
+  CHECK(second == std::string(first.rbegin(), first.rend()));
+
+  // Each record takes 1ms, so with a budget of 1.5ms each module passes on
+  // two of them per call.
+  scheduler.setBudget(1500);
+  module1.peerSend("a\nb\nc\n");
+  module2.peerSend("x\ny\nz\n");
+  hostAdvance(100000);
+  CHECK(scheduler.runOnce());
+  CHECK(left.received == "a\nb\n");
+  CHECK(right.received == "x\ny\n");
+  CHECK(ble1.getStats().budgetExhausted == 1);
+  CHECK(ble2.getStats().budgetExhausted == 1);
+
+  CHECK(!scheduler.runOnce());
+  CHECK(left.received == "a\nb\nc\n");
+  CHECK(right.received == "x\ny\nz\n");
+}
+
+/** A `Print` that appends to a string. */
+class StringPrint : public Print {
+public:
+  size_t write(uint8_t value) override
+  {
+    text += (char)value;
+    return 1;
+  }
+  using Print::write;
+
+  std::string text;
+};
+
+/** Events must record the time, the state and the byte count, and the trace
+ must keep the newest events once it has wrapped around.
+ */
+static void testTraceEvents()
+{
+  printf("  event fields and wrap around\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+
+  // The last transition is the one into the connected state.
+  MHGroveBLE::TraceEvent event;
+  uint8_t connectedState = 0;
+  for (unsigned int i = 0; ble.getTraceEvent(i, event); ++i) {
+    if (event.type == MHGroveBLE::TraceEventType::transition) {
+      connectedState = event.state;
+    }
+  }
+  CHECK(ble.getTraceLength() == 8);
+
+  ble.clearTrace();
+  CHECK(ble.getTraceLength() == 0);
+  CHECK(!ble.getTraceEvent(0, event));
+
+  // The bytes arrive one by one, so each call reads one of them.
+  module.peerSend("abcdefghijkl");
+  std::vector<uint32_t> readTimes;
+  unsigned long long end = hostTime() + 1000000;
+  while (readTimes.size() < 12 && hostTime() < end) {
+    hostAdvance(kLoopPeriod);
+    if (module.available() > 0) {
+      readTimes.push_back((uint32_t)micros());
+    }
+    ble.runOnce();
+  }
+  if (!CHECK(readTimes.size() == 12)) {
+    return;
+  }
+
+  CHECK(ble.getTraceLength() == 8);
+  for (unsigned int i = 0; i < 8; ++i) {
+    CHECK(ble.getTraceEvent(i, event));
+    CHECK(event.type == MHGroveBLE::TraceEventType::bytesRead);
+    CHECK(event.timestamp == readTimes[4 + i]);
+    CHECK(event.state == connectedState);
+    CHECK(event.count == 1);
+  }
+  CHECK(!ble.getTraceEvent(8, event));
+
+  // Once nothing arrived for a while, the data is passed on.
+  run(ble, 100000);
+  CHECK(ble.getTraceLength() == 8);
+  CHECK(ble.getTraceEvent(7, event));
+  CHECK(event.type == MHGroveBLE::TraceEventType::dataDelivered);
+  CHECK(event.count == 12);
+
+  StringPrint output;
+  ble.printTrace(output);
+  std::string firstLine =
+    std::to_string(readTimes[5]) + " 3 " + std::to_string(connectedState) + " 1\n";
+  CHECK(output.text.compare(0, firstLine.size(), firstLine) == 0);
+  CHECK(std::count(output.text.begin(), output.text.end(), '\n') == 8);
+}
+
+/** Debug messages. */
+static std::vector<std::string> debugMessages;
+
+static void onDebug(const char * text)
+{
+  debugMessages.push_back(text);
+}
+
+/** Messages above `MHGROVEBLE_LOG_LEVEL` must not reach the debug handler:
+ the tests are built with `MHGROVEBLE_LOG_INFO`, which leaves out the state
+ transitions.
+ */
+static void testLogLevel()
+{
+  printf("  messages above the log level\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  debugMessages.clear();
+  ble.setDebug(onDebug);
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+
+  bool hasCommand = false;
+  bool hasTransition = false;
+  for (const std::string & message : debugMessages) {
+    hasCommand |= message == "Sending command: AT";
+    hasTransition |= message.find("Transitioning") != std::string::npos;
+  }
+  CHECK(hasCommand);
+  CHECK(!hasTransition);
+}
+
+/** Time the data handler of the histogram test takes, in microseconds. */
+static unsigned long handlerDuration;
+
+static void onSlowBytesReceived(const uint8_t * data, size_t length)
+{
+  onBytesReceived(data, length);
+  hostAdvance(handlerDuration);
+}
+
+/** Receive the first byte of the peer's data, wait `latency` microseconds,
+ and receive the rest.
+
+ @return The number of `runOnce()` calls.
+ */
+static unsigned int receiveWithLatency(
+  MHGroveBLE & ble,
+  GroveBLEEmulator & module,
+  const std::string & data,
+  unsigned long latency
+)
+{
+  unsigned int calls = 0;
+  module.peerSend(data);
+  hostAdvance(kLoopPeriod);
+  while (module.available() == 0) {
+    ble.runOnce();
+    ++calls;
+    hostAdvance(kLoopPeriod);
+  }
+  ble.runOnce();
+  hostAdvance(latency);
+  ble.runOnce();
+  return calls + 2;
+}
+
+/** Durations must land in the bucket of their number of significant bits,
+ longer ones in the last bucket, and `printHistograms` must print them.
+ */
+static void testHistograms()
+{
+  printf("  buckets and printed histograms\n");
+  GroveBLEEmulator module;
+  MHGroveBLE ble(module, "Test");
+  ble.setDelimiter('\n');
+  ble.setOnBytesReceived(onSlowBytesReceived);
+  handlerDuration = 0;
+  if (!CHECK(runUntilConnected(ble, module))) {
+    return;
+  }
+
+  ble.resetStats();
+  received.clear();
+  handlerDuration = 1000;
+  unsigned int calls = receiveWithLatency(ble, module, "a\n", 3000);
+  handlerDuration = 1000000;
+  calls += receiveWithLatency(ble, module, "b\n", 2000);
+  CHECK(received == "a\nb\n");
+
+  // 3000 has 12 significant bits, 2000 has 11.
+  const MHGroveBLE::Histogram & latency = ble.getStats().receiveLatency;
+  CHECK(latency.counts[12] == 1);
+  CHECK(latency.counts[11] == 1);
+  CHECK(latency.maximum == 3000);
+  // 1000 has 10 significant bits, 1000000 is beyond the last bucket. All
+  // other calls take no time on the simulated clock.
+  const MHGroveBLE::Histogram & run = ble.getStats().runDuration;
+  CHECK(run.counts[10] == 1);
+  CHECK(run.counts[19] == 1);
+  CHECK(run.counts[0] == calls - 2);
+  CHECK(run.maximum == 1000000);
+  uint32_t total = 0;
+  for (int i = 0; i < 20; ++i) {
+    total += latency.counts[i];
+  }
+  CHECK(total == 2);
+
+  StringPrint output;
+  ble.printHistograms(output);
+  std::vector<std::string> lines;
+  size_t start = 0;
+  size_t end;
+  while ((end = output.text.find('\n', start)) != std::string::npos) {
+    lines.push_back(output.text.substr(start, end - start));
+    start = end + 1;
+  }
+  if (!CHECK(lines.size() == 21)) {
+    return;
+  }
+  CHECK(lines[0] == "0 0 " + std::to_string(calls - 2));
+  CHECK(lines[1] == "1 0 0");
+  CHECK(lines[10] == "512 0 1");
+  CHECK(lines[11] == "1024 1 0");
+  CHECK(lines[12] == "2048 1 0");
+  CHECK(lines[19] == "262144 0 1");
+  CHECK(lines[20] == "max 3000 1000000");
+}
+
+int main()
+{
+  printf("Ring buffer\n");
+  testRingBufferWrap();
+
+  printf("Notification matcher\n");
+  testMatcherFallBack();
+
+  printf("Command queue\n");
+  testRecoverFromTimedOutCommand();
+  testRecoverFromLastCommand();
+  testRecoverFromInterruptedCommand();
+  testCommandInterruptedMidResponse();
+  testChainCancellation();
+  testChainStepsBackToBack();
+
+  printf("Warm boot\n");
+  testFastBootWritesDifferences();
+  testWarmBootWithNewTargetBaudRate();
+
+  printf("Central role\n");
+  testDataRightAfterConnectingToPeer();
+  testStreamingPeer();
+  testConnectingToMissingPeer();
+  testRecoverFromHungDiscovery();
+
+  printf("Framing\n");
+  testCobsRoundTrip();
+  testCobsTruncatedBlock();
+  testLengthPrefixedFrames();
+  testFramesEndingInLost();
+
+  printf("Receive buffer\n");
+  testDroppedData();
+  testHighWatermark();
+  testStopReading();
+
+  printf("Read budget and scheduler\n");
+  testReadBudget();
+  testScheduler();
+
+  printf("Static buffers\n");
+  testStaticBuffers();
+  testMissingRxStorage();
+
+  printf("Profiles\n");
+  testProfileSettings();
+  testProfileOverrides();
+
+  printf("Event loop\n");
+  testSleepUntilNextEvent();
+
+  printf("Sending\n");
+  testSendBytes();
+  testSendPrintable();
+
+  printf("Transmit buffer\n");
+  testTxBufferChunks();
+  testTxBufferFlashText();
+
+  printf("Debugging\n");
+  testTraceEvents();
+  testLogLevel();
+  testHistograms();
+
+  printf("%u failed checks\n", failures);
+  return failures;
+}
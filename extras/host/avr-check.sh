@@ -0,0 +1,33 @@
+#!/bin/sh
+# Checks that the library compiles for AVR, e.g. an Arduino Uno, where `int`
+# has 16 bits. The native build can't catch that: a constant like `1 << 15`
+# is fine with 32 bit `int` but negative on AVR. The Arduino core is replaced
+# by the declarations in `avr/`, so nothing is linked. Needs avr-g++ and
+# avr-libc; exits with 77 (skipped) if the compiler isn't installed.
+#
+# Usage: ./avr-check.sh [CXX]
+
+set -e
+
+CXX=${1:-${AVR_CXX:-avr-g++}}
+FLAGS="-std=gnu++11 -mmcu=atmega328p -Os -Wall -Wextra -fsyntax-only -Iavr -I../../src"
+SOURCES="../../src/MHGroveBLE.cpp ../../src/MHNotificationMatcher.cpp ../../src/MHRingBuffer.cpp"
+
+if ! command -v "$CXX" > /dev/null 2>&1; then
+  echo "$CXX not found, skipping the AVR check"
+  exit 77
+fi
+
+check() {
+  title=$1
+  shift
+  $CXX $FLAGS "$@" $SOURCES
+  echo "  $title: OK"
+}
+
+check "default"
+check "minimal" -DMHGROVEBLE_LOG_LEVEL=MHGROVEBLE_LOG_NONE -DMHGROVEBLE_PIN=0 \
+  -DMHGROVEBLE_CONNECTION_HANDLERS=0 -DMHGROVEBLE_STRING_HANDLERS=0 \
+  -DMHGROVEBLE_COMMAND_QUEUE_SIZE=0 -DMHGROVEBLE_PEER_CACHE_SIZE=0 \
+  -DMHGROVEBLE_READ_CHUNK_SIZE=0 -DMHGROVEBLE_STATS=0
+check "trace and histograms" -DMHGROVEBLE_TRACE_SIZE=32 -DMHGROVEBLE_HISTOGRAM_SIZE=20
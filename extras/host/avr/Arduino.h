@@ -0,0 +1,158 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+/*
+Declarations of the parts of the Arduino core used by MHGroveBLE, for
+compiling the library for AVR without an Arduino installation, see
+`avr-check.sh` and `footprint.sh`. Nothing is defined, so this is only good
+for syntax checks and for measuring the compiled objects; nothing is linked.
+Unlike the native build, `int` has 16 bits on AVR.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#define DEC 10
+
+class __FlashStringHelper;
+#define F(text) (reinterpret_cast<const __FlashStringHelper *>(PSTR(text)))
+
+unsigned long millis();
+unsigned long micros();
+
+class String {
+public:
+  String(const char * text = "");
+  String(const String & text);
+  String(const __FlashStringHelper * text);
+  explicit String(char value);
+  explicit String(unsigned char value, unsigned char base = DEC);
+  explicit String(int value, unsigned char base = DEC);
+  explicit String(unsigned int value, unsigned char base = DEC);
+  explicit String(long value, unsigned char base = DEC);
+  explicit String(unsigned long value, unsigned char base = DEC);
+  ~String();
+
+  String & operator=(const String & text);
+  String & operator=(const char * text);
+  String & operator=(const __FlashStringHelper * text);
+
+  unsigned char reserve(unsigned int size);
+  unsigned int length() const;
+  const char * c_str() const;
+  char charAt(unsigned int index) const;
+  char operator[](unsigned int index) const;
+  char & operator[](unsigned int index);
+
+  String & operator+=(const String & text);
+  String & operator+=(const char * text);
+  String & operator+=(const __FlashStringHelper * text);
+  String & operator+=(char value);
+  String & operator+=(unsigned char value);
+  String & operator+=(int value);
+  String & operator+=(unsigned int value);
+  String & operator+=(long value);
+  String & operator+=(unsigned long value);
+
+  unsigned char equals(const String & text) const;
+  unsigned char equals(const char * text) const;
+  unsigned char operator==(const String & text) const;
+  unsigned char operator==(const char * text) const;
+  unsigned char operator!=(const String & text) const;
+  unsigned char operator!=(const char * text) const;
+  unsigned char startsWith(const String & prefix) const;
+  unsigned char startsWith(const String & prefix, unsigned int offset) const;
+  unsigned char endsWith(const String & suffix) const;
+  int indexOf(char value) const;
+  int indexOf(char value, unsigned int from) const;
+  int indexOf(const String & text) const;
+  int indexOf(const String & text, unsigned int from) const;
+  String substring(unsigned int from) const;
+  String substring(unsigned int from, unsigned int to) const;
+  long toInt() const;
+};
+
+class Print;
+
+class Printable {
+public:
+  virtual size_t printTo(Print & output) const = 0;
+};
+
+class Print {
+public:
+  virtual size_t write(uint8_t value) = 0;
+  virtual size_t write(const uint8_t * buffer, size_t size);
+  size_t write(const char * text);
+  size_t write(const char * buffer, size_t size);
+  virtual int availableForWrite();
+  virtual void flush();
+
+  size_t print(const __FlashStringHelper * text);
+  size_t print(const String & text);
+  size_t print(const char * text);
+  size_t print(char value);
+  size_t print(unsigned char value, int base = DEC);
+  size_t print(int value, int base = DEC);
+  size_t print(unsigned int value, int base = DEC);
+  size_t print(long value, int base = DEC);
+  size_t print(unsigned long value, int base = DEC);
+  size_t print(double value, int digits = 2);
+  size_t print(const Printable & value);
+
+  size_t println(const __FlashStringHelper * text);
+  size_t println(const String & text);
+  size_t println(const char * text);
+  size_t println(char value);
+  size_t println(unsigned char value, int base = DEC);
+  size_t println(int value, int base = DEC);
+  size_t println(unsigned int value, int base = DEC);
+  size_t println(long value, int base = DEC);
+  size_t println(unsigned long value, int base = DEC);
+  size_t println(double value, int digits = 2);
+  size_t println(const Printable & value);
+  size_t println();
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  void setTimeout(unsigned long timeout);
+  size_t readBytes(char * buffer, size_t length);
+  size_t readBytes(uint8_t * buffer, size_t length);
+};
+
+#endif
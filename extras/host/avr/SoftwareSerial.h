@@ -0,0 +1,54 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+
+#ifndef SOFTWARESERIAL_H
+#define SOFTWARESERIAL_H
+
+/*
+Declaration of the Arduino `SoftwareSerial`, see `Arduino.h`.
+*/
+
+#include "Arduino.h"
+
+class SoftwareSerial : public Stream {
+public:
+  SoftwareSerial(uint8_t receivePin, uint8_t transmitPin, bool inverseLogic = false);
+  void begin(long speed);
+  void end();
+  bool listen();
+  bool isListening();
+
+  virtual size_t write(uint8_t value);
+  virtual int available();
+  virtual int read();
+  virtual int peek();
+  virtual void flush();
+
+  using Print::write;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#!/bin/sh
+# Prints the size of an `MHGroveBLE` object and the size of the library for
+# several configurations of `MHGroveBLEConfig.h`. If avr-g++ is installed, the
+# library is compiled for an ATmega328P (an Arduino Uno, with 2 KB of RAM),
+# against the declarations of the Arduino core in `avr/`, and the sizes are
+# those on AVR. Otherwise it's compiled natively, and the numbers are only good
+# for comparing configurations: pointers take 8 bytes instead of 2 and the code
+# is larger.
+#
+# "flash" is the code and constant data of the library, "RAM" its static
+# variables; both count everything in the library, even functions the linker
+# would drop when the application doesn't call them. Each object takes
+# "sizeof" bytes of RAM on top, plus its receive buffer.
+#
+# Usage: ./footprint.sh [CXX]
+
+set -e
+
+AVR_CXX=${AVR_CXX:-avr-g++}
+if [ -n "$1" ]; then
+  CXX=$1
+elif command -v "$AVR_CXX" > /dev/null 2>&1; then
+  CXX=$AVR_CXX
+else
+  CXX=${CXX:-c++}
+fi
+
+case $($CXX -dumpmachine) in
+  avr*)
+    target="ATmega328P"
+    SIZE=${SIZE:-avr-size}
+    NM=${NM:-avr-nm}
+    FLAGS="-std=gnu++11 -mmcu=atmega328p -Os -ffunction-sections -fdata-sections -Iavr -I../../src"
+    ;;
+  *)
+    target="the host, install avr-g++ for the AVR sizes"
+    SIZE=${SIZE:-size}
+    NM=${NM:-nm}
+    FLAGS="-std=c++11 -Os -ffunction-sections -fdata-sections -DMHGROVEBLE_NATIVE -I. -I../../src"
+    ;;
+esac
+
+SOURCES="../../src/MHGroveBLE.cpp ../../src/MHNotificationMatcher.cpp ../../src/MHRingBuffer.cpp"
+MINIMAL="-DMHGROVEBLE_LOG_LEVEL=MHGROVEBLE_LOG_NONE -DMHGROVEBLE_PIN=0 \
+-DMHGROVEBLE_CONNECTION_HANDLERS=0 -DMHGROVEBLE_STRING_HANDLERS=0 \
+-DMHGROVEBLE_COMMAND_QUEUE_SIZE=0 -DMHGROVEBLE_PEER_CACHE_SIZE=0 \
+-DMHGROVEBLE_READ_CHUNK_SIZE=0 -DMHGROVEBLE_STATS=0"
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+report() {
+  title=$1
+  shift
+  $CXX $FLAGS "$@" -c -o "$dir/footprint.o" Footprint.cpp
+  object=$(printf "%d" "0x$($NM -S "$dir/footprint.o" | awk '$4 == "mhGroveBLEObjectSize" { print $2 }')")
+  rm -f "$dir/footprint.o"
+  for source in $SOURCES; do
+    $CXX $FLAGS "$@" -c -o "$dir/$(basename "$source" .cpp).o" "$source"
+  done
+  # Columns of the total: text, data, bss. Initialized data is stored in flash
+  # and copied to RAM.
+  sizes=$($SIZE -t "$dir"/*.o | tail -n 1)
+  flash=$(echo "$sizes" | awk '{ print $1 + $2 }')
+  ram=$(echo "$sizes" | awk '{ print $2 + $3 }')
+  printf "  %-40s %6s bytes %8s bytes %6s bytes\n" "$title" "$object" "$flash" "$ram"
+  rm -f "$dir"/*.o
+}
+
+echo "Compiled for $target"
+printf "  %-40s %12s %14s %12s\n" "Configuration" "sizeof" "flash" "RAM"
+report "default"
+report "MHGROVEBLE_LOG_NONE" -DMHGROVEBLE_LOG_LEVEL=MHGROVEBLE_LOG_NONE
+report "MHGROVEBLE_LOG_ERROR" -DMHGROVEBLE_LOG_LEVEL=MHGROVEBLE_LOG_ERROR
+report "MHGROVEBLE_PIN=0" -DMHGROVEBLE_PIN=0
+report "MHGROVEBLE_CONNECTION_HANDLERS=0" -DMHGROVEBLE_CONNECTION_HANDLERS=0
+report "MHGROVEBLE_STRING_HANDLERS=0" -DMHGROVEBLE_STRING_HANDLERS=0
+report "MHGROVEBLE_COMMAND_QUEUE_SIZE=0" -DMHGROVEBLE_COMMAND_QUEUE_SIZE=0
+report "MHGROVEBLE_PEER_CACHE_SIZE=0" -DMHGROVEBLE_PEER_CACHE_SIZE=0
+report "MHGROVEBLE_READ_CHUNK_SIZE=0" -DMHGROVEBLE_READ_CHUNK_SIZE=0
+report "MHGROVEBLE_STATS=0" -DMHGROVEBLE_STATS=0
+report "MHGROVEBLE_TRACE_SIZE=32" -DMHGROVEBLE_TRACE_SIZE=32
+report "MHGROVEBLE_HISTOGRAM_SIZE=20" -DMHGROVEBLE_HISTOGRAM_SIZE=20
+report "minimal, all features above off" $MINIMAL
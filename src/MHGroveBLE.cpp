@@ -24,6 +24,18 @@ SOFTWARE.
 
 #include "MHGroveBLE.h"
 
+#if MHGROVEBLE_TRACE_SIZE > 0
+#define MHGROVEBLE_TRACE(type, count) trace(TraceEventType::type, count)
+#else
+#define MHGROVEBLE_TRACE(type, count)
+#endif
+
+#if MHGROVEBLE_STATS > 0
+#define MHGROVEBLE_COUNT(counter, value) (stats.counter += (value))
+#else
+#define MHGROVEBLE_COUNT(counter, value) ((void)(value))
+#endif
+
 /*
 Some notes about the Seeed Grove BLE:
 
@@ -45,15 +57,92 @@ static const unsigned long kWaitForDeviceTimeout = 5000;
  reached, resend the "AT" command.
  */
 static const unsigned long kWaitForDeviceRetryTimeout = 500;
+/** Like `kWaitForDeviceRetryTimeout`, for `recover()`: the device has
+ already booted, so it's expected to respond right away.
+ */
+static const unsigned long kRecoveryRetryTimeout = 50;
+/** Central role: time to wait for the result of a connection attempt. */
+static const unsigned long kConnectTimeout = 10000;
+/** Central role: time to wait for the end of a discovery. */
+static const unsigned long kDiscoveryTimeout = 15000;
+/** Central role: time between failed connection attempts. */
+static const unsigned long kConnectRetryDelay = 1000;
 /** Timeout for reads while in the connected state. */
 static const unsigned long kConnectedReadTimeout = 50;
+/** Time without data after "OK+LOST" inside an unfinished frame after which
+ it's taken as the end of the connection, which cut the frame off.
+ */
+static const unsigned long kFrameLostTimeout = 1000;
+/** Number of bytes sent at once from the transmit buffer. This is the
+ payload size of a BLE packet.
+ */
+static const uint8_t kTxChunkSize = 20;
+/** Default time between two chunks sent from the transmit buffer. */
+static const unsigned long kDefaultTxInterval = 20;
+/** If the baud rate is known: number of character times without data after
+ which a response is considered complete.
+ */
+static const unsigned long kResponseIdleCharacters = 4;
+/** Baud rate of the module after a renew. */
+static const unsigned long kFactoryBaudRate = 9600;
+/** Supported baud rates. The index is the parameter for "AT+BAUD". */
+static const uint32_t kBaudRates[] PROGMEM = {
+  9600, 19200, 38400, 57600, 115200
+};
+static const uint8_t kBaudRateCount = sizeof(kBaudRates) / sizeof(kBaudRates[0]);
+/** The parameters for "AT+BAUD", as strings. */
+static const char kBaudRateParameters[][2] = { "0", "1", "2", "3", "4" };
+
+/** Bits in `instanceHandlers`. */
+enum {
+  kHandlerReady = 1,
+  kHandlerPanic = 2,
+  kHandlerConnect = 4,
+  kHandlerDisconnect = 8,
+  kHandlerDataReceived = 16,
+  kHandlerBytesReceived = 32,
+  kHandlerFrameReceived = 64,
+  kHandlerDataDropped = 128,
+};
+
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+/** Values of `connectProgress`: how far a connection attempt in the central
+ role has got. The module answers "OK+CONNA" (for "AT+CON<address>") or
+ "OK+CONNL" (for "AT+CONNL") while it's connecting, followed by "OK+CONN" once
+ connected or "OK+CONNF" if that failed. "OK+CONNE", "OK+CONNF" and "OK+CONNN"
+ right away mean failure as well.
+ */
+enum {
+  /** Waiting for the response to the command. */
+  kConnectSent,
+  /** The response started with "OK+CONN", the next byte is the status. */
+  kConnectResponse,
+  /** The module is connecting, waiting for "OK+CONN". */
+  kConnectConnecting,
+  /** "OK+CONN" arrived while connecting. Unless "F" follows, the module is
+   connected and the byte has been sent by the peer.
+   */
+  kConnectNotified,
+  /** "OK+CONNF" arrived while connecting. It's only taken as a failure once
+   nothing followed it for `responseIdleTimeout`, as the peer may have sent the
+   "F".
+   */
+  kConnectFailPending,
+};
+#endif
 
 /** Internal state. */
 enum class MHGroveBLE::InternalState {
   /** Initial state. */
   startup,
-  /** Send "AT" periodically and wait until the device responds. */
+  /** Send "AT" periodically and wait until the device responds. If the baud
+   rate can be changed, try the supported baud rates in turn.
+   */
   waitForDeviceAfterStartup,
+  /** With a fingerprint storage: get the firmware version and complete the
+   initialization right away if the fingerprint matches.
+   */
+  checkFingerprint,
   /** Reset all settings to their factory defaults. */
   renew,
   /** After "renew" was sent, we need to give the device half a second to apply
@@ -62,8 +151,32 @@ enum class MHGroveBLE::InternalState {
    a query).
    */
   waitAfterRenew,
-  /** Get the firmware version. */
+  /** If the baud rate is not the factory default, find the baud rate that the
+   device is using after the renew.
+   */
+  waitForDeviceAfterRenew,
+  /** Get the firmware version, unless `checkFingerprint` did. */
   getFirmwareVersion,
+  /** Fast boot: query the Bluetooth name. */
+  queryName,
+  /** Fast boot: query the Bluetooth pin. */
+  queryPIN,
+  /** Fast boot: query the authentication type. */
+  queryPINAuth,
+  /** Fast boot: query whether we get notified about connections. */
+  queryNotification,
+  /** Fast boot: query the advertising interval (if a profile is set). */
+  queryAdvertisingInterval,
+  /** Fast boot: query the transmit power (if a profile is set). */
+  queryTransmitPower,
+  /** Fast boot: query the power mode (if a profile is set). */
+  queryPowerMode,
+  /** Fast boot: query the connection interval (if a profile is set). */
+  queryConnectionInterval,
+  /** Fast boot: query whether the module is a central. */
+  queryRole,
+  /** Fast boot: query whether the module only acts on AT commands. */
+  queryMode,
   /** Set the Bluetooth name. */
   setName,
   /** Set the Bluetooth pin. */
@@ -72,6 +185,24 @@ enum class MHGroveBLE::InternalState {
   setPINAuth,
   /** Set that we want to be notified about connections. */
   setNotification,
+  /** Set the advertising interval of the profile. */
+  setAdvertisingInterval,
+  /** Set the transmit power of the profile. */
+  setTransmitPower,
+  /** Disable the automatic sleep mode. */
+  setPowerMode,
+  /** Set the connection interval of the profile. */
+  setConnectionInterval,
+  /** Set the role (if central or in fast boot mode). */
+  setRole,
+  /** Set whether the module only acts on AT commands: a central must not
+   connect on its own.
+   */
+  setMode,
+  /** Send the commands set with `setSetupCommands`. */
+  sendSetupCommands,
+  /** Set the baud rate that is used after the reset. */
+  switchBaudRate,
   /** Reset after setting the device up. */
   reset,
   /** Send "AT" periodically and wait until the device responds. */
@@ -79,8 +210,19 @@ enum class MHGroveBLE::InternalState {
   /** Initialization is done, inform the handler. */
   initializationComplete,
 
+  /** `recover()`: send "AT" periodically and wait until the device responds.
+   Must come right before `waitingForConnection`.
+   */
+  recovering,
+
   /** Waiting for a connection. */
   waitingForConnection,
+  /** Waiting for the response to a command queued with `enqueueCommand`. */
+  runningCommand,
+  /** Central role: connecting to the known or the last peer. */
+  connectingToPeer,
+  /** Central role: waiting for the end of a discovery. */
+  discoveringPeers,
   /** A peer has connected. */
   connected,
 
@@ -100,6 +242,383 @@ enum class MHGroveBLE::ResponseState {
   success
 };
 
+/** Settings that may need to be written, for `pendingSettings`. */
+enum : uint8_t {
+  kSettingName = 1 << 0,
+  kSettingPIN = 1 << 1,
+  kSettingPINAuth = 1 << 2,
+  kSettingNotification = 1 << 3,
+  kSettingBaudRate = 1 << 4,
+  kSettingSetupCommands = 1 << 5,
+  /** The link settings of the profile set with `setProfile`. */
+  kSettingProfile = 1 << 6,
+  /** The role and the mode ("AT+IMME") that goes with it. */
+  kSettingRole = 1 << 7,
+  /** The settings that are always written after a renew. */
+  kSettingAll =
+    kSettingName | kSettingPIN | kSettingPINAuth | kSettingNotification | kSettingProfile
+    | kSettingRole
+};
+
+/** How an initialization step is executed, for `InitStep::kind`. */
+enum : uint8_t {
+  /** Nothing to do. */
+  kStepNone,
+  /** Send "AT" periodically until the device responds. */
+  kStepWaitForDevice,
+  /** Wait for `timeout` milliseconds. */
+  kStepDelay,
+  /** Send the command and wait for the response. Marks `setting` as
+   pending.
+   */
+  kStepCommand,
+  /** Like `kStepCommand`, but only if `setting` is pending. */
+  kStepWrite,
+  /** Send a query. Marks `setting` as pending unless the expected response
+   is received.
+   */
+  kStepQuery,
+  /** Query the firmware version and parse the response. */
+  kStepFirmwareVersion,
+  /** Like `kStepCommand`, but go on even if the device doesn't respond. */
+  kStepReset,
+  /** Send the commands set with `setSetupCommands`, one after another. */
+  kStepSetupCommands,
+  /** Inform the handler that the initialization is complete. */
+  kStepComplete,
+};
+
+/** Conditions for running an initialization step, for `InitStep::flags`.
+ A step is skipped unless all of its conditions are met.
+ */
+enum : uint16_t {
+  kRunIfFastBoot = 1u << 0,
+  kRunIfNotFastBoot = 1u << 1,
+  kRunIfPIN = 1u << 2,
+  kRunIfPINOrFastBoot = 1u << 3,
+  /** The firmware supports "AT+TYPE". */
+  kRunIfFirmware515 = 1u << 4,
+  /** The baud rate may have changed to the factory default. */
+  kRunIfBaudRateLost = 1u << 5,
+  /** The module needs to be switched to the target baud rate. */
+  kRunIfBaudRateSwitch = 1u << 6,
+  kRunIfPendingSettings = 1u << 7,
+  kRunIfSetupCommands = 1u << 8,
+  /** A profile other than `Profile::none` is set. */
+  kRunIfProfile = 1u << 9,
+  /** The firmware supports "AT+COMI". */
+  kRunIfFirmware538 = 1u << 10,
+  kRunIfCentralOrFastBoot = 1u << 11,
+  /** A fingerprint storage is set. */
+  kRunIfFingerprint = 1u << 12,
+  kRunIfNoFingerprint = 1u << 13,
+  /** Not a condition: switch to the factory baud rate before running the
+   step, and don't try any other while waiting for the device.
+   */
+  kApplyFactoryBaudRate = 1u << 14,
+  /** Not a condition: switch to the target baud rate before running the step,
+   if the module has been told to use it.
+   */
+  kApplyTargetBaudRate = 1u << 15,
+};
+
+/** Strings appended to commands or expected in responses, for
+ `InitStep::commandArgument` and `InitStep::responseArgument`.
+ */
+enum : uint8_t {
+  kArgumentNone,
+  kArgumentName,
+  kArgumentPIN,
+  /** "2" if a PIN is set, "0" otherwise. */
+  kArgumentPINAuth,
+  /** The parameter of "AT+BAUD" for the target baud rate. */
+  kArgumentBaudRate,
+  /** The parameter of "AT+ADVI" for the profile. */
+  kArgumentAdvertisingInterval,
+  /** The parameter of "AT+POWE" for the profile. */
+  kArgumentTransmitPower,
+  /** The parameter of "AT+COMI" for the profile. */
+  kArgumentConnectionInterval,
+  /** "1" in the central role, "0" otherwise. Also the parameter of
+   "AT+IMME".
+   */
+  kArgumentRole,
+};
+
+/** The parameters for "AT+ADVI", "AT+POWE" and "AT+COMI", one row per
+ profile in the order of the `Profile` enum, starting with
+ `Profile::lowLatency`.
+ */
+static const char kProfileParameters[][3][2] = {
+  // lowLatency: 100ms, 0dBm, 7.5ms. The shortest advertising interval, so a
+  // central finds the module quickly, and the shortest connection interval,
+  // so each message waits as little as possible for the next connection
+  // event.
+  { "0", "2", "0" },
+  // highThroughput: 318.75ms, 6dBm, 15ms. How fast a connection is set up
+  // doesn't matter for a transfer, so advertising is slower. The highest
+  // power avoids retransmissions. 15ms is the shortest connection interval
+  // that phones accept (iOS rejects 7.5ms and falls back to its own, longer
+  // default), and it leaves room for several packets per connection event.
+  { "3", "3", "2" },
+  // lowPower: 1285ms, -6dBm, 45ms. The longest advertising interval, and the
+  // longest connection interval short of the 4s setting, which many centrals
+  // refuse. The reduced power still reaches across a room.
+  { "9", "1", "8" },
+};
+
+/** An entry of the initialization sequence. */
+struct InitStep {
+  /** The command, or null. */
+  PGM_P command;
+  /** The start of the expected response, or null. */
+  PGM_P responsePrefix;
+  /** Conditions for running the step. */
+  uint16_t flags;
+  /** Timeout in milliseconds. */
+  uint16_t timeout;
+  /** How the step is executed. */
+  uint8_t kind;
+  /** Appended to the command. */
+  uint8_t commandArgument;
+  /** Expected after `responsePrefix`. */
+  uint8_t responseArgument;
+  /** Number of arbitrary characters at the end of the response. */
+  uint8_t responseExtraLength;
+  /** The setting handled by the step, if any. */
+  uint8_t setting;
+};
+
+static const char kCommandAT[] PROGMEM = "AT";
+static const char kCommandRenew[] PROGMEM = "AT+RENEW";
+static const char kCommandQueryVersion[] PROGMEM = "AT+VERS?";
+static const char kCommandQueryName[] PROGMEM = "AT+NAME?";
+static const char kCommandQueryPIN[] PROGMEM = "AT+PASS?";
+static const char kCommandQueryPINAuth[] PROGMEM = "AT+TYPE?";
+static const char kCommandQueryNotification[] PROGMEM = "AT+NOTI?";
+static const char kCommandName[] PROGMEM = "AT+NAME";
+static const char kCommandPIN[] PROGMEM = "AT+PASS";
+static const char kCommandPINAuth[] PROGMEM = "AT+TYPE";
+static const char kCommandNotification[] PROGMEM = "AT+NOTI1";
+static const char kCommandQueryAdvertisingInterval[] PROGMEM = "AT+ADVI?";
+static const char kCommandQueryTransmitPower[] PROGMEM = "AT+POWE?";
+static const char kCommandQueryPowerMode[] PROGMEM = "AT+PWRM?";
+static const char kCommandQueryConnectionInterval[] PROGMEM = "AT+COMI?";
+static const char kCommandAdvertisingInterval[] PROGMEM = "AT+ADVI";
+static const char kCommandTransmitPower[] PROGMEM = "AT+POWE";
+static const char kCommandPowerMode[] PROGMEM = "AT+PWRM1";
+static const char kCommandConnectionInterval[] PROGMEM = "AT+COMI";
+static const char kCommandQueryRole[] PROGMEM = "AT+ROLE?";
+static const char kCommandQueryMode[] PROGMEM = "AT+IMME?";
+static const char kCommandRole[] PROGMEM = "AT+ROLE";
+static const char kCommandMode[] PROGMEM = "AT+IMME";
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+static const char kCommandConnect[] PROGMEM = "AT+CON";
+static const char kCommandConnectLast[] PROGMEM = "AT+CONNL";
+static const char kCommandDiscover[] PROGMEM = "AT+DISC?";
+static const char kResponseDiscovery[] PROGMEM = "OK+DIS";
+#endif
+static const char kCommandBaudRate[] PROGMEM = "AT+BAUD";
+static const char kCommandReset[] PROGMEM = "AT+RESET";
+static const char kResponseOK[] PROGMEM = "OK";
+static const char kResponseRenew[] PROGMEM = "OK+RENEW";
+static const char kResponseVersion[] PROGMEM = "HMSoft V";
+static const char kResponseName[] PROGMEM = "OK+NAME:";
+static const char kResponseGet[] PROGMEM = "OK+Get:";
+static const char kResponseGetNotification[] PROGMEM = "OK+Get:1";
+static const char kResponseSet[] PROGMEM = "OK+Set:";
+static const char kResponseSetNotification[] PROGMEM = "OK+Set:1";
+static const char kResponseGetPowerMode[] PROGMEM = "OK+Get:1";
+static const char kResponseSetPowerMode[] PROGMEM = "OK+Set:1";
+static const char kResponseReset[] PROGMEM = "OK+RESET";
+
+/** The initialization sequence, one entry per initialization state in the
+ order of the `InternalState` enum. The steps are executed in order, skipping
+ those whose conditions aren't met.
+ */
+static const InitStep kInitSteps[] PROGMEM = {
+  // startup
+  { nullptr, nullptr, 0, 0, kStepNone, kArgumentNone, kArgumentNone, 0, 0 },
+  // waitForDeviceAfterStartup
+  { kCommandAT, kResponseOK, 0, kWaitForDeviceTimeout,
+    kStepWaitForDevice, kArgumentNone, kArgumentNone, 0, 0 },
+  // checkFingerprint: before the renew, which would undo the configuration.
+  { kCommandQueryVersion, kResponseVersion, kRunIfFingerprint, kGenericCommandTimeout,
+    kStepFirmwareVersion, kArgumentNone, kArgumentNone, 3, 0 },
+  // renew
+  { kCommandRenew, kResponseRenew, kRunIfNotFastBoot, kGenericCommandTimeout,
+    kStepCommand, kArgumentNone, kArgumentNone, 0, 0 },
+  // waitAfterRenew: documentation says that we should wait for 500ms after
+  // "AT+RENEW", but that's too short: communication wasn't stable with this
+  // delay. Even 600ms didn't work, while 750ms did work. Let's stay on the
+  // safe side and grant the device a full second.
+  { nullptr, nullptr, kRunIfNotFastBoot, 1000,
+    kStepDelay, kArgumentNone, kArgumentNone, 0, 0 },
+  // waitForDeviceAfterRenew: the module is back at the factory baud rate.
+  { kCommandAT, kResponseOK, kRunIfNotFastBoot | kRunIfBaudRateLost | kApplyFactoryBaudRate,
+    kWaitForDeviceTimeout,
+    kStepWaitForDevice, kArgumentNone, kArgumentNone, 0, 0 },
+  // getFirmwareVersion: the response is something like "HMSoft V540".
+  { kCommandQueryVersion, kResponseVersion, kRunIfNoFingerprint, kGenericCommandTimeout,
+    kStepFirmwareVersion, kArgumentNone, kArgumentNone, 3, 0 },
+  // queryName
+  { kCommandQueryName, kResponseName, kRunIfFastBoot, kGenericCommandTimeout,
+    kStepQuery, kArgumentNone, kArgumentName, 0, kSettingName },
+  // queryPIN: without a PIN, the PIN itself doesn't matter as it's not
+  // required.
+  { kCommandQueryPIN, kResponseGet, kRunIfFastBoot | kRunIfPIN, kGenericCommandTimeout,
+    kStepQuery, kArgumentNone, kArgumentPIN, 0, kSettingPIN },
+  // queryPINAuth
+  { kCommandQueryPINAuth, kResponseGet, kRunIfFastBoot | kRunIfFirmware515, kGenericCommandTimeout,
+    kStepQuery, kArgumentNone, kArgumentPINAuth, 0, kSettingPINAuth },
+  // queryNotification
+  { kCommandQueryNotification, kResponseGetNotification, kRunIfFastBoot, kGenericCommandTimeout,
+    kStepQuery, kArgumentNone, kArgumentNone, 0, kSettingNotification },
+  // queryAdvertisingInterval
+  { kCommandQueryAdvertisingInterval, kResponseGet, kRunIfFastBoot | kRunIfProfile,
+    kGenericCommandTimeout,
+    kStepQuery, kArgumentNone, kArgumentAdvertisingInterval, 0, kSettingProfile },
+  // queryTransmitPower
+  { kCommandQueryTransmitPower, kResponseGet, kRunIfFastBoot | kRunIfProfile,
+    kGenericCommandTimeout,
+    kStepQuery, kArgumentNone, kArgumentTransmitPower, 0, kSettingProfile },
+  // queryPowerMode
+  { kCommandQueryPowerMode, kResponseGetPowerMode, kRunIfFastBoot | kRunIfProfile,
+    kGenericCommandTimeout,
+    kStepQuery, kArgumentNone, kArgumentNone, 0, kSettingProfile },
+  // queryConnectionInterval
+  { kCommandQueryConnectionInterval, kResponseGet,
+    kRunIfFastBoot | kRunIfProfile | kRunIfFirmware538, kGenericCommandTimeout,
+    kStepQuery, kArgumentNone, kArgumentConnectionInterval, 0, kSettingProfile },
+  // queryRole
+  { kCommandQueryRole, kResponseGet, kRunIfFastBoot, kGenericCommandTimeout,
+    kStepQuery, kArgumentNone, kArgumentRole, 0, kSettingRole },
+  // queryMode
+  { kCommandQueryMode, kResponseGet, kRunIfFastBoot, kGenericCommandTimeout,
+    kStepQuery, kArgumentNone, kArgumentRole, 0, kSettingRole },
+  // setName
+  { kCommandName, kResponseSet, 0, kGenericCommandTimeout,
+    kStepWrite, kArgumentName, kArgumentName, 0, kSettingName },
+  // setPIN
+  { kCommandPIN, kResponseSet, kRunIfPIN, kGenericCommandTimeout,
+    kStepWrite, kArgumentPIN, kArgumentPIN, 0, kSettingPIN },
+  // setPINAuth: the documentation explicitly says not to issue this command if
+  // the firmware version is less than 515. After a renew, the device doesn't
+  // require a PIN. In fast boot mode, we may need to turn off the
+  // authentication if a PIN was required before.
+  { kCommandPINAuth, kResponseSet, kRunIfPINOrFastBoot | kRunIfFirmware515, kGenericCommandTimeout,
+    kStepWrite, kArgumentPINAuth, kArgumentPINAuth, 0, kSettingPINAuth },
+  // setNotification
+  { kCommandNotification, kResponseSetNotification, 0, kGenericCommandTimeout,
+    kStepWrite, kArgumentNone, kArgumentNone, 0, kSettingNotification },
+  // setAdvertisingInterval
+  { kCommandAdvertisingInterval, kResponseSet, kRunIfProfile, kGenericCommandTimeout,
+    kStepWrite, kArgumentAdvertisingInterval, kArgumentAdvertisingInterval, 0, kSettingProfile },
+  // setTransmitPower
+  { kCommandTransmitPower, kResponseSet, kRunIfProfile, kGenericCommandTimeout,
+    kStepWrite, kArgumentTransmitPower, kArgumentTransmitPower, 0, kSettingProfile },
+  // setPowerMode: never "AT+PWRM0", a sleeping module doesn't respond to AT
+  // commands. Written with every profile in case the module was left in the
+  // sleep mode.
+  { kCommandPowerMode, kResponseSetPowerMode, kRunIfProfile, kGenericCommandTimeout,
+    kStepWrite, kArgumentNone, kArgumentNone, 0, kSettingProfile },
+  // setConnectionInterval
+  { kCommandConnectionInterval, kResponseSet, kRunIfProfile | kRunIfFirmware538,
+    kGenericCommandTimeout,
+    kStepWrite, kArgumentConnectionInterval, kArgumentConnectionInterval, 0, kSettingProfile },
+  // setRole: after a renew, the module is a peripheral.
+  { kCommandRole, kResponseSet, kRunIfCentralOrFastBoot, kGenericCommandTimeout,
+    kStepWrite, kArgumentRole, kArgumentRole, 0, kSettingRole },
+  // setMode: a central only acts on AT commands, so it doesn't connect or
+  // discover on its own after the reset. A peripheral must not wait for
+  // "AT+START" before advertising.
+  { kCommandMode, kResponseSet, kRunIfCentralOrFastBoot, kGenericCommandTimeout,
+    kStepWrite, kArgumentRole, kArgumentRole, 0, kSettingRole },
+  // sendSetupCommands
+  { nullptr, nullptr, kRunIfSetupCommands, kGenericCommandTimeout,
+    kStepSetupCommands, kArgumentNone, kArgumentNone, 0, kSettingSetupCommands },
+  // switchBaudRate: sets the baud rate that is used after the reset.
+  { kCommandBaudRate, kResponseSet, kRunIfBaudRateSwitch, kGenericCommandTimeout,
+    kStepCommand, kArgumentBaudRate, kArgumentBaudRate, 0, kSettingBaudRate },
+  // reset: no need to reset if the device is already configured correctly.
+  { kCommandReset, kResponseReset, kRunIfPendingSettings, kGenericCommandTimeout,
+    kStepReset, kArgumentNone, kArgumentNone, 0, 0 },
+  // waitForDeviceAfterReset: a new baud rate is used after the reset.
+  { kCommandAT, kResponseOK, kRunIfPendingSettings | kApplyTargetBaudRate, kWaitForDeviceTimeout,
+    kStepWaitForDevice, kArgumentNone, kArgumentNone, 0, 0 },
+  // initializationComplete
+  { nullptr, nullptr, 0, 0, kStepComplete, kArgumentNone, kArgumentNone, 0, 0 },
+};
+
+#if MHGROVEBLE_LOG_LEVEL >= MHGROVEBLE_LOG_INFO
+static const char kLogSendingCommand[] PROGMEM = "Sending command: ";
+/** Maximum number of command characters in the log. */
+static const size_t kLogCommandLength = 40;
+
+/** Internal helper: copy part of a command from flash or RAM into `text`,
+ truncated to `space` characters.
+
+ @return The number of characters copied.
+ */
+static size_t copyCommandPart(
+  char * text,
+  size_t space,
+  const char * part,
+  size_t length,
+  bool isFlash
+)
+{
+  if (length > space) {
+    length = space;
+  }
+  if (length == 0) {
+    // `part` may be null, e.g. a command without argument.
+    return 0;
+  }
+  if (isFlash) {
+    memcpy_P(text, part, length);
+  } else {
+    memcpy(text, part, length);
+  }
+  return length;
+}
+#endif
+
+#if MHGROVEBLE_LOG_LEVEL >= MHGROVEBLE_LOG_ERROR
+static const char kLogPanic[] PROGMEM = "Panic!";
+#endif
+
+namespace {
+
+/** Internal helper: a `Print` that only counts the bytes written to it. */
+class CountingPrint : public Print {
+public:
+  size_t count = 0;
+
+  size_t write(uint8_t) override
+  {
+    ++count;
+    return 1;
+  }
+};
+
+/** Internal helper: a `Print` that appends to a ring buffer. */
+class RingBufferPrint : public Print {
+public:
+  explicit RingBufferPrint(MHRingBuffer & buffer) : buffer(buffer) {}
+
+  size_t write(uint8_t value) override
+  {
+    buffer.push(value);
+    return 1;
+  }
+
+private:
+  MHRingBuffer & buffer;
+};
+
+}
+
 /** Internal helper: calculate whether a timeout occurred.
 
  Handles `millies()` overflow.
@@ -109,304 +628,2017 @@ static bool isTimeout(unsigned long now, unsigned long referenceTime, unsigned l
   return (now - referenceTime) >= duration;
 }
 
+/** Internal helper: calculate the time until a timeout occurs.
+
+ Handles `millies()` overflow.
+ */
+static unsigned long timeUntilTimeout(
+  unsigned long now,
+  unsigned long referenceTime,
+  unsigned long duration
+)
+{
+  unsigned long elapsed = now - referenceTime;
+  return elapsed >= duration ? 0 : duration - elapsed;
+}
+
+/** Internal helper: get the index of the baud rate in `kBaudRates`.
+
+ @return The index, or -1 if the baud rate is not supported.
+ */
+static int baudRateIndex(unsigned long baud)
+{
+  for (uint8_t i = 0; i < kBaudRateCount; ++i) {
+    if (pgm_read_dword(&kBaudRates[i]) == baud) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static const uint32_t kFnvOffsetBasis = 2166136261UL;
+static const uint32_t kFnvPrime = 16777619UL;
+
+/** Internal helper: add a byte to an FNV-1a hash. */
+static uint32_t hashByte(uint32_t hash, uint8_t byte)
+{
+  return (hash ^ byte) * kFnvPrime;
+}
+
+/** Internal helper: add a value to an FNV-1a hash, least significant byte
+ first.
+ */
+static uint32_t hashValue(uint32_t hash, uint32_t value)
+{
+  for (uint8_t i = 0; i < 4; ++i) {
+    hash = hashByte(hash, value & 0xFF);
+    value >>= 8;
+  }
+  return hash;
+}
+
+/** Internal helper: add a string to an FNV-1a hash, including the terminating
+ null character so that consecutive strings can't run into each other. A null
+ pointer is hashed like an empty string.
+ */
+static uint32_t hashString(uint32_t hash, const char * string, bool isFlash)
+{
+  if (string) {
+    for (;; ++string) {
+      uint8_t c = isFlash ? pgm_read_byte(string) : *string;
+      if (!c) {
+        break;
+      }
+      hash = hashByte(hash, c);
+    }
+  }
+  return hashByte(hash, 0);
+}
+
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0
+/** Internal helper: add a duration to a histogram. */
+static void recordDuration(MHGroveBLE::Histogram & histogram, unsigned long duration)
+{
+  // The bucket is the number of significant bits.
+  uint8_t bucket = 0;
+  while (bucket < MHGROVEBLE_HISTOGRAM_SIZE - 1 && (duration >> bucket) > 0) {
+    ++bucket;
+  }
+  ++histogram.counts[bucket];
+  if (duration > histogram.maximum) {
+    histogram.maximum = duration;
+  }
+}
+#endif
+
+/** Internal helper: check whether `buffer` consists of exactly `prefix`
+ followed by `value` (if not null) and `extraLength` arbitrary characters.
+ */
+static bool isResponse(
+  const MHRingBuffer & buffer,
+  const __FlashStringHelper * prefix,
+  const char * value,
+  uint8_t extraLength
+)
+{
+  unsigned int prefixLength = strlen_P(reinterpret_cast<PGM_P>(prefix));
+  unsigned int valueLength = value ? strlen(value) : 0;
+
+  if (
+    buffer.length() != prefixLength + valueLength + extraLength
+    || !buffer.startsWith(prefix)
+  ) {
+    return false;
+  }
+
+  for (unsigned int i = 0; i < valueLength; ++i) {
+    if (buffer[prefixLength + i] != (uint8_t)value[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+MHGroveBLE::MHGroveBLE(
+  Stream & device,
+  const char * name,
+  unsigned int rxBufferSize
+) :
+  MHGroveBLE(device, name, new uint8_t[rxBufferSize], rxBufferSize, true)
+{
+}
 
 MHGroveBLE::MHGroveBLE(
   Stream & device,
   const char * name,
+  uint8_t * rxStorage,
   unsigned int rxBufferSize
+) :
+  MHGroveBLE(device, name, rxStorage, rxBufferSize, false)
+{
+}
+
+MHGroveBLE::MHGroveBLE(
+  Stream & device,
+  const char * name,
+  uint8_t * rxStorage,
+  unsigned int rxBufferSize,
+  bool ownsRxStorage
 ) :
   device(device),
   name(name),
-  rxBufferSize(rxBufferSize),
-  internalState(InternalState::startup)
+#if MHGROVEBLE_PIN > 0
+  pin(nullptr),
+#endif
+  fastBoot(false),
+  profile(Profile::none),
+  pendingSettings(kSettingAll),
+  initialized(false),
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+  role(Role::peripheral),
+  peerAddress(),
+  discoveredPeers(),
+  discoveredPeerCount(0),
+  connectingAfterDiscovery(false),
+  connectRetryReferenceTime(0),
+  connectRetryDelay(0),
+  connectProgress(0),
+#endif
+  setupCommands(nullptr),
+  setupCommandOffset(0),
+  setupCommandsNeedReset(false),
+  fingerprintLoader(nullptr),
+  fingerprintStorer(nullptr),
+  storedFingerprint(0),
+  ownedRxStorage(ownsRxStorage ? rxStorage : nullptr),
+  // Without memory, e.g. if the allocation failed, the buffer has no room
+  // instead of writing through a null pointer.
+  rxBuffer(rxStorage, rxStorage != nullptr ? rxBufferSize : 0),
+  txBuffer(nullptr, 0),
+  txInterval(kDefaultTxInterval),
+  txReferenceTime(0),
+  delimiter(-1),
+  highWatermark(0),
+  overflowPolicy(OverflowPolicy::overwrite),
+  readBudgetBytes(0),
+  readBudgetMicros(0),
+  budgetExhausted(false),
+#if MHGROVEBLE_READ_CHUNK_SIZE > 0
+  reader(nullptr),
+  readChunkOffset(0),
+  readChunkLength(0),
+#endif
+  framing(Framing::none),
+  frameInProgress(false),
+  frameOverflow(false),
+  frameRemaining(0),
+  cobsCode(0),
+  notification(MHNotificationMatcher::Notification::none),
+  isLostPending(false),
+  lostReferenceTime(0),
+  internalState(InternalState::startup),
+  baudRate(0),
+  targetBaudRate(0),
+  stateReferenceTime(0),
+  initReferenceTime(0),
+#if MHGROVEBLE_STATS > 0
+  stats(),
+#endif
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0
+  messageStartTime(0),
+#endif
+#if MHGROVEBLE_TRACE_SIZE > 0
+  traceHead(0),
+  traceLength(0),
+#endif
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+  commandQueueHead(0),
+  commandQueueLength(0),
+  isCommandInFlight(false),
+#endif
+  retryCount(0),
+  responseIdleTimeout(kReceiveResponseEarlyTimeout),
+  expectedResponsePrefix(nullptr),
+  expectedResponseValue(nullptr),
+  expectedResponseExtraLength(0),
+  context(nullptr),
+  instanceHandlers(0),
+  onReady(),
+  onPanic(),
+#if MHGROVEBLE_CONNECTION_HANDLERS > 0
+  onConnect(),
+  onDisconnect(),
+#endif
+#if MHGROVEBLE_STRING_HANDLERS > 0
+  onDataReceived(),
+#endif
+  onBytesReceived(),
+  onFrameReceived(),
+  onDataDropped(),
+#if MHGROVEBLE_LOG_LEVEL > MHGROVEBLE_LOG_NONE
+  debug(nullptr),
+#endif
+  onBaudRateChange(nullptr)
+{
+}
+
+MHGroveBLE::~MHGroveBLE()
 {
-  rxBuffer.reserve(rxBufferSize);
+  delete[] ownedRxStorage;
 }
 
-void MHGroveBLE::runOnce()
+bool MHGroveBLE::runOnce()
 {
+  budgetExhausted = false;
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0
+  unsigned long startTime = micros();
+#endif
+
   switch (internalState) {
     case InternalState::startup:
+      // In fast boot mode, the queries find out which settings need to be
+      // written. Otherwise, all of them are written after the renew.
+      pendingSettings = fastBoot ? 0 : kSettingAll;
+      initReferenceTime = millis();
       transitionToState(InternalState::waitForDeviceAfterStartup);
       break;
 
-    case InternalState::waitForDeviceAfterStartup:
-    case InternalState::waitForDeviceAfterReset:
-      handleWaitForDevice();
+    case InternalState::initializationComplete:
+      // It should not be possible to end up here since we immediately
+      // transition to the `waitingForConnection` state.
       break;
 
-    case InternalState::waitAfterRenew:
-      if (isTimeout(millis(), timeoutReferenceTime, timeoutDuration)) {
-        transitionToState(InternalState::getFirmwareVersion);
-      }
+    case InternalState::waitingForConnection:
+      handleWaitForConnect();
       break;
 
-    case InternalState::renew:
-    case InternalState::setName:
-    case InternalState::setPIN:
-    case InternalState::setPINAuth:
-    case InternalState::setNotification:
-      handleGenericCommand();
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+    case InternalState::runningCommand:
+      handleRunningCommand();
       break;
+#endif
 
-    case InternalState::getFirmwareVersion:
-      handleGetFirmwareVersion();
+    case InternalState::connected:
+      handleConnected();
       break;
 
-    case InternalState::reset:
-      handleReset();
+    case InternalState::recovering:
+      handleWaitForDevice();
       break;
 
-    case InternalState::initializationComplete:
-      // It should not be possible to end up here since we immediately
-      // transition to the `waitingForConnection` state.
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+    case InternalState::connectingToPeer:
+      handleConnectingToPeer();
       break;
 
-    case InternalState::waitingForConnection:
-      handleWaitForConnect();
+    case InternalState::discoveringPeers:
+      handleDiscoveringPeers();
       break;
+#endif
 
-    case InternalState::connected:
-      handleConnected();
+    case InternalState::panicked:
+      // Nothing to do until `recover()` is called.
+      break;
+
+    default:
+      handleInitStep();
       break;
+  }
 
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0
+  recordDuration(stats.runDuration, micros() - startTime);
+#endif
+  return budgetExhausted;
+}
+
+bool MHGroveBLE::recover()
+{
+  switch (internalState) {
     case InternalState::panicked:
-      // Once we've panicked we won't do anything again.
+    case InternalState::waitingForConnection:
+      break;
+
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+    case InternalState::runningCommand:
+      if (notification == MHNotificationMatcher::Notification::connected) {
+        // Called from the handler of a command that a connect interrupted:
+        // the module would pass "AT" on to the peer.
+        return false;
+      }
+      // Go back first, so the handler can't start another command. When
+      // called from the handler of the command, it's already finished.
+      internalState = InternalState::waitingForConnection;
+      if (isCommandInFlight) {
+        finishCommand(CommandResult::cancelled);
+      }
+      break;
+#endif
+
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+    case InternalState::connectingToPeer:
+    case InternalState::discoveringPeers:
+      // Give up on the attempt like on a failed one; it's started again once
+      // the module responds.
+      if (connectingAfterDiscovery) {
+        peerAddress[0] = 0;
+        connectingAfterDiscovery = false;
+      }
+      discoveredPeerCount = 0;
+      rxBuffer.clear();
+      connectRetryReferenceTime = millis();
+      connectRetryDelay = kConnectRetryDelay;
       break;
+#endif
+
+    default:
+      return false;
   }
+
+  if (!initialized) {
+    // Nothing is known about the device, start from scratch.
+    transitionToState(InternalState::startup);
+    return true;
+  }
+
+  transitionToState(InternalState::recovering);
+  return true;
 }
 
 MHGroveBLE::State MHGroveBLE::getState() {
   switch (internalState) {
     case InternalState::panicked:   return State::panicked;
     case InternalState::waitingForConnection: return State::waitingForConnection;
+    case InternalState::runningCommand: return State::waitingForConnection;
+    case InternalState::connectingToPeer: return State::waitingForConnection;
+    case InternalState::discoveringPeers: return State::waitingForConnection;
     case InternalState::connected:  return State::connected;
     default:                        return State::initializing;
   }
 }
 
+unsigned long MHGroveBLE::millisUntilNextEvent()
+{
+  unsigned long now = millis();
+  unsigned long deadline = kNoDeadline;
+
+  if (isInputAvailable()) {
+    return 0;
+  }
+
+  switch (internalState) {
+    case InternalState::startup:
+    case InternalState::initializationComplete:
+      return 0;
+
+    case InternalState::panicked:
+      return kNoDeadline;
+
+    case InternalState::waitingForConnection:
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+      if (commandQueueLength > 0) {
+        return 0;
+      }
+#endif
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+      if (role == Role::central) {
+        return timeUntilTimeout(now, connectRetryReferenceTime, connectRetryDelay);
+      }
+#endif
+      return kNoDeadline;
+
+    case InternalState::connected:
+      if (timeoutDuration > 0) {
+        deadline = timeUntilTimeout(now, timeoutReferenceTime, timeoutDuration);
+      }
+      if (isLostPending) {
+        unsigned long lostDeadline =
+          timeUntilTimeout(now, lostReferenceTime, lostTimeout());
+        if (lostDeadline < deadline) {
+          deadline = lostDeadline;
+        }
+      }
+      if (!txBuffer.isEmpty()) {
+        unsigned long txDeadline = timeUntilTimeout(now, txReferenceTime, txInterval);
+        if (txDeadline < deadline) {
+          deadline = txDeadline;
+        }
+      }
+      return deadline;
+
+    default:
+      // Waiting for a response or for the device; see `receiveResponse`.
+      deadline = timeUntilTimeout(now, timeoutReferenceTime, timeoutDuration);
+      if (softTimeoutDuration > 0) {
+        unsigned long softDeadline =
+          timeUntilTimeout(now, softTimeoutReferenceTime, softTimeoutDuration);
+        if (softDeadline < deadline) {
+          deadline = softDeadline;
+        }
+      }
+      return deadline;
+  }
+}
+
+bool MHGroveBLE::isExpectingData()
+{
+  switch (internalState) {
+    case InternalState::startup:
+    case InternalState::waitAfterRenew:
+    case InternalState::initializationComplete:
+    case InternalState::panicked:
+    case InternalState::waitingForConnection:
+      return false;
+
+    case InternalState::connected:
+      // Either a message or a frame is partially received.
+      return !rxBuffer.isEmpty() || frameInProgress;
+
+    default:
+      // A command has been sent and its response is outstanding.
+      return true;
+  }
+}
+
+#if MHGROVEBLE_STATS > 0
+const MHGroveBLE::Stats & MHGroveBLE::getStats() const
+{
+  return stats;
+}
+
+void MHGroveBLE::resetStats()
+{
+  stats = Stats();
+}
+#endif
+
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0
+void MHGroveBLE::printHistograms(Print & output) const
+{
+  for (uint8_t i = 0; i < MHGROVEBLE_HISTOGRAM_SIZE; ++i) {
+    output.print(i > 0 ? 1UL << (i - 1) : 0UL);
+    output.print(' ');
+    output.print(stats.receiveLatency.counts[i]);
+    output.print(' ');
+    output.print(stats.runDuration.counts[i]);
+    output.println();
+  }
+  output.print(F("max "));
+  output.print(stats.receiveLatency.maximum);
+  output.print(' ');
+  output.print(stats.runDuration.maximum);
+  output.println();
+}
+#endif
+
+#if MHGROVEBLE_TRACE_SIZE > 0
+unsigned int MHGroveBLE::getTraceLength() const
+{
+  return traceLength;
+}
+
+bool MHGroveBLE::getTraceEvent(unsigned int index, TraceEvent & event) const
+{
+  if (index >= traceLength) {
+    return false;
+  }
+
+  event = traceEvents[(traceHead + index) % MHGROVEBLE_TRACE_SIZE];
+  return true;
+}
+
+void MHGroveBLE::printTrace(Print & output) const
+{
+  TraceEvent event;
+
+  for (unsigned int i = 0; getTraceEvent(i, event); ++i) {
+    output.print(event.timestamp);
+    output.print(' ');
+    output.print((int)event.type);
+    output.print(' ');
+    output.print((int)event.state);
+    output.print(' ');
+    output.print((unsigned int)event.count);
+    output.println();
+  }
+}
+
+void MHGroveBLE::clearTrace()
+{
+  traceHead = 0;
+  traceLength = 0;
+}
+#endif
+
+#if MHGROVEBLE_PIN > 0
 void MHGroveBLE::setPIN(const char * aPin)
 {
   pin = aPin;
 }
+#endif
 
-void MHGroveBLE::setOnReady(void (*onFunc)())
+void MHGroveBLE::setFastBoot(bool enabled)
 {
-  onReady = onFunc;
+  fastBoot = enabled;
 }
 
-void MHGroveBLE::setOnPanic(void (*onFunc)())
+void MHGroveBLE::setFingerprintStorage(FingerprintLoader load, FingerprintStorer store)
 {
-  onPanic = onFunc;
+  fingerprintLoader = load;
+  fingerprintStorer = store;
 }
 
-void MHGroveBLE::setOnConnect(void (*onFunc)())
+void MHGroveBLE::setProfile(Profile aProfile)
 {
-  onConnect = onFunc;
+  profile = aProfile;
 }
 
-void MHGroveBLE::setOnDisconnect(void (*onFunc)())
+void MHGroveBLE::setSetupCommands(const __FlashStringHelper * commands, bool needsReset)
 {
-  onDisconnect = onFunc;
+  setupCommands = reinterpret_cast<PGM_P>(commands);
+  setupCommandsNeedReset = needsReset;
 }
 
-void MHGroveBLE::setOnDataReceived(void (*onFunc)(const String &))
+void MHGroveBLE::setBaudRate(unsigned long baud)
 {
-  onDataReceived = onFunc;
+  applyBaudRate(baud);
+}
 
+void MHGroveBLE::setTargetBaudRate(unsigned long baud)
+{
+  targetBaudRate = baud;
 }
 
-void MHGroveBLE::setDebug(void (*debugFunc)(const char *))
+void MHGroveBLE::setContext(void * aContext)
 {
-  debug = debugFunc;
+  context = aContext;
 }
 
-bool MHGroveBLE::send(const String & data)
+void * MHGroveBLE::getContext() const
 {
-  if (internalState != InternalState::connected) {
-    return false;
-  }
+  return context;
+}
 
-  device.print(data);
-  return true;
+void MHGroveBLE::setOnReady(void (*onFunc)())
+{
+  onReady.plain = onFunc;
+  setInstanceHandler(kHandlerReady, false);
 }
 
+void MHGroveBLE::setOnReadyInstance(InstanceHandler onFunc)
+{
+  onReady.instance = onFunc;
+  setInstanceHandler(kHandlerReady, true);
+}
 
-/*******************************************************************************
- * Private section
- ******************************************************************************/
+void MHGroveBLE::setOnPanic(void (*onFunc)())
+{
+  onPanic.plain = onFunc;
+  setInstanceHandler(kHandlerPanic, false);
+}
+
+void MHGroveBLE::setOnPanicInstance(InstanceHandler onFunc)
+{
+  onPanic.instance = onFunc;
+  setInstanceHandler(kHandlerPanic, true);
+}
+
+#if MHGROVEBLE_CONNECTION_HANDLERS > 0
+void MHGroveBLE::setOnConnect(void (*onFunc)())
+{
+  onConnect.plain = onFunc;
+  setInstanceHandler(kHandlerConnect, false);
+}
+
+void MHGroveBLE::setOnConnectInstance(InstanceHandler onFunc)
+{
+  onConnect.instance = onFunc;
+  setInstanceHandler(kHandlerConnect, true);
+}
+
+void MHGroveBLE::setOnDisconnect(void (*onFunc)())
+{
+  onDisconnect.plain = onFunc;
+  setInstanceHandler(kHandlerDisconnect, false);
+}
+
+void MHGroveBLE::setOnDisconnectInstance(InstanceHandler onFunc)
+{
+  onDisconnect.instance = onFunc;
+  setInstanceHandler(kHandlerDisconnect, true);
+}
+#endif
+
+#if MHGROVEBLE_STRING_HANDLERS > 0
+void MHGroveBLE::setOnDataReceived(void (*onFunc)(const String &))
+{
+  onDataReceived.plain = onFunc;
+  setInstanceHandler(kHandlerDataReceived, false);
+}
+
+void MHGroveBLE::setOnDataReceivedInstance(InstanceDataHandler onFunc)
+{
+  onDataReceived.instance = onFunc;
+  setInstanceHandler(kHandlerDataReceived, true);
+}
+#endif
+
+void MHGroveBLE::setOnBytesReceived(void (*onFunc)(const uint8_t *, size_t))
+{
+  onBytesReceived.plain = onFunc;
+  setInstanceHandler(kHandlerBytesReceived, false);
+}
+
+void MHGroveBLE::setOnBytesReceivedInstance(InstanceBytesHandler onFunc)
+{
+  onBytesReceived.instance = onFunc;
+  setInstanceHandler(kHandlerBytesReceived, true);
+}
+
+void MHGroveBLE::setOnBaudRateChange(void (*onFunc)(unsigned long))
+{
+  onBaudRateChange = onFunc;
+}
+
+void MHGroveBLE::setDebug(void (*debugFunc)(const char *))
+{
+#if MHGROVEBLE_LOG_LEVEL > MHGROVEBLE_LOG_NONE
+  debug = debugFunc;
+#else
+  (void)debugFunc;
+#endif
+}
+
+bool MHGroveBLE::send(const String & data)
+{
+  return send(reinterpret_cast<const uint8_t *>(data.c_str()), data.length());
+}
+
+bool MHGroveBLE::send(const char * data)
+{
+  return send(reinterpret_cast<const uint8_t *>(data), strlen(data));
+}
+
+bool MHGroveBLE::send(const uint8_t * data, size_t length)
+{
+  if (!canSend(length)) {
+    return false;
+  }
+
+  transmit(data, length);
+  return true;
+}
+
+bool MHGroveBLE::send(const __FlashStringHelper * data)
+{
+  PGM_P text = reinterpret_cast<PGM_P>(data);
+  size_t length = strlen_P(text);
+  if (!canSend(length)) {
+    return false;
+  }
+
+  if (txBuffer.capacity() == 0) {
+    for (size_t i = 0; i < length; ++i) {
+      device.write((uint8_t)pgm_read_byte(text + i));
+    }
+    MHGROVEBLE_COUNT(bytesSent, length);
+    return true;
+  }
+
+  for (size_t i = 0; i < length; ++i) {
+    txBuffer.push(pgm_read_byte(text + i));
+  }
+  return true;
+}
+
+bool MHGroveBLE::send(const Printable & data)
+{
+  if (internalState != InternalState::connected) {
+    return false;
+  }
+
+  if (txBuffer.capacity() == 0) {
+    MHGROVEBLE_COUNT(bytesSent, data.printTo(device));
+    return true;
+  }
+
+  // Print it twice: once to check that it fits, once into the buffer.
+  CountingPrint counter;
+  data.printTo(counter);
+  if (!canSend(counter.count)) {
+    return false;
+  }
+  RingBufferPrint output(txBuffer);
+  data.printTo(output);
+  return true;
+}
+
+bool MHGroveBLE::sendFrame(const uint8_t * data, size_t length)
+{
+  if (internalState != InternalState::connected) {
+    return false;
+  }
+
+  switch (framing) {
+    case Framing::none:
+      return false;
+
+    case Framing::lengthPrefixed: {
+      if (length > 255) {
+        return false;
+      }
+      if (txBuffer.capacity() > 0 && length + 1 > txBuffer.freeSpace()) {
+        return false;
+      }
+
+      uint8_t prefix = (uint8_t)length;
+      transmit(&prefix, 1);
+      transmit(data, length);
+      return true;
+    }
+
+    case Framing::cobs: {
+      if (txBuffer.capacity() > 0 && writeCobs(data, length, true) > txBuffer.freeSpace()) {
+        return false;
+      }
+
+      writeCobs(data, length, false);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+bool MHGroveBLE::enqueueCommand(
+  const __FlashStringHelper * command,
+  CommandHandler handler,
+  uint16_t timeout
+)
+{
+  return enqueueCommand(reinterpret_cast<PGM_P>(command), true, handler, timeout);
+}
+
+bool MHGroveBLE::enqueueCommand(
+  const char * command,
+  CommandHandler handler,
+  uint16_t timeout
+)
+{
+  return enqueueCommand(command, false, handler, timeout);
+}
+
+uint8_t MHGroveBLE::getQueuedCommandCount() const
+{
+  return commandQueueLength;
+}
+
+MHGroveBLE::CommandChain MHGroveBLE::command(
+  const __FlashStringHelper * command,
+  CommandHandler handler,
+  uint16_t timeout
+)
+{
+  bool isQueued = enqueueCommand(reinterpret_cast<PGM_P>(command), true, handler, timeout);
+  return CommandChain(isQueued ? this : nullptr);
+}
+
+MHGroveBLE::CommandChain MHGroveBLE::command(
+  const char * command,
+  CommandHandler handler,
+  uint16_t timeout
+)
+{
+  return CommandChain(enqueueCommand(command, false, handler, timeout) ? this : nullptr);
+}
+
+MHGroveBLE::CommandChain::CommandChain(MHGroveBLE * aBle) :
+  ble(aBle)
+{
+}
+
+MHGroveBLE::CommandChain MHGroveBLE::CommandChain::then(
+  const __FlashStringHelper * command,
+  CommandHandler handler,
+  uint16_t timeout
+)
+{
+  bool isQueued =
+    ble && ble->enqueueCommand(reinterpret_cast<PGM_P>(command), true, handler, timeout, true);
+  return CommandChain(isQueued ? ble : nullptr);
+}
+
+MHGroveBLE::CommandChain MHGroveBLE::CommandChain::then(
+  const char * command,
+  CommandHandler handler,
+  uint16_t timeout
+)
+{
+  bool isQueued = ble && ble->enqueueCommand(command, false, handler, timeout, true);
+  return CommandChain(isQueued ? ble : nullptr);
+}
+
+bool MHGroveBLE::CommandChain::isQueued() const
+{
+  return ble != nullptr;
+}
+#endif
+
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+void MHGroveBLE::setRole(Role aRole)
+{
+  role = aRole;
+}
+
+void MHGroveBLE::setPeerAddress(const char * address)
+{
+  peerAddress[0] = 0;
+  if (address) {
+    strncpy(peerAddress, address, kPeerAddressLength);
+    peerAddress[kPeerAddressLength] = 0;
+  }
+}
+
+const char * MHGroveBLE::getPeerAddress() const
+{
+  return peerAddress;
+}
+
+uint8_t MHGroveBLE::getDiscoveredPeerCount() const
+{
+  return discoveredPeerCount;
+}
+
+const char * MHGroveBLE::getDiscoveredPeer(uint8_t index) const
+{
+  return index < discoveredPeerCount ? discoveredPeers[index] : "";
+}
+#endif
+
+void MHGroveBLE::setTxBuffer(uint8_t * storage, unsigned int size)
+{
+  txBuffer = MHRingBuffer(storage, size);
+}
+
+void MHGroveBLE::setDelimiter(int aDelimiter)
+{
+  delimiter = aDelimiter;
+}
+
+void MHGroveBLE::setHighWatermark(unsigned int watermark)
+{
+  highWatermark = watermark;
+}
+
+void MHGroveBLE::setOverflowPolicy(OverflowPolicy policy)
+{
+  overflowPolicy = policy;
+}
+
+void MHGroveBLE::setReadBudget(unsigned int bytes, unsigned long micros)
+{
+  readBudgetBytes = bytes;
+  readBudgetMicros = micros;
+}
+
+#if MHGROVEBLE_READ_CHUNK_SIZE > 0
+void MHGroveBLE::setReader(Reader aReader)
+{
+  reader = aReader;
+}
+
+size_t MHGroveBLE::readAvailableBytes(Stream & stream, uint8_t * buffer, size_t length)
+{
+  int available = stream.available();
+  if (available <= 0) {
+    return 0;
+  }
+  if ((size_t)available < length) {
+    length = available;
+  }
+  // The bytes are available, so this doesn't wait for the stream's timeout.
+  return stream.readBytes(buffer, length);
+}
+#endif
+
+void MHGroveBLE::setOnDataDropped(void (*onFunc)(size_t))
+{
+  onDataDropped.plain = onFunc;
+  setInstanceHandler(kHandlerDataDropped, false);
+}
+
+void MHGroveBLE::setOnDataDroppedInstance(InstanceDropHandler onFunc)
+{
+  onDataDropped.instance = onFunc;
+  setInstanceHandler(kHandlerDataDropped, true);
+}
+
+void MHGroveBLE::setFraming(Framing aFraming)
+{
+  framing = aFraming;
+  rxBuffer.clear();
+  resetFrame();
+}
+
+void MHGroveBLE::setOnFrameReceived(void (*onFunc)(const uint8_t *, size_t))
+{
+  onFrameReceived.plain = onFunc;
+  setInstanceHandler(kHandlerFrameReceived, false);
+}
+
+void MHGroveBLE::setOnFrameReceivedInstance(InstanceBytesHandler onFunc)
+{
+  onFrameReceived.instance = onFunc;
+  setInstanceHandler(kHandlerFrameReceived, true);
+}
+
+void MHGroveBLE::setTxInterval(unsigned long interval)
+{
+  txInterval = interval;
+}
+
+unsigned int MHGroveBLE::getTxBufferFree()
+{
+  return txBuffer.freeSpace();
+}
+
+
+/*******************************************************************************
+ * Private section
+ ******************************************************************************/
+
+#if MHGROVEBLE_TRACE_SIZE > 0
+void MHGroveBLE::trace(TraceEventType type, unsigned int count)
+{
+  unsigned int index;
+
+  if (traceLength < MHGROVEBLE_TRACE_SIZE) {
+    index = (traceHead + traceLength) % MHGROVEBLE_TRACE_SIZE;
+    ++traceLength;
+  } else {
+    // Overwrite the oldest event.
+    index = traceHead;
+    traceHead = (traceHead + 1) % MHGROVEBLE_TRACE_SIZE;
+  }
+
+  TraceEvent & event = traceEvents[index];
+  event.timestamp = micros();
+  event.type = type;
+  event.state = (uint8_t)internalState;
+  event.count = count;
+}
+#endif
+
+void MHGroveBLE::applyBaudRate(unsigned long baud)
+{
+  baudRate = baud;
+  // One character is 10 bits (8N1). Round up and add a millisecond to account
+  // for the granularity of `millis()`.
+  responseIdleTimeout =
+    baud > 0
+    ? (kResponseIdleCharacters * 10 * 1000 + baud - 1) / baud + 1
+    : kReceiveResponseEarlyTimeout;
+}
+
+void MHGroveBLE::changeBaudRate(unsigned long baud)
+{
+#if MHGROVEBLE_LOG_LEVEL >= MHGROVEBLE_LOG_INFO
+  if (debug) {
+    String text = F("Switching baud rate: ");
+    text += baud;
+    debug(text.c_str());
+  }
+#endif
+
+  onBaudRateChange(baud);
+  applyBaudRate(baud);
+
+  // Bytes that were read at the old baud rate are garbage now.
+#if MHGROVEBLE_READ_CHUNK_SIZE > 0
+  readChunkOffset = 0;
+  readChunkLength = 0;
+#endif
+  notificationMatcher.reset();
+}
+
+void MHGroveBLE::transitionToState(MHGroveBLE::InternalState nextState)
+{
+  unsigned long now = millis();
+
+  // Keep track of how long the initialization steps take.
+  static_assert(
+    (int)InternalState::initializationComplete + 1 == kInitStepCount,
+    "kInitStepCount must match the number of initialization states"
+  );
+  static_assert(
+    sizeof(kInitSteps) / sizeof(kInitSteps[0]) == kInitStepCount,
+    "kInitSteps must have an entry for each initialization state"
+  );
+#if MHGROVEBLE_STATS > 0
+  if ((int)internalState < kInitStepCount) {
+    stats.initStepDurations[(int)internalState] = now - stateReferenceTime;
+  }
+#endif
+  stateReferenceTime = now;
+
+  // Skip the initialization steps that aren't needed. This always ends at
+  // `initializationComplete` at the latest, since it has no conditions.
+  while ((int)nextState < kInitStepCount && !shouldRunInitStep(nextState)) {
+#if MHGROVEBLE_STATS > 0
+    stats.initStepDurations[(int)nextState] = 0;
+#endif
+    nextState = (InternalState)((int)nextState + 1);
+  }
+
+#if MHGROVEBLE_LOG_LEVEL >= MHGROVEBLE_LOG_VERBOSE
+  if (debug) {
+    String text = F("Transitioning to state: ");
+    text += (int)nextState;
+    debug(text.c_str());
+  }
+#endif
+
+  if (nextState == InternalState::initializationComplete) {
+    // When we've reached the `initializationComplete` state, we just want to
+    // inform the handler and then continue to the `waitingForConnection`
+    // state right away.
+    internalState = nextState;
+    MHGROVEBLE_TRACE(transition, 0);
+#if MHGROVEBLE_STATS > 0
+    stats.initDuration = now - initReferenceTime;
+    stats.initStepDurations[(int)nextState] = 0;
+#endif
+    initialized = true;
+    if (fingerprintLoader && fingerprintStorer) {
+      uint32_t fingerprint = configurationFingerprint();
+      if (fingerprint != storedFingerprint) {
+        fingerprintStorer(fingerprint);
+        storedFingerprint = fingerprint;
+      }
+    }
+    callHandler(onReady, kHandlerReady);
+    nextState = InternalState::waitingForConnection;
+  }
+
+  // Set most commonly needed values.
+  softTimeoutReferenceTime = 0;
+  softTimeoutDuration = 0;
+  timeoutReferenceTime = now;
+  timeoutDuration = kGenericCommandTimeout;
+  retryCount = 0;
+
+  switch (nextState) {
+    case InternalState::waitingForConnection:
+      if (internalState == InternalState::connected) {
+        MHGROVEBLE_COUNT(disconnects, 1);
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+        // Reconnect right away.
+        connectRetryDelay = 0;
+#endif
+#if MHGROVEBLE_CONNECTION_HANDLERS > 0
+        callHandler(onDisconnect, kHandlerDisconnect);
+#endif
+      }
+      rxBuffer.clear();
+      // Whatever hasn't been sent yet cannot be sent anymore.
+      txBuffer.clear();
+      notificationMatcher.reset();
+      isLostPending = false;
+      if (internalState == InternalState::recovering) {
+        internalState = nextState;
+        MHGROVEBLE_TRACE(transition, 0);
+        MHGROVEBLE_COUNT(recoveries, 1);
+        callHandler(onReady, kHandlerReady);
+        return;
+      }
+      break;
+
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+    case InternalState::connectingToPeer:
+      notificationMatcher.reset();
+      connectProgress = kConnectSent;
+      if (peerAddress[0]) {
+        sendCommand(kCommandConnect, peerAddress);
+      } else {
+        sendCommand(kCommandConnectLast);
+      }
+      timeoutDuration = kConnectTimeout;
+      break;
+
+    case InternalState::discoveringPeers:
+      discoveredPeerCount = 0;
+      MHGROVEBLE_COUNT(discoveries, 1);
+      sendCommand(kCommandDiscover);
+      timeoutDuration = kDiscoveryTimeout;
+      break;
+#endif
+
+    case InternalState::recovering:
+      sendCommand(kCommandAT, nullptr, reinterpret_cast<const __FlashStringHelper *>(kResponseOK));
+      softTimeoutReferenceTime = now;
+      softTimeoutDuration = kRecoveryRetryTimeout;
+      timeoutDuration = kWaitForDeviceTimeout;
+      break;
+
+    case InternalState::connected:
+      // The receive buffer is left alone: it may hold the first data of the
+      // connection, see `handleConnectingToPeer`.
+      notificationMatcher.reset();
+      isLostPending = false;
+      resetFrame();
+      MHGROVEBLE_COUNT(connects, 1);
+#if MHGROVEBLE_CONNECTION_HANDLERS > 0
+      callHandler(onConnect, kHandlerConnect);
+#endif
+      timeoutReferenceTime = 0;
+      timeoutDuration = 0;
+      break;
+
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+    case InternalState::runningCommand: {
+      // Also when coming straight from the previous command.
+      notificationMatcher.reset();
+      const QueuedCommand & command = commandQueue[commandQueueHead];
+      isCommandInFlight = true;
+      if (command.isFlash) {
+        sendCommand(command.command);
+      } else {
+        sendCommand(command.command, strlen(command.command), false, nullptr);
+      }
+      timeoutDuration = command.timeout;
+      break;
+    }
+#endif
+
+    case InternalState::panicked:
+#if MHGROVEBLE_LOG_LEVEL >= MHGROVEBLE_LOG_ERROR
+      if (debug) {
+        char text[sizeof(kLogPanic)];
+        memcpy_P(text, kLogPanic, sizeof(kLogPanic));
+        debug(text);
+      }
+#endif
+      internalState = nextState;
+      MHGROVEBLE_TRACE(transition, 0);
+      rxBuffer.clear();
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+      while (commandQueueLength > 0) {
+        finishCommand(CommandResult::cancelled);
+      }
+#endif
+      // Last, as the handler may call `recover()`.
+      callHandler(onPanic, kHandlerPanic);
+      return;
+
+    default:
+      internalState = nextState;
+      MHGROVEBLE_TRACE(transition, 0);
+      startInitStep();
+      return;
+  }
+
+  internalState = nextState;
+  MHGROVEBLE_TRACE(transition, 0);
+}
+
+bool MHGroveBLE::isCentral() const
+{
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+  return role == Role::central;
+#else
+  return false;
+#endif
+}
+
+uint32_t MHGroveBLE::configurationFingerprint() const
+{
+  // The number of steps changes with the initialization sequence, so a new
+  // version of the library doesn't take an old fingerprint for its own.
+  uint32_t hash = hashValue(kFnvOffsetBasis, kInitStepCount);
+  hash = hashString(hash, name, false);
+  hash = hashString(hash, getPIN(), false);
+  hash = hashByte(hash, (uint8_t)profile);
+  hash = hashByte(hash, isCentral());
+  hash = hashString(hash, setupCommands, true);
+  hash = hashByte(hash, setupCommandsNeedReset);
+  // The module may still use the current baud rate after the target has been
+  // changed.
+  hash = hashValue(hash, baudRate);
+  hash = hashValue(hash, targetBaudRate);
+  hash = hashValue(hash, firmwareVersion);
+  return hash != 0 ? hash : 1;
+}
+
+const char * MHGroveBLE::getPIN() const
+{
+#if MHGROVEBLE_PIN > 0
+  return pin;
+#else
+  return nullptr;
+#endif
+}
+
+bool MHGroveBLE::shouldRunInitStep(InternalState state)
+{
+  InitStep step;
+  memcpy_P(&step, &kInitSteps[(int)state], sizeof(step));
+  uint16_t flags = step.flags;
+
+  if (step.kind == kStepWrite && !(pendingSettings & step.setting)) {
+    return false;
+  }
+
+  if ((flags & kRunIfFastBoot) && !fastBoot) {
+    return false;
+  }
+  if ((flags & kRunIfNotFastBoot) && fastBoot) {
+    return false;
+  }
+  if ((flags & kRunIfPIN) && !getPIN()) {
+    return false;
+  }
+  if ((flags & kRunIfPINOrFastBoot) && !getPIN() && !fastBoot) {
+    return false;
+  }
+  if ((flags & kRunIfFirmware515) && firmwareVersion < 515) {
+    return false;
+  }
+  if (
+    (flags & kRunIfBaudRateLost)
+    && !(onBaudRateChange && baudRate != 0 && baudRate != kFactoryBaudRate)
+  ) {
+    return false;
+  }
+  if (flags & kRunIfBaudRateSwitch) {
+    // After a renew, the device is configured for the factory baud rate.
+    // Otherwise it's configured for the one it's currently using.
+    unsigned long configuredBaudRate =
+      fastBoot && baudRate != 0 ? baudRate : kFactoryBaudRate;
+    if (
+      !onBaudRateChange
+      || baudRateIndex(targetBaudRate) < 0
+      || targetBaudRate == configuredBaudRate
+    ) {
+      return false;
+    }
+  }
+  if ((flags & kRunIfPendingSettings) && !pendingSettings) {
+    return false;
+  }
+  if ((flags & kRunIfSetupCommands) && !(setupCommands && pgm_read_byte(setupCommands))) {
+    return false;
+  }
+  if ((flags & kRunIfProfile) && profile == Profile::none) {
+    return false;
+  }
+  if ((flags & kRunIfFirmware538) && firmwareVersion < 538) {
+    return false;
+  }
+  if ((flags & kRunIfCentralOrFastBoot) && !isCentral() && !fastBoot) {
+    return false;
+  }
+  bool hasFingerprintStorage = fingerprintLoader && fingerprintStorer;
+  if ((flags & kRunIfFingerprint) && !hasFingerprintStorage) {
+    return false;
+  }
+  if ((flags & kRunIfNoFingerprint) && hasFingerprintStorage) {
+    return false;
+  }
+  return true;
+}
+
+void MHGroveBLE::startInitStep()
+{
+  unsigned long now = millis();
+  InitStep step;
+  memcpy_P(&step, &kInitSteps[(int)internalState], sizeof(step));
+
+  if (step.timeout > 0) {
+    timeoutDuration = step.timeout;
+  }
+
+  switch (step.kind) {
+    case kStepNone:
+    case kStepDelay:
+    case kStepComplete:
+      // The transition to the next state is handled in `handleInitStep()`.
+      break;
+
+    case kStepWaitForDevice:
+      if (step.flags & kApplyFactoryBaudRate) {
+        changeBaudRate(kFactoryBaudRate);
+      }
+      if ((step.flags & kApplyTargetBaudRate) && (pendingSettings & kSettingBaudRate)) {
+        changeBaudRate(targetBaudRate);
+      }
+      sendCommand(kCommandAT, nullptr, reinterpret_cast<const __FlashStringHelper *>(kResponseOK));
+      softTimeoutReferenceTime = now;
+      softTimeoutDuration = kWaitForDeviceRetryTimeout;
+      break;
+
+    case kStepSetupCommands:
+      if (setupCommandsNeedReset) {
+        pendingSettings |= step.setting;
+      }
+      setupCommandOffset = 0;
+      sendSetupCommand();
+      break;
+
+    default: {
+      if (step.kind == kStepCommand) {
+        pendingSettings |= step.setting;
+      }
+
+      sendCommand(
+        step.command,
+        initStepArgument(step.commandArgument),
+        reinterpret_cast<const __FlashStringHelper *>(step.responsePrefix),
+        initStepArgument(step.responseArgument),
+        step.responseExtraLength
+      );
+      break;
+    }
+  }
+}
+
+const char * MHGroveBLE::initStepArgument(uint8_t argument)
+{
+  switch (argument) {
+    case kArgumentName:
+      return name;
+
+    case kArgumentPIN:
+      return getPIN();
+
+    case kArgumentPINAuth:
+      // Auth with PIN or no auth.
+      return getPIN() ? "2" : "0";
+
+    case kArgumentBaudRate: {
+      int index = baudRateIndex(targetBaudRate);
+      return index >= 0 ? kBaudRateParameters[index] : nullptr;
+    }
+
+    case kArgumentRole:
+      return isCentral() ? "1" : "0";
+
+    case kArgumentAdvertisingInterval:
+    case kArgumentTransmitPower:
+    case kArgumentConnectionInterval:
+      if (profile == Profile::none) {
+        return nullptr;
+      }
+      return kProfileParameters[(int)profile - 1][argument - kArgumentAdvertisingInterval];
+
+    default:
+      return nullptr;
+  }
+}
+
+bool MHGroveBLE::sendSetupCommand()
+{
+  // The commands are separated by newlines, empty lines are skipped.
+  while (pgm_read_byte(setupCommands + setupCommandOffset) == '\n') {
+    ++setupCommandOffset;
+  }
+
+  unsigned int start = setupCommandOffset;
+  char value;
+  while ((value = pgm_read_byte(setupCommands + setupCommandOffset)) != 0 && value != '\n') {
+    ++setupCommandOffset;
+  }
+
+  if (setupCommandOffset == start) {
+    return false;
+  }
+  sendCommand(setupCommands + start, setupCommandOffset - start, true, nullptr);
+  return true;
+}
+
+void MHGroveBLE::sendCommand(
+  PGM_P command,
+  const char * argument,
+  const __FlashStringHelper * expectedPrefix,
+  const char * expectedValue,
+  uint8_t expectedExtraLength
+)
+{
+  sendCommand(
+    command,
+    strlen_P(command),
+    true,
+    argument,
+    expectedPrefix,
+    expectedValue,
+    expectedExtraLength
+  );
+}
+
+void MHGroveBLE::sendCommand(
+  const char * command,
+  size_t length,
+  bool isFlash,
+  const char * argument,
+  const __FlashStringHelper * expectedPrefix,
+  const char * expectedValue,
+  uint8_t expectedExtraLength
+)
+{
+  size_t argumentLength = argument ? strlen(argument) : 0;
+
+#if MHGROVEBLE_LOG_LEVEL >= MHGROVEBLE_LOG_INFO
+  if (debug) {
+    // Longer commands are truncated in the log.
+    char text[sizeof(kLogSendingCommand) + kLogCommandLength];
+    size_t used = sizeof(kLogSendingCommand) - 1;
+    memcpy_P(text, kLogSendingCommand, used);
+    used += copyCommandPart(text + used, sizeof(text) - 1 - used, command, length, isFlash);
+    used += copyCommandPart(text + used, sizeof(text) - 1 - used, argument, argumentLength, false);
+    text[used] = 0;
+    debug(text);
+  }
+#endif
+  MHGROVEBLE_TRACE(commandSent, length + argumentLength);
+
+  // Written piece by piece, so a command never needs a temporary string.
+  if (isFlash) {
+    for (size_t i = 0; i < length; ++i) {
+      device.write((uint8_t)pgm_read_byte(command + i));
+    }
+  } else {
+    device.write(reinterpret_cast<const uint8_t *>(command), length);
+  }
+  if (argumentLength > 0) {
+    device.write(reinterpret_cast<const uint8_t *>(argument), argumentLength);
+  }
+
+  // Clear the receive buffer after sending a command.
+  rxBuffer.clear();
+
+  expectedResponsePrefix = expectedPrefix;
+  expectedResponseValue = expectedValue;
+  expectedResponseExtraLength = expectedExtraLength;
+}
+
+bool MHGroveBLE::isExpectedResponse()
+{
+  return
+    expectedResponsePrefix
+    && isResponse(
+      rxBuffer,
+      expectedResponsePrefix,
+      expectedResponseValue,
+      expectedResponseExtraLength
+    );
+}
+
+bool MHGroveBLE::readIntoBuffer()
+{
+  typedef MHNotificationMatcher::Notification Notification;
+  bool didReceive = false;
+  bool isUnframed = framing == Framing::none || internalState != InternalState::connected;
+  size_t droppedCount = 0;
+
+  notification = Notification::none;
+
+  // Each state reads once per `runOnce()` call, so this is the budget of the
+  // call.
+  unsigned int bytesRead = 0;
+  unsigned long startTime = readBudgetMicros > 0 ? micros() : 0;
+
+  for (;;) {
+    if (
+      isUnframed
+      && rxBuffer.isFull()
+      && overflowPolicy == OverflowPolicy::stopReading
+      && internalState == InternalState::connected
+    ) {
+      // Leave the data in the stream until the buffer has been passed on.
+      break;
+    }
+
+    if (
+      bytesRead > 0
+      && (
+        (readBudgetBytes > 0 && bytesRead >= readBudgetBytes)
+        || (readBudgetMicros > 0 && micros() - startTime >= readBudgetMicros)
+      )
+    ) {
+      if (isInputAvailable()) {
+        budgetExhausted = true;
+        MHGROVEBLE_COUNT(budgetExhausted, 1);
+      }
+      break;
+    }
+
+    int value = readByte();
+    if (value < 0) {
+      break;
+    }
+    ++bytesRead;
+    MHGROVEBLE_COUNT(bytesReceived, 1);
+    didReceive = true;
+    Notification match = receiveByte((uint8_t)value, isUnframed, droppedCount);
+
+    // Stop right after a connect so the bytes following it are handled in
+    // the connected state.
+    if (
+      match == Notification::connected
+      && (internalState == InternalState::waitingForConnection
+        || internalState == InternalState::runningCommand
+        || internalState == InternalState::connectingToPeer)
+    ) {
+      notification = match;
+      break;
+    }
+  }
+
+  // As an app is also able to send "OK+LOST", it's only taken as the end of
+  // the connection if nothing follows it for a few character times. At low
+  // baud rates, the next byte simply may not have arrived yet.
+  if (
+    isLostPending
+    && !isInputAvailable()
+    && isTimeout(millis(), lostReferenceTime, lostTimeout())
+  ) {
+    isLostPending = false;
+    notification = Notification::lost;
+  }
+
+  if (didReceive) {
+    MHGROVEBLE_TRACE(bytesRead, bytesRead);
+  }
+  if (droppedCount > 0) {
+    MHGROVEBLE_COUNT(bytesDropped, droppedCount);
+    if (instanceHandlers & kHandlerDataDropped) {
+      if (onDataDropped.instance) {
+        onDataDropped.instance(*this, droppedCount);
+      }
+    } else if (onDataDropped.plain) {
+      onDataDropped.plain(droppedCount);
+    }
+  }
+  return didReceive;
+}
+
+MHNotificationMatcher::Notification MHGroveBLE::receiveByte(
+  uint8_t value,
+  bool isUnframed,
+  size_t & droppedCount
+)
+{
+  typedef MHNotificationMatcher::Notification Notification;
+
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0
+  if (
+    internalState == InternalState::connected
+    && (isUnframed ? rxBuffer.isEmpty() : !frameInProgress)
+  ) {
+    messageStartTime = micros();
+  }
+#endif
+
+  bool wasInFrame = !isUnframed && frameInProgress;
+  if (!isUnframed) {
+    receiveFramedByte(value);
+  } else {
+    // We don't want to grow the receive buffer. If it's full, the oldest
+    // byte is discarded.
+    if (rxBuffer.push(value) && internalState == InternalState::connected) {
+      ++droppedCount;
+    }
+  }
+  // Whatever follows "OK+LOST" shows that the peer has sent it.
+  isLostPending = false;
+
+  Notification match = notificationMatcher.feed(value);
+  if (wasInFrame && !frameInProgress) {
+    // The byte completed a frame, so what it matched is payload, and the next
+    // notification starts after it.
+    notificationMatcher.reset();
+    match = Notification::none;
+  }
+  if (match == Notification::lost && internalState == InternalState::connected) {
+    isLostPending = true;
+    lostReferenceTime = millis();
+  }
+
+  // A complete record can be passed on right away, except for what may be
+  // the start of "OK+LOST". That is passed on with the next flush.
+  if (
+    isUnframed
+    && value == delimiter
+    && internalState == InternalState::connected
+  ) {
+    if (deliverBuffer(sentinelLengthToKeep())) {
+      MHGROVEBLE_COUNT(flushesOnDelimiter, 1);
+    }
+  }
+  return match;
+}
+
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+void MHGroveBLE::receiveBufferedBytes()
+{
+  bool isUnframed = framing == Framing::none;
+  size_t droppedCount = 0;
+  unsigned int length = rxBuffer.length();
+  const uint8_t * data = rxBuffer.linearize();
+
+  // The bytes are received into the same storage they're read from. That's
+  // safe: the receive path never stores more bytes than it has been fed, so
+  // it only overwrites bytes that have already been handled.
+  rxBuffer.clear();
+  for (unsigned int i = 0; i < length; ++i) {
+    receiveByte(data[i], isUnframed, droppedCount);
+  }
+
+  if (isUnframed && !rxBuffer.isEmpty()) {
+    // Passed on like data that has just been read.
+    timeoutReferenceTime = millis();
+    timeoutDuration = kConnectedReadTimeout;
+  }
+}
+#endif
+
+int MHGroveBLE::readByte()
+{
+#if MHGROVEBLE_READ_CHUNK_SIZE > 0
+  static_assert(
+    MHGROVEBLE_READ_CHUNK_SIZE <= 255,
+    "MHGROVEBLE_READ_CHUNK_SIZE must fit into readChunkLength"
+  );
+  if (readChunkOffset < readChunkLength) {
+    return readChunk[readChunkOffset++];
+  }
+  if (reader) {
+    size_t length = reader(device, readChunk, sizeof(readChunk));
+    readChunkOffset = 0;
+    readChunkLength = length < sizeof(readChunk) ? length : sizeof(readChunk);
+    if (readChunkLength == 0) {
+      return -1;
+    }
+    return readChunk[readChunkOffset++];
+  }
+#endif
+
+  if (device.available() <= 0) {
+    return -1;
+  }
+  // Negative if there's nothing to read after all.
+  return device.read();
+}
+
+bool MHGroveBLE::isInputAvailable()
+{
+#if MHGROVEBLE_READ_CHUNK_SIZE > 0
+  if (readChunkOffset < readChunkLength) {
+    return true;
+  }
+#endif
+  return device.available() > 0;
+}
 
-void MHGroveBLE::transitionToState(MHGroveBLE::InternalState nextState)
+void MHGroveBLE::drainTxBuffer()
 {
   unsigned long now = millis();
-  InternalState skipToState = nextState;
 
-  if (debug) {
-    String text = F("Transitioning to state: ");
-    text += (int)nextState;
-    debug(text.c_str());
+  if (txBuffer.isEmpty() || !isTimeout(now, txReferenceTime, txInterval)) {
+    return;
   }
 
-  // Set most commonly needed values.
-  softTimeoutReferenceTime = 0;
-  softTimeoutDuration = 0;
-  timeoutReferenceTime = now;
-  timeoutDuration = kGenericCommandTimeout;
-
-  switch (nextState) {
-    case InternalState::startup:
-      break;
+  uint8_t chunk[kTxChunkSize];
+  unsigned int length = txBuffer.length();
+  if (length > kTxChunkSize) {
+    length = kTxChunkSize;
+  }
 
-    case InternalState::waitForDeviceAfterStartup:
-      sendCommand(F("AT"));
-      softTimeoutReferenceTime = now;
-      softTimeoutDuration = kWaitForDeviceRetryTimeout;
-      timeoutDuration = kWaitForDeviceTimeout;
-      break;
+  for (unsigned int i = 0; i < length; ++i) {
+    chunk[i] = txBuffer[i];
+  }
+  device.write(chunk, length);
+  MHGROVEBLE_COUNT(bytesSent, length);
+  txBuffer.removeFirst(length);
+  txReferenceTime = now;
+}
 
-    case InternalState::renew:
-      sendCommand(F("AT+RENEW"));
-      genericNextInternalState = InternalState::waitAfterRenew;
-      break;
+bool MHGroveBLE::canSend(size_t length)
+{
+  if (internalState != InternalState::connected) {
+    return false;
+  }
+  return txBuffer.capacity() == 0 || length <= txBuffer.freeSpace();
+}
 
-    case InternalState::waitAfterRenew:
-      // Documentation says that we should wait for 500ms after "AT+RENEW",
-      // but that's too short: communication wasn't stable with this delay.
-      // Even 600ms didn't work, while 750ms did work. Let's stay on the safe
-      // side and grant the device a full second.
-      timeoutDuration = 1000;
-      // The transition to the next state is handled in `runOnce()`.
-      break;
+void MHGroveBLE::transmit(const uint8_t * data, size_t length)
+{
+  if (txBuffer.capacity() == 0) {
+    device.write(data, length);
+    MHGROVEBLE_COUNT(bytesSent, length);
+    return;
+  }
 
-    case InternalState::getFirmwareVersion:
-      sendCommand(F("AT+VERS?"));
-      genericNextInternalState = InternalState::setName;
-      break;
+  for (size_t i = 0; i < length; ++i) {
+    txBuffer.push(data[i]);
+  }
+}
 
-    case InternalState::setName: {
-      String command = F("AT+NAME");
-      command += name;
-      sendCommand(command);
-      genericNextInternalState = InternalState::setPIN;
-      break;
+size_t MHGroveBLE::writeCobs(const uint8_t * data, size_t length, bool dryRun)
+{
+  // Every 0 is replaced by the code byte of the block following it, which
+  // holds the distance to the next 0. A block has at most 254 bytes: a block
+  // with code 0xFF isn't followed by a 0.
+  size_t encodedLength = 1;
+  size_t index = 0;
+
+  while (true) {
+    size_t blockStart = index;
+    while (index < length && data[index] != 0 && index - blockStart < 254) {
+      ++index;
     }
 
-    case InternalState::setPIN:
-      if (pin) {
-        String command = F("AT+PASS");
-        command += pin;
-        sendCommand(command);
-        genericNextInternalState = InternalState::setPINAuth;
-      } else {
-        skipToState = InternalState::setNotification;
-      }
-      break;
-
-    case InternalState::setPINAuth:
-      // The documentation explicitly says not to issue this command if the
-      // firmwareVersion is less than 515.
-      if (pin && firmwareVersion >= 515) {
-        sendCommand(F("AT+TYPE2")); // Auth with PIN
-        genericNextInternalState = InternalState::setNotification;
-      } else {
-        skipToState = InternalState::setNotification;
-      }
-      break;
-
-    case InternalState::setNotification:
-      sendCommand(F("AT+NOTI1"));
-      genericNextInternalState = InternalState::reset;
-      break;
+    uint8_t code = (uint8_t)(index - blockStart + 1);
+    encodedLength += code;
+    if (!dryRun) {
+      transmit(&code, 1);
+      transmit(data + blockStart, index - blockStart);
+    }
 
-    case InternalState::reset:
-      sendCommand(F("AT+RESET"));
+    if (index == length) {
       break;
+    }
+    if (code != 0xFF) {
+      // Skip the 0, it's implied by the code.
+      ++index;
+    }
+  }
 
-    case InternalState::waitForDeviceAfterReset:
-      sendCommand(F("AT"));
-      softTimeoutReferenceTime = now;
-      softTimeoutDuration = kWaitForDeviceRetryTimeout;
-      timeoutReferenceTime = now;
-      timeoutDuration = kWaitForDeviceTimeout;
-      break;
+  if (!dryRun) {
+    uint8_t delimiter = 0;
+    transmit(&delimiter, 1);
+  }
+  return encodedLength;
+}
 
-    case InternalState::initializationComplete:
-      // When we've reached the `initializationComplete` state, we just want to
-      // inform the handler and then continue to the `waitingForConnection`
-      // state right away.
-      if (onReady) {
-        onReady();
+void MHGroveBLE::receiveFramedByte(uint8_t value)
+{
+  bool isFrameEnd = false;
+
+  switch (framing) {
+    case Framing::none:
+      return;
+
+    case Framing::lengthPrefixed:
+      if (!frameInProgress) {
+        // Start a new frame. Empty frames are ignored.
+        rxBuffer.clear();
+        resetFrame();
+        frameRemaining = value;
+        frameInProgress = value > 0;
+        frameOverflow = value > rxBuffer.capacity();
+        return;
       }
-      skipToState = InternalState::waitingForConnection;
-      break;
 
-    case InternalState::waitingForConnection:
-      if (internalState == InternalState::connected && onDisconnect) {
-        onDisconnect();
+      if (!frameOverflow) {
+        rxBuffer.push(value);
       }
-      rxBuffer = "";
+      isFrameEnd = --frameRemaining == 0;
       break;
 
-    case InternalState::connected:
-      if (onConnect) {
-        onConnect();
+    case Framing::cobs:
+      if (value == 0) {
+        // End of frame. It's only valid if the last block is complete.
+        isFrameEnd = true;
+        frameOverflow = frameOverflow || !frameInProgress || frameRemaining > 0;
+        break;
       }
-      timeoutReferenceTime = 0;
-      timeoutDuration = 0;
-      break;
 
-    case InternalState::panicked:
-      if (debug) {
-        debug("Panic!");
-      }
-      if (onPanic) {
-        onPanic();
+      if (!frameInProgress || frameRemaining == 0) {
+        // Start of a new block. Unless the previous block was a full one, a 0
+        // lies between the two.
+        if (frameInProgress && cobsCode != 0xFF) {
+          frameOverflow = frameOverflow || rxBuffer.push(0);
+        }
+        frameInProgress = true;
+        cobsCode = value;
+        frameRemaining = value - 1;
+        return;
       }
-      break;
+
+      frameOverflow = frameOverflow || rxBuffer.push(value);
+      --frameRemaining;
+      return;
   }
 
-  internalState = nextState;
+  if (!isFrameEnd) {
+    return;
+  }
 
-  if (skipToState != nextState) {
-    transitionToState(skipToState);
+  if (frameOverflow) {
+    MHGROVEBLE_COUNT(framesDropped, 1);
+  } else {
+    MHGROVEBLE_COUNT(framesReceived, 1);
+    MHGROVEBLE_TRACE(frameDelivered, rxBuffer.length());
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0
+    recordDuration(stats.receiveLatency, micros() - messageStartTime);
+#endif
+    callBytesHandler(
+      onFrameReceived, kHandlerFrameReceived,
+      rxBuffer.linearize(), rxBuffer.length()
+    );
   }
+  rxBuffer.clear();
+  resetFrame();
 }
 
-void MHGroveBLE::sendCommand(const String & command)
+void MHGroveBLE::resetFrame()
 {
-  if (debug) {
-    String text = F("Sending command: ");
-    text += command;
-    debug(text.c_str());
+  frameInProgress = false;
+  frameOverflow = false;
+  frameRemaining = 0;
+  cobsCode = 0;
+}
+
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+bool MHGroveBLE::enqueueCommand(
+  const char * command,
+  bool isFlash,
+  CommandHandler handler,
+  uint16_t timeout,
+  bool isChained
+)
+{
+  if (
+    commandQueueLength >= MHGROVEBLE_COMMAND_QUEUE_SIZE
+    || internalState == InternalState::panicked
+  ) {
+    return false;
   }
 
-  device.print(command);
+  QueuedCommand & entry =
+    commandQueue[(commandQueueHead + commandQueueLength) % MHGROVEBLE_COMMAND_QUEUE_SIZE];
+  entry.command = command;
+  entry.handler = handler;
+  entry.timeout = timeout;
+  entry.isFlash = isFlash;
+  entry.isChained = isChained;
+  ++commandQueueLength;
+  return true;
+}
 
-  // Clear the receive buffer after sending a command.
-  rxBuffer = "";
+void MHGroveBLE::finishCommand(CommandResult result)
+{
+  // Remove the command first: the handler may queue another one or call
+  // `recover()`.
+  CommandHandler handler = commandQueue[commandQueueHead].handler;
+  commandQueueHead = (commandQueueHead + 1) % MHGROVEBLE_COMMAND_QUEUE_SIZE;
+  --commandQueueLength;
+  isCommandInFlight = false;
+
+  if (result != CommandResult::success) {
+    rxBuffer.clear();
+  }
+  if (handler) {
+    handler(*this, result, rxBuffer.linearize(), rxBuffer.length());
+  }
+  rxBuffer.clear();
+
+  // The rest of the chain depends on this command.
+  if (
+    result != CommandResult::success
+    && commandQueueLength > 0
+    && commandQueue[commandQueueHead].isChained
+  ) {
+    finishCommand(CommandResult::cancelled);
+  }
 }
+#endif
 
-bool MHGroveBLE::readIntoBuffer()
+void MHGroveBLE::setInstanceHandler(uint8_t handlerBit, bool isInstanceHandler)
 {
-  bool didReceive = false;
+  if (isInstanceHandler) {
+    instanceHandlers |= handlerBit;
+  } else {
+    instanceHandlers &= ~handlerBit;
+  }
+}
 
-  while (device.available() > 0) {
-    int value = device.read();
-    if (value < 0) {
-      // Shouldn't happen? We asked whether there's stuff available!
-      break;
+void MHGroveBLE::callHandler(const Handler & handler, uint8_t handlerBit)
+{
+  if (instanceHandlers & handlerBit) {
+    if (handler.instance) {
+      handler.instance(*this);
     }
+  } else if (handler.plain) {
+    handler.plain();
+  }
+}
 
-    if (rxBuffer.length() == rxBufferSize) {
-      // We don't want to grow the receive buffer. Discard old data.
-      rxBuffer.remove(0, 1);
+void MHGroveBLE::callBytesHandler(
+  const BytesHandler & handler,
+  uint8_t handlerBit,
+  const uint8_t * data,
+  size_t length
+)
+{
+  if (instanceHandlers & handlerBit) {
+    if (handler.instance) {
+      handler.instance(*this, data, length);
     }
+  } else if (handler.plain) {
+    handler.plain(data, length);
+  }
+}
 
-    rxBuffer += (char)value;
-    didReceive = true;
+bool MHGroveBLE::deliverBuffer(unsigned int keepLength)
+{
+  if (keepLength >= rxBuffer.length()) {
+    return false;
   }
 
-  return didReceive;
+  unsigned int length = rxBuffer.length() - keepLength;
+  MHGROVEBLE_COUNT(flushes, 1);
+  MHGROVEBLE_TRACE(dataDelivered, length);
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0
+  recordDuration(stats.receiveLatency, micros() - messageStartTime);
+#endif
+  callBytesHandler(
+    onBytesReceived, kHandlerBytesReceived,
+    rxBuffer.linearize(), length
+  );
+#if MHGROVEBLE_STRING_HANDLERS > 0
+  if (instanceHandlers & kHandlerDataReceived) {
+    if (onDataReceived.instance) {
+      onDataReceived.instance(*this, rxBufferToString(length));
+    }
+  } else if (onDataReceived.plain) {
+    onDataReceived.plain(rxBufferToString(length));
+  }
+#endif
+  rxBuffer.removeFirst(length);
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0
+  if (!rxBuffer.isEmpty()) {
+    // The bytes kept back start the next message.
+    messageStartTime = micros();
+  }
+#endif
+  return true;
+}
+
+unsigned long MHGroveBLE::lostTimeout() const
+{
+  // A frame is sent in one go, so inside one "OK+LOST" is payload unless the
+  // frame then stops short.
+  return frameInProgress ? kFrameLostTimeout : responseIdleTimeout;
+}
+
+unsigned int MHGroveBLE::sentinelLengthToKeep()
+{
+  typedef MHNotificationMatcher::Notification Notification;
+  unsigned int length =
+    isLostPending
+    ? MHNotificationMatcher::length(Notification::lost)
+    : notificationMatcher.matchedLength(Notification::lost);
+
+  if (length >= rxBuffer.length()) {
+    // A full buffer has to make room, even if that passes on a part of the
+    // sentinel.
+    return rxBuffer.isFull() ? 0 : rxBuffer.length();
+  }
+  return length;
+}
+
+String MHGroveBLE::rxBufferToString(unsigned int length)
+{
+  String text;
+  const uint8_t * data = rxBuffer.linearize();
+
+  text.reserve(length);
+  for (unsigned int i = 0; i < length; ++i) {
+    text += (char)data[i];
+  }
+  return text;
 }
 
 MHGroveBLE::ResponseState MHGroveBLE::receiveResponse()
@@ -419,21 +2651,28 @@ MHGroveBLE::ResponseState MHGroveBLE::receiveResponse()
     ? isTimeout(now, softTimeoutReferenceTime, softTimeoutDuration)
     : false;
 
+  bool isComplete = false;
+
   if (readIntoBuffer()) {
     // We've read response data! We don't need to wait for the complete timeout
     // now, it's enough to wait until the response text is likely complete.
     softTimeoutReferenceTime = now;
-    softTimeoutDuration = kReceiveResponseEarlyTimeout;
+    softTimeoutDuration = responseIdleTimeout;
+    // If we know what the response looks like, we don't need to wait at all.
+    isComplete = isExpectedResponse();
   }
 
-  if (softTimeoutReached || timeoutReached) {
+  if (isComplete || softTimeoutReached || timeoutReached) {
     if (rxBuffer.length() > 0) {
       // We reached a timeout and have data! We're done.
+#if MHGROVEBLE_LOG_LEVEL >= MHGROVEBLE_LOG_INFO
       if (debug) {
         String text = F("Received response: ");
-        text += rxBuffer;
+        text += rxBufferToString(rxBuffer.length());
         debug(text.c_str());
       }
+#endif
+      MHGROVEBLE_TRACE(responseReceived, rxBuffer.length());
       return ResponseState::success;
 
     } else if (timeoutReached) {
@@ -460,7 +2699,23 @@ void MHGroveBLE::handleWaitForDevice()
       break;
 
     case ResponseState::needRetry:
-      sendCommand(F("AT"));
+      // The first retry is done with the same baud rate: the device might
+      // still be booting. After a renew, the baud rate is known.
+      if (
+        onBaudRateChange
+        && retryCount > 0
+        && !(
+          (int)internalState < kInitStepCount
+          && (pgm_read_word(&kInitSteps[(int)internalState].flags) & kApplyFactoryBaudRate)
+        )
+      ) {
+        // Maybe the device is using another baud rate; try the next one.
+        int index = baudRateIndex(baudRate != 0 ? baudRate : kFactoryBaudRate);
+        changeBaudRate(pgm_read_dword(&kBaudRates[(index + 1) % kBaudRateCount]));
+      }
+      ++retryCount;
+      MHGROVEBLE_COUNT(commandRetries, 1);
+      sendCommand(kCommandAT, nullptr, reinterpret_cast<const __FlashStringHelper *>(kResponseOK));
       break;
 
     case ResponseState::timedOut:
@@ -468,119 +2723,413 @@ void MHGroveBLE::handleWaitForDevice()
       break;
 
     case ResponseState::success:
-      switch (internalState) {
-        case InternalState::waitForDeviceAfterStartup:
-          transitionToState(InternalState::renew);
-          break;
+      transitionToState((InternalState)((int)internalState + 1));
+      break;
+  }
+}
+
+void MHGroveBLE::handleInitStep()
+{
+  InternalState nextState = (InternalState)((int)internalState + 1);
+  uint8_t kind = pgm_read_byte(&kInitSteps[(int)internalState].kind);
+  uint8_t setting = pgm_read_byte(&kInitSteps[(int)internalState].setting);
 
-        case InternalState::waitForDeviceAfterReset:
-          transitionToState(InternalState::initializationComplete);
-          break;
+  switch (kind) {
+    case kStepNone:
+      transitionToState(nextState);
+      return;
 
-        default:
-          // Bug! Must not happen.
-          panic();
+    case kStepDelay:
+      if (isTimeout(millis(), timeoutReferenceTime, timeoutDuration)) {
+        transitionToState(nextState);
       }
+      return;
+
+    case kStepWaitForDevice:
+      handleWaitForDevice();
+      return;
+
+    default:
       break;
   }
-}
 
-void MHGroveBLE::handleGenericCommand()
-{
   switch (receiveResponse()) {
     case ResponseState::receiving:
       break;
 
     case ResponseState::needRetry: // Bug, must not happen
-    case ResponseState::timedOut:
       panic();
       break;
 
+    case ResponseState::timedOut:
+      if (kind == kStepQuery) {
+        // Treat it as a mismatch: an unanswered query must not prevent us
+        // from writing the setting.
+        pendingSettings |= setting;
+        transitionToState(nextState);
+      } else if (kind == kStepReset) {
+        // Try waiting for the device.
+        transitionToState(nextState);
+      } else {
+        panic();
+      }
+      break;
+
     case ResponseState::success:
-      transitionToState(genericNextInternalState);
+      if (kind == kStepQuery) {
+        // The expected response has been passed to `sendCommand`.
+        if (!isExpectedResponse()) {
+          pendingSettings |= setting;
+        }
+      } else if (kind == kStepFirmwareVersion) {
+        // We expect a string like "HMSoft V540".
+        if (rxBuffer.startsWith(reinterpret_cast<const __FlashStringHelper *>(kResponseVersion))) {
+          firmwareVersion = 0;
+          for (unsigned int i = 8; i < rxBuffer.length(); ++i) {
+            uint8_t digit = rxBuffer[i];
+            if (digit < '0' || digit > '9') {
+              break;
+            }
+            firmwareVersion = firmwareVersion * 10 + (digit - '0');
+          }
+#if MHGROVEBLE_LOG_LEVEL >= MHGROVEBLE_LOG_INFO
+          if (debug) {
+            String text = F("Detected firmware version: ");
+            text += firmwareVersion;
+            debug(text.c_str());
+          }
+#endif
+        }
+        if (fingerprintLoader && fingerprintStorer) {
+          storedFingerprint = fingerprintLoader();
+          if (storedFingerprint == configurationFingerprint()) {
+#if MHGROVEBLE_LOG_LEVEL >= MHGROVEBLE_LOG_INFO
+            if (debug) {
+              String text =
+                F("Configuration unchanged, skipping initialization");
+              debug(text.c_str());
+            }
+#endif
+            pendingSettings = 0;
+            nextState = InternalState::initializationComplete;
+          } else if (storedFingerprint != 0) {
+            // The module is about to change, so the old fingerprint must not
+            // match if the initialization is interrupted.
+            fingerprintStorer(0);
+            storedFingerprint = 0;
+          }
+        }
+      } else if (kind == kStepSetupCommands && sendSetupCommand()) {
+        // Give the next command the full timeout.
+        timeoutReferenceTime = millis();
+        softTimeoutDuration = 0;
+        break;
+      }
+      transitionToState(nextState);
       break;
   }
 }
 
-void MHGroveBLE::handleGetFirmwareVersion()
+void MHGroveBLE::handleWaitForConnect()
 {
-  switch (receiveResponse()) {
+  if (!readIntoBuffer()) {
+    // Only send a command if nothing arrived, so it doesn't delay a
+    // connection notification.
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+    if (commandQueueLength > 0) {
+      transitionToState(InternalState::runningCommand);
+      return;
+    }
+#endif
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+    if (
+      role == Role::central
+      && isTimeout(millis(), connectRetryReferenceTime, connectRetryDelay)
+    ) {
+      transitionToState(InternalState::connectingToPeer);
+    }
+#endif
+    return;
+  }
+
+  if (notification == MHNotificationMatcher::Notification::connected) {
+    rxBuffer.clear();
+    // Once we've received this string immediately transition to the "connected"
+    // state. There's no point in waiting for a timeout like when we're waiting
+    // for AT command responses.
+    // The matcher skips over any garbage we may have received before.
+    transitionToState(InternalState::connected);
+  }
+}
+
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+void MHGroveBLE::handleConnectingToPeer()
+{
+  if (connectProgress == kConnectResponse || connectProgress == kConnectNotified) {
+    // The byte after "OK+CONN" is read on its own: if it isn't a status, it's
+    // the first byte sent by the peer, and everything after it stays in the
+    // stream for the connected state.
+    int status = readByte();
+    if (status < 0) {
+      if (isTimeout(millis(), softTimeoutReferenceTime, softTimeoutDuration)) {
+        // Nothing followed, so this is the notification.
+        connectedToPeer(-1);
+      }
+      return;
+    }
+    MHGROVEBLE_COUNT(bytesReceived, 1);
+    MHGROVEBLE_TRACE(bytesRead, 1);
+
+    if (connectProgress == kConnectResponse) {
+      // The response to the command.
+      if (status == 'A' || status == 'L') {
+        connectProgress = kConnectConnecting;
+        timeoutReferenceTime = millis();
+        softTimeoutDuration = 0;
+        return;
+      }
+      if (status == 'E' || status == 'F' || status == 'N') {
+        connectToPeerFailed();
+        return;
+      }
+    } else if (status == 'F') {
+      connectProgress = kConnectFailPending;
+      softTimeoutReferenceTime = millis();
+      return;
+    }
+    connectedToPeer(status);
+    return;
+  }
+
+  if (connectProgress == kConnectFailPending) {
+    if (isInputAvailable()) {
+      // The peer sent the "F", and more.
+      connectedToPeer('F');
+    } else if (isTimeout(millis(), softTimeoutReferenceTime, softTimeoutDuration)) {
+      connectToPeerFailed();
+    }
+    return;
+  }
+
+  // Waiting for "OK+CONN", which `readIntoBuffer` stops at. Anything else is
+  // dropped.
+  ResponseState state = receiveResponse();
+  if (notification == MHNotificationMatcher::Notification::connected) {
+    rxBuffer.clear();
+    connectProgress =
+      connectProgress == kConnectSent ? kConnectResponse : kConnectNotified;
+    softTimeoutReferenceTime = millis();
+    softTimeoutDuration = responseIdleTimeout;
+    return;
+  }
+
+  switch (state) {
     case ResponseState::receiving:
-      break;
+      return;
 
     case ResponseState::needRetry: // Bug, must not happen
     case ResponseState::timedOut:
-      panic();
-      break;
+      connectToPeerFailed();
+      return;
 
     case ResponseState::success:
-      // We expect a string like "HMSoft V540".
-      if (rxBuffer.startsWith(F("HMSoft V"))) {
-        rxBuffer.remove(0, 8);
-        firmwareVersion = rxBuffer.toInt();
-        if (debug) {
-          String text = F("Detected firmware version: ");
-          text += firmwareVersion;
-          debug(text.c_str());
-        }
+      break;
+  }
+
+  if (connectProgress == kConnectSent) {
+    // Not a response to the connection attempt.
+    connectToPeerFailed();
+    return;
+  }
+
+  // Still connecting: wait for the notification.
+  rxBuffer.clear();
+  softTimeoutDuration = 0;
+}
+
+void MHGroveBLE::connectedToPeer(int firstByte)
+{
+  connectingAfterDiscovery = false;
+  rxBuffer.clear();
+  transitionToState(InternalState::connected);
+  if (internalState == InternalState::connected && firstByte >= 0) {
+    // Like in `handleWaitForConnect`, it's received in the connected state.
+    rxBuffer.push((uint8_t)firstByte);
+    receiveBufferedBytes();
+  }
+}
+
+void MHGroveBLE::handleDiscoveringPeers()
+{
+  bool isComplete = readIntoBuffer() && parseDiscoveredPeers();
+  if (!isComplete && !isTimeout(millis(), timeoutReferenceTime, timeoutDuration)) {
+    return;
+  }
+
+  rxBuffer.clear();
+  if (discoveredPeerCount == 0) {
+    connectRetryReferenceTime = millis();
+    connectRetryDelay = kConnectRetryDelay;
+    transitionToState(InternalState::waitingForConnection);
+    return;
+  }
+
+  // The first peer found becomes the known peer.
+  memcpy(peerAddress, discoveredPeers[0], sizeof(peerAddress));
+  connectingAfterDiscovery = true;
+  transitionToState(InternalState::connectingToPeer);
+}
+
+void MHGroveBLE::connectToPeerFailed()
+{
+  rxBuffer.clear();
+
+  if (!peerAddress[0]) {
+    // "AT+CONNL" failed, look for peers.
+    transitionToState(InternalState::discoveringPeers);
+    return;
+  }
+
+  if (connectingAfterDiscovery) {
+    // The peer wasn't known before, pick one again next time.
+    peerAddress[0] = 0;
+    connectingAfterDiscovery = false;
+  }
+  connectRetryReferenceTime = millis();
+  connectRetryDelay = kConnectRetryDelay;
+  transitionToState(InternalState::waitingForConnection);
+}
+
+bool MHGroveBLE::parseDiscoveredPeers()
+{
+  // Entries look like "OK+DIS0:0017EA090909" (some firmware versions use
+  // "OK+DISC:"), enclosed in "OK+DISCS" and "OK+DISCE".
+  const uint8_t prefixLength = strlen_P(kResponseDiscovery);
+
+  for (;;) {
+    int index = rxBuffer.indexOf(
+      reinterpret_cast<const __FlashStringHelper *>(kResponseDiscovery)
+    );
+    if (index < 0) {
+      // Keep what may be the start of the next entry.
+      if (rxBuffer.length() > prefixLength) {
+        rxBuffer.removeFirst(rxBuffer.length() - prefixLength);
       }
+      return false;
+    }
+    rxBuffer.removeFirst(index);
 
-      transitionToState(genericNextInternalState);
-      break;
+    if (rxBuffer.length() < prefixLength + 2u) {
+      return false;
+    }
+    if (rxBuffer[prefixLength] == 'C' && rxBuffer[prefixLength + 1] == 'E') {
+      return true;
+    }
+    if (rxBuffer[prefixLength + 1] != ':') {
+      // "OK+DISCS" or something unknown.
+      rxBuffer.removeFirst(prefixLength);
+      continue;
+    }
+
+    unsigned int entryLength = prefixLength + 2 + kPeerAddressLength;
+    if (rxBuffer.length() < entryLength) {
+      return false;
+    }
+
+    char address[kPeerAddressLength + 1];
+    for (uint8_t i = 0; i < kPeerAddressLength; ++i) {
+      address[i] = rxBuffer[prefixLength + 2 + i];
+    }
+    address[kPeerAddressLength] = 0;
+    rxBuffer.removeFirst(entryLength);
+
+    bool isKnown = false;
+    for (uint8_t i = 0; i < discoveredPeerCount; ++i) {
+      if (strcmp(discoveredPeers[i], address) == 0) {
+        isKnown = true;
+      }
+    }
+    if (!isKnown && discoveredPeerCount < MHGROVEBLE_PEER_CACHE_SIZE) {
+      memcpy(discoveredPeers[discoveredPeerCount++], address, sizeof(address));
+    }
   }
 }
+#endif
 
-void MHGroveBLE::handleReset()
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+void MHGroveBLE::handleRunningCommand()
 {
-  switch (receiveResponse()) {
+  ResponseState state = receiveResponse();
+
+  if (notification == MHNotificationMatcher::Notification::connected) {
+    // A peer connected in the middle of the command. What has arrived of
+    // the response may be cut off, so it's dropped.
+    finishCommand(CommandResult::cancelled);
+    if (internalState == InternalState::runningCommand) {
+      rxBuffer.clear();
+      transitionToState(InternalState::connected);
+    }
+    return;
+  }
+
+  switch (state) {
     case ResponseState::receiving:
-      break;
+      return;
 
     case ResponseState::needRetry: // Bug, must not happen
-      panic();
+    case ResponseState::timedOut:
+      finishCommand(CommandResult::timedOut);
       break;
 
-    case ResponseState::timedOut:
-      // Try waiting for the device.
-      // Fall-through
     case ResponseState::success:
-      transitionToState(InternalState::waitForDeviceAfterReset);
+      finishCommand(CommandResult::success);
       break;
   }
-}
 
-void MHGroveBLE::handleWaitForConnect()
-{
-  if (!readIntoBuffer()) {
+  if (internalState != InternalState::runningCommand) {
+    // The handler changed the state, e.g. by calling `recover()`.
     return;
   }
 
-  if (rxBuffer.indexOf(F("OK+CONN")) != -1) {
-    rxBuffer = "";
-    // Once we've received this string immediately transition to the "connected"
-    // state. There's no point in waiting for a timeout like when we're waiting
-    // for AT command responses.
-    // The point of doing this with `indexOf` is to recover if we have received
-    // garbage before.
-    transitionToState(InternalState::connected);
-  }
+  // Send the next command right away, e.g. the next step of a chain. This
+  // doesn't delay a connection notification: it would have ended the
+  // response.
+  transitionToState(
+    commandQueueLength > 0
+    ? InternalState::runningCommand
+    : InternalState::waitingForConnection
+  );
 }
 
+#endif
+
 void MHGroveBLE::handleConnected()
 {
+  drainTxBuffer();
+
   unsigned long now = millis();
-  bool connectionClosed = false;
   bool dataWasRead = readIntoBuffer();
+  bool connectionClosed =
+    notification == MHNotificationMatcher::Notification::lost;
   bool timeoutReached =
     timeoutDuration > 0
     ? isTimeout(now, timeoutReferenceTime, timeoutDuration)
     : false;
 
-  if (!dataWasRead && !timeoutReached) {
+  if (!dataWasRead && !timeoutReached && !connectionClosed) {
     // Nothing happened, no need to react yet.
     return;
   }
 
+  if (framing != Framing::none) {
+    // Frames have already been passed to the handler as they arrived. A
+    // partially received frame is lost once the connection is closed.
+    if (connectionClosed) {
+      transitionToState(InternalState::waitingForConnection);
+    }
+    return;
+  }
+
   if (dataWasRead) {
     // Every time we read data we need to reset our timeout to avoid
     // timing out in the middle of a stream.
@@ -588,9 +3137,11 @@ void MHGroveBLE::handleConnected()
     timeoutDuration = kConnectedReadTimeout;
   }
 
-  // Pass the data to the handler if either the timeout occurred or if the
-  // receive buffer is full. The later is necessary to not lose any data.
-  if (timeoutReached || rxBuffer.length() == rxBufferSize) {
+  // Pass the data to the handler if either the timeout occurred, if the
+  // receive buffer is full or has reached the watermark, or if the connection
+  // was closed. The full buffer case is necessary to not lose any data.
+  bool watermarkReached = highWatermark > 0 && rxBuffer.length() >= highWatermark;
+  if (timeoutReached || rxBuffer.isFull() || watermarkReached || connectionClosed) {
     // The Grove BLE sends "OK+LOST" when the connection is closed.
     // Unfortunately, an app is also able to send this string and we don't know
     // whether the Grove BLE or the app has sent it.
@@ -598,23 +3149,41 @@ void MHGroveBLE::handleConnected()
     // garbage: it's possible that an app sends "OK+LOST" and once the
     // connection is really closed, another "OK+LOST" is sent by Grove BLE
     // before the "OK+CONN" for a new connection arrives.
-    int index = rxBuffer.lastIndexOf(F("OK+LOST"));
-    // Check whether it's the last thing in the buffer to avoid reacting on the
-    // string being part of some other text.
-    if (index >= 0 && ((unsigned)index+7 == rxBuffer.length())) {
-      connectionClosed = true;
-      // Remove the sentinel.
-      rxBuffer.remove(index);
-    }
-
-    // Pass the data to the handler...
-    if (onDataReceived && rxBuffer.length() > 0) {
-      onDataReceived(rxBuffer);
-    }
-    // ... and clear it.
-    rxBuffer = "";
-    timeoutReferenceTime = 0;
-    timeoutDuration = 0;
+    if (connectionClosed) {
+      // Remove the sentinel. Part of it may already have been passed to the
+      // handler if the buffer ran full in the middle of it.
+      unsigned int sentinelLength =
+        MHNotificationMatcher::length(MHNotificationMatcher::Notification::lost);
+      rxBuffer.removeLast(
+        sentinelLength < rxBuffer.length() ? sentinelLength : rxBuffer.length()
+      );
+    }
+
+    // Keep back what may be the start of "OK+LOST" sent by the module until
+    // the match either completes or breaks off. Once nothing has followed it
+    // for the timeout, a partial match is just data; bytes read just now may
+    // be the start of the real one after a pause.
+    unsigned int keepLength =
+      !connectionClosed && (isLostPending || dataWasRead || !timeoutReached)
+      ? sentinelLengthToKeep()
+      : 0;
+    bool wasFull = rxBuffer.isFull();
+    if (deliverBuffer(keepLength)) {
+      if (connectionClosed) {
+        MHGROVEBLE_COUNT(flushesOnDisconnect, 1);
+      } else if (timeoutReached) {
+        MHGROVEBLE_COUNT(flushesOnTimeout, 1);
+      } else if (wasFull) {
+        MHGROVEBLE_COUNT(flushesOnBufferFull, 1);
+      } else {
+        MHGROVEBLE_COUNT(flushesOnWatermark, 1);
+      }
+    }
+    if (rxBuffer.isEmpty()) {
+      // Otherwise, the timeout passes on what has been kept back.
+      timeoutReferenceTime = 0;
+      timeoutDuration = 0;
+    }
   }
 
   if (connectionClosed) {
@@ -25,8 +25,13 @@ SOFTWARE.
 #ifndef MHGROVEBLE_H
 #define MHGROVEBLE_H
 
-#include <Arduino.h>
-#include <SoftwareSerial.h>
+#include "MHGroveBLEHal.h"
+#include "MHGroveBLEConfig.h"
+#include "MHNotificationMatcher.h"
+#include "MHRingBuffer.h"
+
+// The namespace depends on the settings, see `MHGroveBLEConfig.h`.
+inline namespace MHGROVEBLE_CONFIG_NAMESPACE {
 
 /** Client/server implementation using Seeed Grove BLE.
 
@@ -40,7 +45,9 @@ public:
   enum class State {
     /** Initialization is still being executed. */
     initializing,
-    /** An unrecoverable error occurred. The object is no longer able to function. */
+    /** An error occurred. The object does nothing until `recover()` is
+     called.
+     */
     panicked,
     /** Waiting for a peer to connect. */
     waitingForConnection,
@@ -48,13 +55,237 @@ public:
     connected,
   };
 
+  /** How messages are delimited in the data exchanged with the peer. */
+  enum class Framing : uint8_t {
+    /** No framing: data is passed on as it arrives. */
+    none,
+    /** Each frame is preceded by one byte holding its length (0 to 255). */
+    lengthPrefixed,
+    /** Each frame is COBS encoded and terminated by a 0 byte. */
+    cobs,
+  };
+
+  /** Handler that gets the object which calls it, see `setContext`. */
+  typedef void (*InstanceHandler) (MHGroveBLE & ble);
+  /** Data handler that gets the object which calls it. */
+  typedef void (*InstanceDataHandler) (MHGroveBLE & ble, const String & data);
+  /** Bytes or frame handler that gets the object which calls it. */
+  typedef void (*InstanceBytesHandler) (
+    MHGroveBLE & ble, const uint8_t * data, size_t length
+  );
+
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+  /** Outcome of a command queued with `enqueueCommand`. */
+  enum class CommandResult : uint8_t {
+    /** A response has been received. */
+    success,
+    /** The device didn't respond. */
+    timedOut,
+    /** A peer connected before the command could be completed, or the
+     object panicked.
+     */
+    cancelled,
+  };
+
+  /** Handler for the response to a queued command.
+
+   The response is not null-terminated and only valid during the call. It's
+   empty unless the result is `CommandResult::success`.
+   */
+  typedef void (*CommandHandler) (
+    MHGroveBLE & ble,
+    CommandResult result,
+    const uint8_t * response,
+    size_t length
+  );
+#endif
+
+  /** What happens when data arrives while the receive buffer is full, see
+   `setOverflowPolicy`.
+   */
+  enum class OverflowPolicy : uint8_t {
+    /** The oldest bytes in the receive buffer are discarded. */
+    overwrite,
+    /** Reading from the stream pauses until the buffer has been passed to
+     the data handlers, leaving the data in the stream's buffer.
+     */
+    stopReading,
+  };
+
+  /** Link settings applied during the initialization, see `setProfile`. */
+  enum class Profile : uint8_t {
+    /** The link settings are left alone. */
+    none,
+    /** Short advertising and connection intervals, so that connecting and
+     round trips are fast.
+     */
+    lowLatency,
+    /** The shortest connection interval that phones accept and the highest
+     transmit power, so that as many packets as possible get through.
+     */
+    highThroughput,
+    /** Long advertising and connection intervals and a reduced transmit
+     power.
+     */
+    lowPower,
+  };
+
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+  /** Whether the module waits for connections or connects to a peer itself,
+   see `setRole`.
+   */
+  enum class Role : uint8_t {
+    /** Advertise and wait for a central to connect. */
+    peripheral,
+    /** Connect to a peripheral: the last one, or one found by a discovery. */
+    central,
+  };
+
+  /** Number of characters in a peer address, e.g. "0017EA090909". */
+  static const uint8_t kPeerAddressLength = 12;
+#endif
+
+  /** Drop handler that gets the object which calls it. */
+  typedef void (*InstanceDropHandler) (MHGroveBLE & ble, size_t count);
+
+#if MHGROVEBLE_READ_CHUNK_SIZE > 0
+  /** Reads a block of data from the stream, see `setReader`.
+
+   @param stream The stream passed to the constructor.
+   @param buffer Where to store the data.
+   @param length Maximum number of bytes to read.
+   @return The number of bytes read, 0 if no data is available. Must not
+    block.
+   */
+  typedef size_t (*Reader) (Stream & stream, uint8_t * buffer, size_t length);
+#endif
+
+  /** Loads the fingerprint stored by a `FingerprintStorer`, see
+   `setFingerprintStorage`. Returns 0 if none has been stored.
+   */
+  typedef uint32_t (*FingerprintLoader) ();
+
+  /** Stores a fingerprint, e.g. in EEPROM, see `setFingerprintStorage`. */
+  typedef void (*FingerprintStorer) (uint32_t fingerprint);
+
+  /** Returned by `millisUntilNextEvent()` if there is no deadline. */
+  static const unsigned long kNoDeadline = (unsigned long)-1;
+
+  /** Number of initialization steps, see `Stats::initStepDurations`. */
+  static const uint8_t kInitStepCount = 32;
+
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0
+  /** Distribution of durations, in buckets that double in width: bucket 0
+   counts durations of 0 microseconds, bucket i those from 2^(i-1) to 2^i - 1
+   microseconds. The last bucket also counts all longer durations.
+   */
+  struct Histogram {
+    /** Number of durations in each bucket. */
+    uint32_t counts[MHGROVEBLE_HISTOGRAM_SIZE];
+    /** Longest duration recorded, in microseconds. */
+    uint32_t maximum;
+  };
+#endif
+
+#if MHGROVEBLE_STATS > 0
+  /** Runtime statistics, see `getStats()`. */
+  struct Stats {
+    /** Bytes read from the stream. */
+    uint32_t bytesReceived;
+    /** Bytes of data written to the peer. */
+    uint32_t bytesSent;
+    /** Bytes discarded because the receive buffer was full. */
+    uint32_t bytesDropped;
+    /** Number of times received data was passed to the data handlers. */
+    uint32_t flushes;
+    /** Flushes because no more data arrived for a while. */
+    uint32_t flushesOnTimeout;
+    /** Flushes because the receive buffer was full. */
+    uint32_t flushesOnBufferFull;
+    /** Flushes because the receive buffer reached the high watermark. */
+    uint32_t flushesOnWatermark;
+    /** Flushes because the delimiter arrived. */
+    uint32_t flushesOnDelimiter;
+    /** Flushes because the connection was closed. */
+    uint32_t flushesOnDisconnect;
+    /** Frames passed to the frame handler. */
+    uint32_t framesReceived;
+    /** Frames dropped because they were malformed or too large. */
+    uint32_t framesDropped;
+    /** Number of `runOnce()` calls that stopped reading because the read
+     budget was used up.
+     */
+    uint32_t budgetExhausted;
+    /** Number of times a command had to be resent. */
+    uint16_t commandRetries;
+    /** Number of established connections. */
+    uint16_t connects;
+    /** Number of closed connections. */
+    uint16_t disconnects;
+    /** Number of times the module responded again after `recover()`. */
+    uint16_t recoveries;
+    /** Number of discoveries run in the central role. */
+    uint16_t discoveries;
+    /** Duration of the last initialization, in milliseconds. */
+    uint32_t initDuration;
+    /** Time spent in each initialization step during the last
+     initialization, in milliseconds. The steps are listed in the order in
+     which they are executed by the `InternalState` enum in `MHGroveBLE.cpp`.
+     */
+    uint16_t initStepDurations[kInitStepCount];
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0
+    /** Time from reading the first byte of a message or frame to passing it
+     to the handlers. Without framing, a message is whatever is passed to the
+     data handlers at once.
+     */
+    Histogram receiveLatency;
+    /** Time spent in `runOnce()`, including the handlers it called. */
+    Histogram runDuration;
+#endif
+  };
+#endif
+
+#if MHGROVEBLE_TRACE_SIZE > 0
+  /** Kinds of events in the event trace. */
+  enum class TraceEventType : uint8_t {
+    /** Entered the internal state `state`. */
+    transition,
+    /** Sent a command of `count` bytes. */
+    commandSent,
+    /** Completed receiving a response of `count` bytes. */
+    responseReceived,
+    /** Read `count` bytes from the stream. */
+    bytesRead,
+    /** Passed `count` bytes of data to the data handlers. */
+    dataDelivered,
+    /** Passed a frame of `count` bytes to the frame handler. */
+    frameDelivered,
+  };
+
+  /** An event in the event trace, see `getTraceEvent`. */
+  struct TraceEvent {
+    /** Value of `micros()` when the event happened. */
+    uint32_t timestamp;
+    /** What happened. */
+    TraceEventType type;
+    /** The internal state when the event happened, as listed by the
+     `InternalState` enum in `MHGroveBLE.cpp`.
+     */
+    uint8_t state;
+    /** Number of bytes involved, if applicable. */
+    uint16_t count;
+  };
+#endif
+
   /** Constructor.
 
    @param stream The stream to read from and write to. If possible, pass a
     HardwareSerial, otherwise a SoftwareSerial or other compatible object.
    @param name Name of the Bluetooth device. This is what a user sees when
     browsing Bluetooth devices.
-   @param rxBufferSize Size of the receive buffer.
+   @param rxBufferSize Size of the receive buffer. The buffer is allocated on
+    the heap. If that fails, the object can't read any responses and panics
+    during the initialization.
    */
   MHGroveBLE(
     Stream & device,
@@ -62,52 +293,572 @@ public:
     unsigned int rxBufferSize = 128
   );
 
+  /** Constructor with caller-provided receive buffer memory.
+
+   No memory is allocated by the object.
+
+   @param stream The stream to read from and write to.
+   @param name Name of the Bluetooth device.
+   @param rxStorage Memory for the receive buffer. Must be at least
+    `rxBufferSize` bytes long and stay valid for the lifetime of the object.
+   @param rxBufferSize Size of the receive buffer.
+   */
+  MHGroveBLE(
+    Stream & device,
+    const char * name,
+    uint8_t * rxStorage,
+    unsigned int rxBufferSize
+  );
+
+  /** Destructor. */
+  ~MHGroveBLE();
+
+  /** Copying is not supported: the object may own its receive buffer. */
+  MHGroveBLE(const MHGroveBLE &) = delete;
+  MHGroveBLE & operator=(const MHGroveBLE &) = delete;
+
   /** Do any work, if possible.
 
    Call this in your `loop()` function.
+
+   @return Whether work is left: the read budget set with `setReadBudget` was
+    used up while more data was waiting in the stream. Call `runOnce()` again
+    soon, e.g. after the other tasks of your `loop()`.
+   */
+  bool runOnce();
+
+  /** Limit the work done by a single `runOnce()` call.
+
+   Once the given number of bytes has been read from the stream, or the given
+   time has passed, `runOnce()` stops reading and returns true. The rest of the
+   data stays in the stream. The time includes the data handlers called while
+   reading. At least one byte is read per call.
+
+   @param bytes The maximum number of bytes, or 0 for no limit (the default).
+   @param micros The maximum time in microseconds, or 0 for no limit (the
+    default).
    */
-  void runOnce();
+  void setReadBudget(unsigned int bytes, unsigned long micros = 0);
 
   /** Query the current state.
    */
   State getState();
 
+  /** Resume after a glitch, e.g. when the module stopped responding.
+
+   If the module has been initialized before, "AT" is sent until it responds
+   again, trying the other baud rates if a baud rate handler is set. Its
+   firmware version and settings are known, so the object then goes straight
+   back to waiting for a connection and calls the ready handler again. If the
+   module doesn't respond, the object panics. If it has never been
+   initialized, the whole initialization is restarted.
+
+   Can be called while panicked (also from the panic handler) or while waiting
+   for a connection, in which case a running queued command or, in the central
+   role, a discovery or connection attempt is cancelled. Not
+   possible while connected, as the module passes AT commands on to the peer;
+   that includes the handler of a command that was interrupted by a connect.
+
+   @return Whether the recovery was started.
+   */
+  bool recover();
+
+  /** Time until `runOnce()` needs to be called again, if no data arrives.
+
+   Instead of calling `runOnce()` continuously, an application may sleep or
+   wait for data from the stream until this time has passed. Data from the
+   stream always requires calling `runOnce()`.
+
+   @return The time in milliseconds, 0 if `runOnce()` has work to do right away,
+    or `kNoDeadline` if only data arriving from the stream can cause work.
+   */
+  unsigned long millisUntilNextEvent();
+
+  /** Whether data from the stream is expected soon.
+
+   This is the case while waiting for the response to a command or while a
+   message is partially received. If false, data may still arrive at any time,
+   e.g. when the peer sends something, but it's not expected.
+   */
+  bool isExpectingData();
+
+#if MHGROVEBLE_STATS > 0
+  /** Get the runtime statistics.
+
+   The counters are cheap to update; they start at 0 when the object is
+   created. Compile with `MHGROVEBLE_STATS` set to 0 to leave them out.
+   */
+  const Stats & getStats() const;
+
+  /** Reset all runtime statistics to 0. */
+  void resetStats();
+#endif
+
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0
+  /** Print the histograms of `Stats`, one bucket per line: the lower bound in
+   microseconds, the receive latency count and the `runOnce()` count. A final
+   line starting with "max" has the longest durations.
+
+   To read them remotely, print them into a buffer and `send()` it, or send
+   the `Histogram` structs as they are.
+   */
+  void printHistograms(Print & output) const;
+#endif
+
+#if MHGROVEBLE_TRACE_SIZE > 0
+  /** Number of events in the event trace.
+
+   The trace keeps the last `MHGROVEBLE_TRACE_SIZE` events. Recording them is
+   cheap and doesn't disturb the timing, unlike the debug messages.
+   */
+  unsigned int getTraceLength() const;
+
+  /** Get an event from the event trace.
+
+   @param index Index of the event, 0 is the oldest one.
+   @param event Receives the event.
+   @return Whether the index was valid.
+   */
+  bool getTraceEvent(unsigned int index, TraceEvent & event) const;
+
+  /** Print the event trace, one event per line. */
+  void printTrace(Print & output) const;
+
+  /** Discard all events in the event trace. */
+  void clearTrace();
+#endif
+
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+  /** Queue an AT command, e.g. `F("AT+RSSI?")`.
+
+   Queued commands are sent one after another from `runOnce()` while waiting
+   for a connection. While a peer is connected, AT commands can't be sent; the
+   commands stay queued until the connection is closed.
+
+   @param command The command. Must stay valid until the handler has been
+    called.
+   @param handler Called with the response, may be null.
+   @param timeout Time to wait for a response, in milliseconds.
+   @return Whether the command has been queued. False if the queue is full or
+    the object has panicked.
+   */
+  bool enqueueCommand(
+    const __FlashStringHelper * command,
+    CommandHandler handler,
+    uint16_t timeout = 1000
+  );
+
+  /** Queue an AT command stored in RAM, see above. */
+  bool enqueueCommand(
+    const char * command,
+    CommandHandler handler,
+    uint16_t timeout = 1000
+  );
+
+  /** Number of queued commands, including the one currently running. */
+  uint8_t getQueuedCommandCount() const;
+
+  /** Handle for adding steps to a command chain, see `command()`. */
+  class CommandChain {
+  public:
+    /** Queue a command that only runs if the previous step of the chain
+     succeeded. Otherwise its handler is called with
+     `CommandResult::cancelled`, like those of the steps after it.
+
+     @return The chain, for adding further steps. If the command couldn't be
+      queued, the steps added before it still run and all further steps are
+      ignored.
+     */
+    CommandChain then(
+      const __FlashStringHelper * command,
+      CommandHandler handler = nullptr,
+      uint16_t timeout = 1000
+    );
+
+    /** Queue a command stored in RAM, see above. */
+    CommandChain then(
+      const char * command,
+      CommandHandler handler = nullptr,
+      uint16_t timeout = 1000
+    );
+
+    /** Whether all steps of the chain have been queued. */
+    bool isQueued() const;
+
+  private:
+    friend class MHGroveBLE;
+
+    CommandChain(MHGroveBLE * ble);
+
+    /** The object the chain runs on, or null if a step couldn't be queued. */
+    MHGroveBLE * ble;
+  };
+
+  /** Start a chain of AT commands, e.g. to query a setting and then change
+   others:
+
+       ble.command(F("AT+RSSI?"), onSignalStrength)
+         .then(F("AT+POWE3"))
+         .then(F("AT+ADVI5"), onDone);
+
+   The steps are queued like with `enqueueCommand`. Each step is sent as soon
+   as the response to the previous one has arrived, within the same
+   `runOnce()` call. A step that fails or times out cancels the rest of the
+   chain. Add all steps right away: `then()` links to the command queued last.
+   A handler can also queue the next command itself, e.g. with a setting that
+   depends on the response; it's sent right after the handler returns if the
+   queue is empty otherwise.
+   */
+  CommandChain command(
+    const __FlashStringHelper * command,
+    CommandHandler handler = nullptr,
+    uint16_t timeout = 1000
+  );
+
+  /** Start a chain with a command stored in RAM, see above. */
+  CommandChain command(
+    const char * command,
+    CommandHandler handler = nullptr,
+    uint16_t timeout = 1000
+  );
+#endif
+
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+  /** Set the role of the module.
+
+   Defaults to `Role::peripheral`. As a central, the module is set up to only
+   act on AT commands ("AT+ROLE1", "AT+IMME1") and the object connects to a
+   peer whenever none is connected:
+
+   - With a known peer address, it connects to it directly ("AT+CON<address>")
+     and retries after a second if that fails.
+   - Otherwise it asks the module to connect to the last peer it was connected
+     to ("AT+CONNL"). If that fails, it discovers peers ("AT+DISC?"), keeps up
+     to `MHGROVEBLE_PEER_CACHE_SIZE` of their addresses and connects to the
+     first one, which becomes the known peer.
+
+   Data the peer sends right after the connection has been set up is passed
+   on, even if it arrives together with the notification. Only a single "F"
+   on its own looks like the module's "OK+CONNF" and is taken as a failed
+   attempt.
+
+   Call this function before calling `runOnce()`.
+   */
+  void setRole(Role role);
+
+  /** Set the address of the peer to connect to in the central role, e.g. one
+   stored from a previous run or one of `getDiscoveredPeer()`.
+
+   @param address The address with `kPeerAddressLength` hex digits, or null
+    to forget the known peer. Copied.
+   */
+  void setPeerAddress(const char * address);
+
+  /** The address of the known peer, or an empty string. */
+  const char * getPeerAddress() const;
+
+  /** Number of addresses found by the last discovery. */
+  uint8_t getDiscoveredPeerCount() const;
+
+  /** An address found by the last discovery, in the order they were found. */
+  const char * getDiscoveredPeer(uint8_t index) const;
+#endif
+
   /** Send data to the peer.
 
+   If a transmit buffer has been set, the data is queued and sent in chunks
+   from `runOnce()`. Otherwise it's sent right away.
+
    @param data The data to send.
-   @return Whether the data was sent.
+   @return Whether the data was sent or queued. If the transmit buffer doesn't
+    have enough space for all of the data, nothing is queued.
    */
   bool send(const String & data);
 
+  /** Send a null-terminated string, see above. */
+  bool send(const char * data);
+
+  /** Send bytes, see above. */
+  bool send(const uint8_t * data, size_t length);
+
+  /** Send a string stored in flash, see above. */
+  bool send(const __FlashStringHelper * data);
+
+  /** Send an object that can print itself, see above.
+
+   Without a transmit buffer, the object is printed straight to the stream.
+   With one, it's printed twice: once to check that it fits into the buffer
+   and once into the buffer.
+   */
+  bool send(const Printable & data);
+
+  /** Send a frame to the peer, encoded as set with `setFraming`.
+
+   Like `send()`, the frame is queued if a transmit buffer has been set.
+
+   @param data The frame to send.
+   @param length The length of the frame. At most 255 bytes with
+    `Framing::lengthPrefixed`.
+   @return Whether the frame was sent or queued. Always false with
+    `Framing::none`.
+   */
+  bool sendFrame(const uint8_t * data, size_t length);
+
+  /** Set a buffer for queueing outgoing data.
+
+   With a transmit buffer, `send()` returns right away and the data is sent in
+   chunks of 20 bytes (the payload size of a BLE packet) from `runOnce()`.
+   Call this function before calling `runOnce()`.
+
+   @param storage Memory for the transmit buffer. Must stay valid for the
+    lifetime of the object.
+   @param size Size of the transmit buffer.
+   */
+  void setTxBuffer(uint8_t * storage, unsigned int size);
+
+  /** Set the minimum time between two chunks sent from the transmit buffer.
+
+   @param interval The time in milliseconds. Defaults to 20ms.
+   */
+  void setTxInterval(unsigned long interval);
+
+  /** Number of bytes that can currently be queued by `send()`.
+
+   Returns 0 if no transmit buffer has been set.
+   */
+  unsigned int getTxBufferFree();
+
+#if MHGROVEBLE_PIN > 0
   /** Set the Bluetooth PIN.
 
    This must be a string with six digits, from "000000" to "999999".
    If you want to set the PIN, call this function before calling `runOnce()`.
    */
   void setPIN(const char * pin);
+#endif
+
+  /** Enable or disable fast booting.
+
+   By default, the module is reset to its factory defaults and then configured
+   on every start. With fast booting, the current settings of the module are
+   queried instead and only those that differ are written. If nothing needs to
+   be changed, the module is not reset at all.
+
+   Settings not managed by this class are not reset to their factory defaults
+   in this mode. Call this function before calling `runOnce()`.
+   */
+  void setFastBoot(bool enabled);
+
+  /** Skip the initialization on warm boots.
+
+   After a successful initialization, a fingerprint of the configuration (name,
+   PIN, profile, role, setup commands, current and target baud rate and
+   firmware version) is passed to `store`. On the next start, the object only
+   checks that the module responds and queries its firmware version. If the
+   fingerprint matches the one returned by `load`, the initialization is
+   complete right away; otherwise it runs as usual, in fast boot mode or not.
+
+   The fingerprint only changes when the configuration does, so `store` isn't
+   called on every start. Settings changed behind the object's back, e.g. with
+   `enqueueCommand`, aren't detected: store 0 to force a full initialization
+   on the next start. Call this function before calling `runOnce()`.
+   */
+  void setFingerprintStorage(FingerprintLoader load, FingerprintStorer store);
+
+  /** Set additional commands to send during the initialization, e.g. to set
+   the transmit power or the advertising interval.
+
+   The commands are sent after the settings managed by this class, before the
+   device is reset. Like those, they are stored in flash.
+
+   @param commands The commands, separated by newlines, e.g.
+    `F("AT+POWE3\nAT+ADVI5")`. Must stay valid for the lifetime of the object.
+   @param needsReset Whether the device needs to be reset for the commands to
+    take effect. In fast boot mode, this means the device is reset on every
+    start.
+   */
+  void setSetupCommands(const __FlashStringHelper * commands, bool needsReset = true);
+
+  /** Select a preset for the advertising interval ("AT+ADVI"), the transmit
+   power ("AT+POWE") and the connection interval ("AT+COMI").
+
+   The preset is written during the initialization, before the setup commands,
+   so these can still override single values. The module never enters the
+   automatic sleep mode ("AT+PWRM0"); it doesn't respond to AT commands while
+   sleeping. "AT+COMI" is only sent to firmware versions that support it.
+
+   | Profile        | Advertising | Power  | Connection    |
+   | -------------- | ----------- | ------ | ------------- |
+   | lowLatency     | 100ms       | 0dBm   | 7.5ms         |
+   | highThroughput | 318.75ms    | 6dBm   | 15ms          |
+   | lowPower       | 1285ms      | -6dBm  | 45ms          |
+
+   Defaults to `Profile::none`. Call this function before calling `runOnce()`.
+   */
+  void setProfile(Profile profile);
+
+  /** Set the baud rate of the stream.
+
+   The module doesn't terminate its responses, so the end of a response is
+   detected by waiting until no more data arrives. Knowing the baud rate, this
+   wait can be reduced to a few character times instead of a conservative
+   fixed duration. Responses that are known in advance complete as soon as
+   they have been received, regardless of this setting.
+   */
+  void setBaudRate(unsigned long baud);
+
+  /** Set the baud rate the module should be switched to.
+
+   Supported are 9600, 19200, 38400, 57600 and 115200 baud. The switch requires
+   a handler set with `setOnBaudRateChange`. Call this function before calling
+   `runOnce()`.
+   */
+  void setTargetBaudRate(unsigned long baud);
+
+  /** Set a pointer for the application's own use, e.g. to tell several
+   modules apart in a handler. Defaults to null.
+   */
+  void setContext(void * context);
+
+  /** Get the pointer set with `setContext`. */
+  void * getContext() const;
 
   /** Handler: initialization has completed and the receiver is now waiting for
    connections.
+
+   Each handler can also be set as a function that gets the object calling it,
+   so one function can serve several modules. Only one variant of a handler is
+   active at a time. The setters for that variant are templates only so that
+   `setOnReady(nullptr)` and `setOnReady(NULL)` aren't ambiguous: they pick
+   the plain variant, which clears the handler.
    */
   void setOnReady(void (*) ());
+  template <typename = void>
+  void setOnReady(InstanceHandler onFunc) { setOnReadyInstance(onFunc); }
 
   /** Handler: an unrecoverable error occurred. The receiver has shut down.
    */
   void setOnPanic(void (*) ());
+  template <typename = void>
+  void setOnPanic(InstanceHandler onFunc) { setOnPanicInstance(onFunc); }
 
+#if MHGROVEBLE_CONNECTION_HANDLERS > 0
   /** Handler: a connection to a peer has been established.
    */
   void setOnConnect(void (*) ());
+  template <typename = void>
+  void setOnConnect(InstanceHandler onFunc) { setOnConnectInstance(onFunc); }
 
   /** Handler: a connection to a peer has been closed.
    */
   void setOnDisconnect(void (*) ());
+  template <typename = void>
+  void setOnDisconnect(InstanceHandler onFunc) { setOnDisconnectInstance(onFunc); }
+#endif
 
+#if MHGROVEBLE_STRING_HANDLERS > 0
   /** Handler: data has been received from peer.
    */
   void setOnDataReceived(void (*) (const String & data));
+  template <typename = void>
+  void setOnDataReceived(InstanceDataHandler onFunc) { setOnDataReceivedInstance(onFunc); }
+#endif
+
+  /** Handler: data has been received from peer.
+
+   In contrast to `setOnDataReceived` no string is created: the handler gets a
+   pointer directly into the receive buffer, which is only valid during the
+   call. Use this for binary data.
+   */
+  void setOnBytesReceived(void (*) (const uint8_t * data, size_t length));
+  template <typename = void>
+  void setOnBytesReceived(InstanceBytesHandler onFunc) { setOnBytesReceivedInstance(onFunc); }
+
+  /** Set a delimiter, like '\n', for passing on received data early.
+
+   Without framing, received data is passed to the data handlers once no more
+   data has arrived for a while or the receive buffer is full. With a
+   delimiter, all data up to and including the delimiter is passed on as soon
+   as the delimiter arrives. Any data after it stays in the buffer.
+
+   @param delimiter The delimiter byte, or -1 to not use a delimiter.
+   */
+  void setDelimiter(int delimiter);
+
+  /** Pass received data on once the receive buffer contains this many bytes.
+
+   Without framing, received data is passed on once no more data has arrived
+   for a while. While data keeps arriving, this limits the latency.
+
+   @param watermark The number of bytes, or 0 to only pass data on when the
+    receive buffer is full.
+   */
+  void setHighWatermark(unsigned int watermark);
+
+  /** Set what happens when data arrives while the receive buffer is full.
+
+   Defaults to `OverflowPolicy::overwrite`. With `OverflowPolicy::stopReading`
+   no data is lost as long as the stream can buffer it, e.g. a HardwareSerial
+   with a large enough receive buffer. Not used with framing.
+   */
+  void setOverflowPolicy(OverflowPolicy policy);
+
+#if MHGROVEBLE_READ_CHUNK_SIZE > 0
+  /** Read from the stream in blocks instead of byte by byte.
+
+   By default, received data is read with one call of `available()` and one of
+   `read()` per byte. A reader fetches up to `MHGROVEBLE_READ_CHUNK_SIZE` bytes
+   at a time, e.g. straight out of the receive buffer of a HardwareSerial or a
+   DMA buffer. `readAvailableBytes` works with any stream whose `readBytes()`
+   reads in bulk.
+
+   @param reader The reader, or null to read byte by byte.
+   */
+  void setReader(Reader reader);
+
+  /** Reader using `available()` and `readBytes()` of the stream. */
+  static size_t readAvailableBytes(Stream & stream, uint8_t * buffer, size_t length);
+#endif
+
+  /** Handler: received data has been discarded because the receive buffer
+   was full.
+
+   @param count The number of bytes discarded by the last `runOnce()` call.
+   */
+  void setOnDataDropped(void (*) (size_t count));
+  template <typename = void>
+  void setOnDataDropped(InstanceDropHandler onFunc) { setOnDataDroppedInstance(onFunc); }
+
+  /** Set how messages are delimited in the data exchanged with the peer.
+
+   With framing, received frames are passed to the handler set with
+   `setOnFrameReceived` as soon as their last byte has arrived, instead of
+   passing the received data to the data handlers. A frame must fit into the
+   receive buffer, larger frames are dropped.
+   */
+  void setFraming(Framing framing);
+
+  /** Handler: a frame has been received from peer.
+
+   The pointer is only valid during the call.
+   */
+  void setOnFrameReceived(void (*) (const uint8_t * data, size_t length));
+  template <typename = void>
+  void setOnFrameReceived(InstanceBytesHandler onFunc) { setOnFrameReceivedInstance(onFunc); }
+
+  /** Handler: the stream needs to be switched to another baud rate, e.g. by
+   calling `bleStream.begin(baud)`.
+
+   Setting this handler enables detecting the baud rate of the module: if it
+   doesn't respond, the supported baud rates are tried in turn. It's also
+   required for switching to the baud rate set with `setTargetBaudRate`.
+   */
+  void setOnBaudRateChange(void (*) (unsigned long baud));
 
   /** Optional debugging function or lambda.
+
+   With `MHGROVEBLE_LOG_LEVEL` set to `MHGROVEBLE_LOG_NONE`, the function is
+   ignored.
    */
   void setDebug(void (*) (const char * text));
 
@@ -117,22 +868,165 @@ private:
   /** The state of the `receiveResponse` method. */
   enum class ResponseState;
 
+  /** Common constructor.
+
+   @param ownsRxStorage Whether `rxStorage` has been allocated with `new[]`
+    and is deleted by the destructor.
+   */
+  MHGroveBLE(
+    Stream & device,
+    const char * name,
+    uint8_t * rxStorage,
+    unsigned int rxBufferSize,
+    bool ownsRxStorage
+  );
+
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+  /** A command queued with `enqueueCommand`. */
+  struct QueuedCommand {
+    /** The command, in flash if `isFlash` is set. */
+    const char * command;
+    /** Called with the response. */
+    CommandHandler handler;
+    /** Time to wait for a response, in milliseconds. */
+    uint16_t timeout;
+    /** Whether `command` points to flash. */
+    bool isFlash;
+    /** Whether the command only runs if the one before it succeeded. */
+    bool isChained;
+  };
+#endif
+
+  /** A handler without arguments, of either variant. */
+  union Handler {
+    void (*plain) ();
+    InstanceHandler instance;
+  };
+  /** A data handler of either variant. */
+  union DataHandler {
+    void (*plain) (const String & data);
+    InstanceDataHandler instance;
+  };
+  /** A drop handler of either variant. */
+  union DropHandler {
+    void (*plain) (size_t count);
+    InstanceDropHandler instance;
+  };
+  /** A bytes or frame handler of either variant. */
+  union BytesHandler {
+    void (*plain) (const uint8_t * data, size_t length);
+    InstanceBytesHandler instance;
+  };
+
   /** Serial port object for communicating with Grove BLE. */
   Stream & device;
   /** Version of the Grove BLE firmware. */
   long firmwareVersion;
   /** Name of the Bluetooth device. */
   const char * name;
+#if MHGROVEBLE_PIN > 0
   /** Bluetooth pin as a string. */
   const char * pin;
+#endif
+  /** Whether to query the settings instead of resetting them. */
+  bool fastBoot;
+  /** Link settings written during the initialization. */
+  Profile profile;
+  /** Bit mask of the settings that need to be written to the device. */
+  uint8_t pendingSettings;
+  /** Whether the initialization has been completed once. */
+  bool initialized;
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+  /** Whether the module waits for connections or connects itself. */
+  Role role;
+  /** The known peer, or an empty string. */
+  char peerAddress[kPeerAddressLength + 1];
+  /** Addresses found by the last discovery. */
+  char discoveredPeers[MHGROVEBLE_PEER_CACHE_SIZE][kPeerAddressLength + 1];
+  /** Number of entries in `discoveredPeers`. */
+  uint8_t discoveredPeerCount;
+  /** Whether the current connection attempt follows a discovery. */
+  bool connectingAfterDiscovery;
+  /** Time the last connection attempt failed. */
+  unsigned long connectRetryReferenceTime;
+  /** Time to wait after `connectRetryReferenceTime` before trying again. */
+  unsigned long connectRetryDelay;
+  /** How far the current connection attempt has got, see
+   `handleConnectingToPeer`.
+   */
+  uint8_t connectProgress;
+#endif
+  /** Commands set with `setSetupCommands`, or null. */
+  PGM_P setupCommands;
+  /** Offset of the next command in `setupCommands`. */
+  unsigned int setupCommandOffset;
+  /** Whether the device needs to be reset after the setup commands. */
+  bool setupCommandsNeedReset;
+  /** Set with `setFingerprintStorage`, or null. */
+  FingerprintLoader fingerprintLoader;
+  /** Set with `setFingerprintStorage`, or null. */
+  FingerprintStorer fingerprintStorer;
+  /** The fingerprint returned by `fingerprintLoader` during this
+   initialization.
+   */
+  uint32_t storedFingerprint;
+  /** Memory for the receive buffer if it was allocated by the object. */
+  uint8_t * ownedRxStorage;
   /** Receive buffer. */
-  String rxBuffer;
-  /** Size of the receive buffer. */
-  unsigned int rxBufferSize;
+  MHRingBuffer rxBuffer;
+  /** Transmit buffer, may have a capacity of 0. */
+  MHRingBuffer txBuffer;
+  /** Minimum time between two chunks sent from the transmit buffer. */
+  unsigned long txInterval;
+  /** Time the last chunk was sent from the transmit buffer. */
+  unsigned long txReferenceTime;
+  /** Byte after which received data is passed on right away, or -1. */
+  int delimiter;
+  /** Fill level at which received data is passed on, or 0. */
+  unsigned int highWatermark;
+  /** What happens when data arrives while the receive buffer is full. */
+  OverflowPolicy overflowPolicy;
+  /** Maximum number of bytes read per `runOnce()` call, or 0. */
+  unsigned int readBudgetBytes;
+  /** Maximum time spent reading per `runOnce()` call, or 0. */
+  unsigned long readBudgetMicros;
+  /** Whether the current `runOnce()` call used up the read budget. */
+  bool budgetExhausted;
+#if MHGROVEBLE_READ_CHUNK_SIZE > 0
+  /** Reads blocks of data from the stream, or null. */
+  Reader reader;
+  /** Block last fetched by `reader`. */
+  uint8_t readChunk[MHGROVEBLE_READ_CHUNK_SIZE];
+  /** Offset of the next byte to handle in `readChunk`. */
+  uint8_t readChunkOffset;
+  /** Number of bytes in `readChunk`. */
+  uint8_t readChunkLength;
+#endif
+  /** How messages are delimited. */
+  Framing framing;
+  /** Whether a frame is being received. */
+  bool frameInProgress;
+  /** Whether the frame being received doesn't fit into the receive buffer. */
+  bool frameOverflow;
+  /** `Framing::lengthPrefixed`: bytes missing for the current frame.
+   `Framing::cobs`: bytes missing for the current block.
+   */
+  uint8_t frameRemaining;
+  /** `Framing::cobs`: the code byte of the current block. */
+  uint8_t cobsCode;
+  /** Detects notifications like "OK+CONN" in the received bytes. */
+  MHNotificationMatcher notificationMatcher;
+  /** The notification detected by the last `readIntoBuffer` call. */
+  MHNotificationMatcher::Notification notification;
+  /** Whether the data received while connected ends with "OK+LOST". It is
+   only taken as the end of the connection once nothing followed it for
+   `lostTimeout()`, as the peer is able to send the same text.
+   */
+  bool isLostPending;
+  /** Time the pending "OK+LOST" has been received. */
+  unsigned long lostReferenceTime;
   /** The current internal state. */
   InternalState internalState;
-  /** For `handleGenericCommand`: the next state to transition to. */
-  InternalState genericNextInternalState;
   /** Reference time for the soft timeout. */
   unsigned long softTimeoutReferenceTime;
   /** Duration for the soft timeout. */
@@ -141,41 +1035,352 @@ private:
   unsigned long timeoutReferenceTime;
   /** Duration for the hard timeout. */
   unsigned long timeoutDuration;
+  /** Baud rate of the stream, or 0 if unknown. */
+  unsigned long baudRate;
+  /** Baud rate to switch the module to, or 0 to keep the current one. */
+  unsigned long targetBaudRate;
+  /** Time the current state was entered. */
+  unsigned long stateReferenceTime;
+  /** Time the initialization was started. */
+  unsigned long initReferenceTime;
+#if MHGROVEBLE_STATS > 0
+  /** Runtime statistics. */
+  Stats stats;
+#endif
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0
+  /** Value of `micros()` when the first byte of the current message was
+   read.
+   */
+  unsigned long messageStartTime;
+#endif
+#if MHGROVEBLE_TRACE_SIZE > 0
+  /** The event trace. */
+  TraceEvent traceEvents[MHGROVEBLE_TRACE_SIZE];
+  /** Index of the oldest event in `traceEvents`. */
+  unsigned int traceHead;
+  /** Number of events in `traceEvents`. */
+  unsigned int traceLength;
+#endif
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+  /** The queued commands. */
+  QueuedCommand commandQueue[MHGROVEBLE_COMMAND_QUEUE_SIZE];
+  /** Index of the oldest command in `commandQueue`. */
+  uint8_t commandQueueHead;
+  /** Number of commands in `commandQueue`. */
+  uint8_t commandQueueLength;
+  /** Whether the command at `commandQueueHead` has been sent and its handler
+   hasn't been called yet.
+   */
+  bool isCommandInFlight;
+#endif
+  /** Number of times the command has been resent in the current state. */
+  uint8_t retryCount;
+  /** Time without data after which a response is considered complete. */
+  unsigned long responseIdleTimeout;
+  /** Start of the expected response to the last command, or null if unknown. */
+  const __FlashStringHelper * expectedResponsePrefix;
+  /** Expected text after `expectedResponsePrefix`, may be null. */
+  const char * expectedResponseValue;
+  /** Number of arbitrary characters expected at the end of the response. */
+  uint8_t expectedResponseExtraLength;
+  /** Pointer for the application's own use. */
+  void * context;
+  /** Bit mask of the handlers that were set as instance handlers, i.e. which
+   member of the handler unions is in use.
+   */
+  uint8_t instanceHandlers;
   /** Handler for completed initialization. */
-  void (*onReady) ();
+  Handler onReady;
   /** Handler for panic shutdown. */
-  void (*onPanic) ();
+  Handler onPanic;
+#if MHGROVEBLE_CONNECTION_HANDLERS > 0
   /** Handler for established connection. */
-  void (*onConnect) ();
+  Handler onConnect;
   /** Handler for closed connection. */
-  void (*onDisconnect) ();
+  Handler onDisconnect;
+#endif
+#if MHGROVEBLE_STRING_HANDLERS > 0
   /** Handler for received data. */
-  void (*onDataReceived) (const String & data);
+  DataHandler onDataReceived;
+#endif
+  /** Handler for received data, without string conversion. */
+  BytesHandler onBytesReceived;
+  /** Handler for received frames. */
+  BytesHandler onFrameReceived;
+  /** Handler for discarded data. */
+  DropHandler onDataDropped;
+#if MHGROVEBLE_LOG_LEVEL > MHGROVEBLE_LOG_NONE
   /** Optional debugging function or lambda. */
   void (*debug) (const char * text);
+#endif
+  /** Handler for switching the baud rate of the stream. */
+  void (*onBaudRateChange) (unsigned long baud);
 
-  /** Send a string to the device. */
-  void sendCommand(const String & command);
+#if MHGROVEBLE_TRACE_SIZE > 0
+  /** Record an event in the event trace. */
+  void trace(TraceEventType type, unsigned int count);
+#endif
+
+  /** The setters for handlers that get the object, see `setOnReady`. */
+  void setOnReadyInstance(InstanceHandler onFunc);
+  void setOnPanicInstance(InstanceHandler onFunc);
+#if MHGROVEBLE_CONNECTION_HANDLERS > 0
+  void setOnConnectInstance(InstanceHandler onFunc);
+  void setOnDisconnectInstance(InstanceHandler onFunc);
+#endif
+#if MHGROVEBLE_STRING_HANDLERS > 0
+  void setOnDataReceivedInstance(InstanceDataHandler onFunc);
+#endif
+  void setOnBytesReceivedInstance(InstanceBytesHandler onFunc);
+  void setOnDataDroppedInstance(InstanceDropHandler onFunc);
+  void setOnFrameReceivedInstance(InstanceBytesHandler onFunc);
+
+  /** Store whether a handler was set as an instance handler. */
+  void setInstanceHandler(uint8_t handlerBit, bool isInstanceHandler);
+
+  /** Call a handler, if set, with the object if it's an instance handler. */
+  void callHandler(const Handler & handler, uint8_t handlerBit);
+
+  /** Call a bytes or frame handler, see `callHandler`. */
+  void callBytesHandler(
+    const BytesHandler & handler,
+    uint8_t handlerBit,
+    const uint8_t * data,
+    size_t length
+  );
+
+  /** Send a command stored in flash to the device, followed by `argument`
+   if it isn't null.
+
+   If the response is known in advance, it can be passed as a prefix followed
+   by a value and a number of arbitrary characters (e.g. digits of a version
+   number). `receiveResponse` then completes as soon as it has been received.
+   */
+  void sendCommand(
+    PGM_P command,
+    const char * argument = nullptr,
+    const __FlashStringHelper * expectedPrefix = nullptr,
+    const char * expectedValue = nullptr,
+    uint8_t expectedExtraLength = 0
+  );
+
+  /** Send a command of `length` characters from flash or RAM, see above. */
+  void sendCommand(
+    const char * command,
+    size_t length,
+    bool isFlash,
+    const char * argument,
+    const __FlashStringHelper * expectedPrefix = nullptr,
+    const char * expectedValue = nullptr,
+    uint8_t expectedExtraLength = 0
+  );
+
+  /** Whether `length` bytes can be sent or queued right now. */
+  bool canSend(size_t length);
+
+  /** Whether the receive buffer contains exactly the expected response. */
+  bool isExpectedResponse();
 
   /** Receive a response from the device. */
   ResponseState receiveResponse();
 
-  /** Go from one state to the next one and trigger the required action. */
+  /** Record the baud rate of the stream and derive the response timeout. */
+  void applyBaudRate(unsigned long baud);
+
+  /** Ask the handler to switch the stream to another baud rate. */
+  void changeBaudRate(unsigned long baud);
+
+  /** Go from one state to the next one and trigger the required action.
+
+   Initialization steps whose conditions aren't met are skipped.
+   */
   void transitionToState(InternalState nextState);
 
+  /** Whether the conditions of an initialization step are met. */
+  bool shouldRunInitStep(InternalState state);
+
+  /** Whether the module is set up as a central. */
+  bool isCentral() const;
+
+  /** The PIN set with `setPIN`, or null. */
+  const char * getPIN() const;
+
+  /** FNV-1a hash of the configuration and the firmware version, never 0. */
+  uint32_t configurationFingerprint() const;
+
+  /** Start the initialization step of the current state. */
+  void startInitStep();
+
+  /** Get a string to append to a command or expect in a response, see
+   `InitStep` in `MHGroveBLE.cpp`.
+   */
+  const char * initStepArgument(uint8_t argument);
+
+  /** Send the next command set with `setSetupCommands`.
+
+   @return Whether there was a command left to send.
+   */
+  bool sendSetupCommand();
+
   /** Read data from the device into the receive buffer.
 
+   Stops reading as soon as "OK+CONN" has been received while waiting for a
+   connection and stores it in `notification`. While connected, "OK+LOST" is
+   stored once nothing followed it for `responseIdleTimeout`.
+
    @return Whether data was read.
    */
   bool readIntoBuffer();
 
+  /** Handle a byte read by `readIntoBuffer`: store it in the receive buffer
+   or the current frame, feed the notification matcher and pass on a record
+   once the delimiter arrives.
+
+   @param value The byte.
+   @param isUnframed Whether the byte is stored in the receive buffer as it
+    is, instead of being decoded as part of a frame.
+   @param droppedCount Incremented if an old byte had to be discarded.
+   @return The notification the byte completed, if any.
+   */
+  MHNotificationMatcher::Notification receiveByte(
+    uint8_t value,
+    bool isUnframed,
+    size_t & droppedCount
+  );
+
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+  /** Receive the bytes in the receive buffer again, as if they had just been
+   read in the connected state. Used for data from the peer that arrived
+   together with the response to a connection attempt.
+   */
+  void receiveBufferedBytes();
+#endif
+
+  /** Get the next received byte, or -1 if there is none. */
+  int readByte();
+
+  /** Whether received bytes are waiting to be read with `readByte()`. */
+  bool isInputAvailable();
+
+  /** Pass the content of the receive buffer to the handlers and clear it.
+
+   @param keepLength Number of bytes at the end that stay in the buffer.
+   @return Whether anything was passed on.
+   */
+  bool deliverBuffer(unsigned int keepLength = 0);
+
+  /** Number of bytes at the end of the receive buffer that may be the start
+   of "OK+LOST" sent by the module, and are kept back when passing on data.
+   */
+  unsigned int sentinelLengthToKeep();
+
+  /** Time without data after which a pending "OK+LOST" is taken as the end
+   of the connection: a few character times, or much longer inside a frame.
+   */
+  unsigned long lostTimeout() const;
+
+  /** Send the next chunk from the transmit buffer, if it's time to do so. */
+  void drainTxBuffer();
+
+  /** Send data to the device or queue it in the transmit buffer. The caller
+   must make sure the transmit buffer has enough room.
+   */
+  void transmit(const uint8_t * data, size_t length);
+
+  /** COBS encode data and transmit it, including the terminating 0.
+
+   @param dryRun If true, nothing is transmitted.
+   @return The length of the encoded data.
+   */
+  size_t writeCobs(const uint8_t * data, size_t length, bool dryRun);
+
+  /** Decode a byte received in the connected state when framing is used. */
+  void receiveFramedByte(uint8_t value);
+
+  /** Forget the decoding state of a partially received frame. Its bytes in
+   the receive buffer are left to the caller.
+   */
+  void resetFrame();
+
+  /** Copy the first `length` bytes of the receive buffer into a string. */
+  String rxBufferToString(unsigned int length);
+
+  void handleInitStep();
   void handleWaitForDevice();
-  void handleGenericCommand();
-  void handleGetFirmwareVersion();
-  void handleReset();
   void handleWaitForConnect();
+#if MHGROVEBLE_COMMAND_QUEUE_SIZE > 0
+  void handleRunningCommand();
+
+  /** Add a command to `commandQueue`. */
+  bool enqueueCommand(
+    const char * command,
+    bool isFlash,
+    CommandHandler handler,
+    uint16_t timeout,
+    bool isChained = false
+  );
+
+  /** Remove the oldest queued command and pass the result to its handler.
+   The response is taken from the receive buffer, which is cleared. Unless
+   the command succeeded, the commands chained to it are cancelled.
+   */
+  void finishCommand(CommandResult result);
+#endif
+#if MHGROVEBLE_PEER_CACHE_SIZE > 0
+  void handleConnectingToPeer();
+  void handleDiscoveringPeers();
+
+  /** Handle a failed connection attempt in the central role. */
+  void connectToPeerFailed();
+
+  /** Handle a successful connection attempt in the central role.
+
+   @param firstByte The first byte sent by the peer, if it has been read
+    already, or -1.
+   */
+  void connectedToPeer(int firstByte);
+
+  /** Take the discovered addresses from the receive buffer.
+
+   @return Whether the end of the discovery has been received.
+   */
+  bool parseDiscoveredPeers();
+#endif
   void handleConnected();
   void panic();
 };
 
+/** Variant of `MHGroveBLE` with buffers of fixed size.
+
+ The buffers are part of the object instead of being allocated on the heap, so
+ the object never allocates memory, e.g. `MHGroveBLEStatic<128>`. If
+ `TxBufferSize` is not 0, a transmit buffer of that size is set up, see
+ `setTxBuffer`.
+ */
+template <unsigned int RxBufferSize, unsigned int TxBufferSize = 0>
+class MHGroveBLEStatic : public MHGroveBLE {
+
+public:
+  /** Constructor.
+
+   @param stream The stream to read from and write to.
+   @param name Name of the Bluetooth device.
+   */
+  MHGroveBLEStatic(Stream & device, const char * name) :
+    MHGroveBLE(device, name, rxStorageInline, RxBufferSize)
+  {
+    if (TxBufferSize > 0) {
+      setTxBuffer(txStorageInline, TxBufferSize);
+    }
+  }
+
+private:
+  /** Memory for the receive buffer. */
+  uint8_t rxStorageInline[RxBufferSize];
+  /** Memory for the transmit buffer. Arrays of size 0 are not allowed. */
+  uint8_t txStorageInline[TxBufferSize > 0 ? TxBufferSize : 1];
+};
+
+}
+
 #endif
@@ -0,0 +1,157 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef MHGROVEBLECONFIG_H
+#define MHGROVEBLECONFIG_H
+
+/*
+Compile-time configuration of MHGroveBLE.
+
+Each setting can be overridden with a global compiler flag, e.g. in
+`build_flags` in PlatformIO or with `-D` in a Makefile, so that the library and
+the application are compiled with the same values. A `#define` in a sketch
+doesn't work: the Arduino IDE compiles the library separately, without it.
+Most settings change the members of `MHGroveBLE`, so the library and the
+application would disagree about the layout of the object. To catch that, the
+class is declared in an inline namespace named after the settings, see
+`MHGROVEBLE_CONFIG_NAMESPACE`; with a mismatch, the application fails to link.
+Set the values as plain numbers or `MHGROVEBLE_LOG_*` names, they become part
+of that name.
+*/
+
+/** Log levels for `MHGROVEBLE_LOG_LEVEL`. */
+#define MHGROVEBLE_LOG_NONE     0
+#define MHGROVEBLE_LOG_ERROR    1
+#define MHGROVEBLE_LOG_INFO     2
+#define MHGROVEBLE_LOG_VERBOSE  3
+
+/** Which messages are passed to the debug handler set with `setDebug`.
+
+ Code for messages above this level is not compiled at all. With
+ `MHGROVEBLE_LOG_NONE`, no debug messages are built.
+ */
+#ifndef MHGROVEBLE_LOG_LEVEL
+#define MHGROVEBLE_LOG_LEVEL MHGROVEBLE_LOG_VERBOSE
+#endif
+
+/** Number of events kept in the binary event trace, see `getTraceEvent`.
+
+ Each event takes 8 bytes. With 0, tracing is not compiled at all.
+ */
+#ifndef MHGROVEBLE_TRACE_SIZE
+#define MHGROVEBLE_TRACE_SIZE 0
+#endif
+
+/** Whether the runtime statistics of `getStats` are kept.
+
+ They take about 130 bytes, most of them for the durations of the
+ initialization steps. With 0, the statistics are not compiled at all.
+ */
+#ifndef MHGROVEBLE_STATS
+#define MHGROVEBLE_STATS 1
+#endif
+
+/** Number of buckets in the latency histograms of `MHGroveBLE::Stats`.
+
+ Bucket i counts durations below 2^i microseconds, so 20 buckets cover up to
+ half a second; at most 32. There are two histograms of 4 bytes per bucket.
+ With 0, histograms are not compiled at all. Requires `MHGROVEBLE_STATS`.
+ */
+#ifndef MHGROVEBLE_HISTOGRAM_SIZE
+#define MHGROVEBLE_HISTOGRAM_SIZE 0
+#endif
+
+#if MHGROVEBLE_HISTOGRAM_SIZE > 0 && MHGROVEBLE_STATS == 0
+#error "MHGROVEBLE_HISTOGRAM_SIZE requires MHGROVEBLE_STATS"
+#endif
+
+/** Number of commands that can be queued with `enqueueCommand`.
+
+ Each entry takes 8 bytes (on AVR). With 0, the command queue is not compiled
+ at all.
+ */
+#ifndef MHGROVEBLE_COMMAND_QUEUE_SIZE
+#define MHGROVEBLE_COMMAND_QUEUE_SIZE 4
+#endif
+
+/** Number of peer addresses kept from a discovery in the central role, see
+ `setRole`.
+
+ Each entry takes 13 bytes. With 0, the central role is not compiled at all.
+ */
+#ifndef MHGROVEBLE_PEER_CACHE_SIZE
+#define MHGROVEBLE_PEER_CACHE_SIZE 4
+#endif
+
+/** Size of the block read at a time by a reader set with `setReader`.
+
+ The block is kept inside the object. At most 255. With 0, readers are not
+ compiled at all and the stream is always read byte by byte.
+ */
+#ifndef MHGROVEBLE_READ_CHUNK_SIZE
+#define MHGROVEBLE_READ_CHUNK_SIZE 16
+#endif
+
+/** Whether `setPIN` is available. With 0, PIN handling is not compiled; in
+ fast boot mode, a PIN required by the module is still turned off.
+ */
+#ifndef MHGROVEBLE_PIN
+#define MHGROVEBLE_PIN 1
+#endif
+
+/** Whether `setOnConnect` and `setOnDisconnect` are available. With 0,
+ `getState()` still tells whether a peer is connected.
+ */
+#ifndef MHGROVEBLE_CONNECTION_HANDLERS
+#define MHGROVEBLE_CONNECTION_HANDLERS 1
+#endif
+
+/** Whether `setOnDataReceived` is available. With 0, no `String` is created
+ for received data, so unless the application uses them, the `String` class
+ and the heap aren't linked in; use `setOnBytesReceived` instead. Combine it
+ with `MHGROVEBLE_LOG_NONE` for that, as debug messages are built as strings.
+ */
+#ifndef MHGROVEBLE_STRING_HANDLERS
+#define MHGROVEBLE_STRING_HANDLERS 1
+#endif
+
+/** Name of the inline namespace that `MHGroveBLE` is declared in. It is made
+ of all settings above that change the object, e.g.
+ `MHGroveBLE_L3_T0_S1_H0_Q4_P4_R16_N1_C1_D1`, so that code compiled with other
+ settings refers to another class and fails to link with the library instead
+ of corrupting memory.
+ */
+#define MHGROVEBLE_CONFIG_NAMESPACE MHGROVEBLE_CONFIG_NAMESPACE_EXPAND( \
+  MHGROVEBLE_LOG_LEVEL, MHGROVEBLE_TRACE_SIZE, MHGROVEBLE_STATS, \
+  MHGROVEBLE_HISTOGRAM_SIZE, MHGROVEBLE_COMMAND_QUEUE_SIZE, \
+  MHGROVEBLE_PEER_CACHE_SIZE, MHGROVEBLE_READ_CHUNK_SIZE, MHGROVEBLE_PIN, \
+  MHGROVEBLE_CONNECTION_HANDLERS, MHGROVEBLE_STRING_HANDLERS)
+/** Expands the settings before pasting them, see above. */
+#define MHGROVEBLE_CONFIG_NAMESPACE_EXPAND(l, t, s, h, q, p, r, n, c, d) \
+  MHGROVEBLE_CONFIG_NAMESPACE_PASTE(l, t, s, h, q, p, r, n, c, d)
+#define MHGROVEBLE_CONFIG_NAMESPACE_PASTE(l, t, s, h, q, p, r, n, c, d) \
+  MHGroveBLE_L##l##_T##t##_S##s##_H##h##_Q##q##_P##p##_R##r##_N##n##_C##c##_D##d
+
+#endif
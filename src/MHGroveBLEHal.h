@@ -0,0 +1,46 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#ifndef MHGROVEBLEHAL_H
+#define MHGROVEBLEHAL_H
+
+/*
+Platform abstraction of MHGroveBLE.
+
+The library needs a clock (`millis()`, `micros()`), a byte stream (`Stream`,
+`Print`), `String` and the flash string helpers (`F()`, `PROGMEM`). On
+Arduino, these come from the Arduino core. Define `MHGROVEBLE_NATIVE` to build
+for other platforms instead, e.g. Linux; see `native/MHGroveBLENative.h`.
+*/
+
+#ifdef MHGROVEBLE_NATIVE
+#include "native/MHGroveBLENative.h"
+#else
+#include <Arduino.h>
+#include <SoftwareSerial.h>
+#endif
+
+#endif
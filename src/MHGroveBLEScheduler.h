@@ -0,0 +1,190 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#ifndef MHGROVEBLESCHEDULER_H
+#define MHGROVEBLESCHEDULER_H
+
+#include "MHGroveBLEHal.h"
+
+#include "MHGroveBLE.h"
+
+/** Drives several `MHGroveBLE` objects from one `runOnce()` call.
+
+ Every module runs once per call, each with its own time budget: the
+ scheduler sets it as the module's read budget, so a module that is busy
+ receiving stops reading once it's used up and the next module runs. This
+ replaces any read budget set with `MHGroveBLE::setReadBudget`, including a
+ limit on the number of bytes; don't call it on a module that has been added.
+ The modules take turns in running first.
+
+ The scheduler doesn't own the objects, they must stay valid while it's used.
+ For example, `MHGroveBLEScheduler<4>` manages up to four modules.
+ */
+template <uint8_t Capacity>
+class MHGroveBLEScheduler {
+
+public:
+  /** Default time budget of a `runOnce()` call per module, in microseconds. */
+  static const unsigned long kDefaultBudget = 2000;
+
+  /** Constructor. */
+  MHGroveBLEScheduler() :
+    moduleCount(0),
+    nextModule(0),
+    budget(kDefaultBudget)
+  {
+  }
+
+  /** Add a module.
+
+   The module's read budget is replaced by the scheduler's time budget, see
+   `setBudget`. Its context is left alone.
+
+   @param module The module to run.
+   @return Whether the module was added. False if `Capacity` modules have
+    already been added.
+   */
+  bool add(MHGroveBLE & module)
+  {
+    if (moduleCount >= Capacity) {
+      return false;
+    }
+
+    module.setReadBudget(0, budget);
+    modules[moduleCount++] = &module;
+    return true;
+  }
+
+  /** Add a module and set its context, see `MHGroveBLE::setContext`.
+
+   @param module The module to run.
+   @param context The context passed to the module's instance handlers.
+   @return Whether the module was added.
+   */
+  bool add(MHGroveBLE & module, void * context)
+  {
+    if (!add(module)) {
+      return false;
+    }
+
+    module.setContext(context);
+    return true;
+  }
+
+  /** Number of modules that have been added. */
+  uint8_t getCount() const
+  {
+    return moduleCount;
+  }
+
+  /** Get a module by the order in which it was added. */
+  MHGroveBLE & operator[](uint8_t index)
+  {
+    return *modules[index];
+  }
+
+  /** Set the time budget of a `runOnce()` call per module.
+
+   This is set as the read budget of every module, see
+   `MHGroveBLE::setReadBudget`, replacing any budget set before. It bounds the
+   time a module spends reading, including the data handlers called while
+   reading; at least one byte is read per call.
+
+   @param micros The time in microseconds. Defaults to 2ms.
+   */
+  void setBudget(unsigned long micros)
+  {
+    budget = micros;
+    for (uint8_t i = 0; i < moduleCount; ++i) {
+      modules[i]->setReadBudget(0, budget);
+    }
+  }
+
+  /** Run every module once, each within its time budget.
+
+   Call this in your `loop()` function instead of the modules' `runOnce()`.
+
+   @return Whether work is left: a module used up its budget while more data
+    was waiting in its stream.
+   */
+  bool runOnce()
+  {
+    bool workLeft = false;
+
+    for (uint8_t count = 0; count < moduleCount; ++count) {
+      if (modules[(nextModule + count) % moduleCount]->runOnce()) {
+        workLeft = true;
+      }
+    }
+
+    // Start with another module next time, so none of them benefits from
+    // running first.
+    if (moduleCount > 0) {
+      nextModule = (nextModule + 1) % moduleCount;
+    }
+    return workLeft;
+  }
+
+  /** The earliest time until any module needs to run again, see
+   `MHGroveBLE::millisUntilNextEvent`.
+   */
+  unsigned long millisUntilNextEvent()
+  {
+    unsigned long result = MHGroveBLE::kNoDeadline;
+    for (uint8_t i = 0; i < moduleCount; ++i) {
+      unsigned long next = modules[i]->millisUntilNextEvent();
+      if (next < result) {
+        result = next;
+      }
+    }
+    return result;
+  }
+
+  /** Whether data from the stream is expected soon by any module, see
+   `MHGroveBLE::isExpectingData`.
+   */
+  bool isExpectingData()
+  {
+    for (uint8_t i = 0; i < moduleCount; ++i) {
+      if (modules[i]->isExpectingData()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  /** The modules, in the order they were added. */
+  MHGroveBLE * modules[Capacity];
+  /** Number of entries in `modules`. */
+  uint8_t moduleCount;
+  /** Index of the module to run first on the next `runOnce()` call. */
+  uint8_t nextModule;
+  /** Time budget of a `runOnce()` call per module, in microseconds. */
+  unsigned long budget;
+};
+
+#endif
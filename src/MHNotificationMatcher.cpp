@@ -0,0 +1,157 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "MHNotificationMatcher.h"
+
+static const char kNotificationConnected[] PROGMEM = "OK+CONN";
+static const char kNotificationLost[] PROGMEM = "OK+LOST";
+
+/** The notifications, in the order of `Notification` (minus `none`). */
+static PGM_P const kNotifications[] PROGMEM = {
+  kNotificationConnected,
+  kNotificationLost,
+};
+static const uint8_t kNotificationCount =
+  sizeof(kNotifications) / sizeof(kNotifications[0]);
+/** All notifications have the same length. */
+static const uint8_t kNotificationLength = 7;
+
+/** Internal helper: byte `index` of notification `pattern`. */
+static uint8_t notificationByte(uint8_t pattern, uint8_t index)
+{
+  PGM_P text = reinterpret_cast<PGM_P>(pgm_read_ptr(&kNotifications[pattern]));
+  return pgm_read_byte(text + index);
+}
+
+
+MHNotificationMatcher::MHNotificationMatcher() :
+  candidate(0),
+  matched(0)
+{
+}
+
+void MHNotificationMatcher::reset()
+{
+  candidate = 0;
+  matched = 0;
+}
+
+MHNotificationMatcher::Notification MHNotificationMatcher::feed(uint8_t value)
+{
+  if (notificationByte(candidate, matched) == value) {
+    // Fast path: the byte continues the current candidate.
+    ++matched;
+  } else if (matched == 0) {
+    // Nothing is being matched, and as all notifications start with "OK+",
+    // the byte doesn't start any of them either.
+    return Notification::none;
+  } else {
+    fallBack(candidate, matched, value, kNotificationLength + 1);
+  }
+
+  if (matched < kNotificationLength) {
+    return Notification::none;
+  }
+
+  // Full match. Continue with whatever part of the notification could be the
+  // start of the next one.
+  uint8_t pattern = candidate;
+  fallBack(pattern, kNotificationLength, -1, kNotificationLength);
+  return static_cast<Notification>(pattern + 1);
+}
+
+uint8_t MHNotificationMatcher::length(Notification notification)
+{
+  return notification == Notification::none ? 0 : kNotificationLength;
+}
+
+uint8_t MHNotificationMatcher::matchedLength(Notification notification) const
+{
+  if (notification == Notification::none) {
+    return 0;
+  }
+
+  // The candidate may be another notification, and a shorter suffix of its
+  // partial match may still be the start of this one, e.g. the last "O" of
+  // "OK+CO". Like `fallBack`, this only runs over a few bytes.
+  uint8_t pattern = static_cast<uint8_t>(notification) - 1;
+  for (uint8_t k = matched; k > 0; --k) {
+    uint8_t start = matched - k;
+    bool isMatch = true;
+    for (uint8_t i = 0; i < k && isMatch; ++i) {
+      isMatch = notificationByte(pattern, i) == notificationByte(candidate, start + i);
+    }
+    if (isMatch) {
+      return k;
+    }
+  }
+  return 0;
+}
+
+
+/*******************************************************************************
+ * Private section
+ ******************************************************************************/
+
+void MHNotificationMatcher::fallBack(
+  uint8_t pattern,
+  uint8_t textLength,
+  int value,
+  uint8_t limit
+)
+{
+  // This is the KMP failure function, computed on the fly instead of being
+  // stored in a table. The texts are so short that this is cheap, and it
+  // only runs when a partial match breaks off.
+  uint8_t totalLength = textLength + (value >= 0 ? 1 : 0);
+
+  for (uint8_t k = totalLength; k > 0; --k) {
+    if (k >= limit) {
+      continue;
+    }
+    uint8_t start = totalLength - k;
+
+    for (uint8_t next = 0; next < kNotificationCount; ++next) {
+      bool isMatch = true;
+      for (uint8_t i = 0; i < k && isMatch; ++i) {
+        uint8_t textIndex = start + i;
+        uint8_t textByte =
+          textIndex < textLength
+          ? notificationByte(pattern, textIndex)
+          : (uint8_t)value;
+        isMatch = notificationByte(next, i) == textByte;
+      }
+
+      if (isMatch) {
+        candidate = next;
+        matched = k;
+        return;
+      }
+    }
+  }
+
+  candidate = 0;
+  matched = 0;
+}
@@ -0,0 +1,86 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef MHNOTIFICATIONMATCHER_H
+#define MHNOTIFICATIONMATCHER_H
+
+#include "MHGroveBLEHal.h"
+
+/** Incremental matcher for the notifications sent by the Grove BLE.
+
+ The matcher is fed one byte at a time and reports a notification the moment
+ its last byte arrives. Only two bytes of state are kept. A byte that neither
+ continues nor starts a notification, the common case in data, takes two
+ comparisons; only a partial match that breaks off compares against all
+ notifications.
+ */
+class MHNotificationMatcher {
+
+public:
+  /** The notifications the matcher knows about. */
+  enum class Notification : uint8_t {
+    /** No notification was completed. */
+    none,
+    /** "OK+CONN": a peer has connected. */
+    connected,
+    /** "OK+LOST": the connection to the peer was closed. */
+    lost,
+  };
+
+  /** Constructor. */
+  MHNotificationMatcher();
+
+  /** Forget any partial match. */
+  void reset();
+
+  /** Feed the next byte.
+
+   @return The notification completed by this byte, or `Notification::none`.
+   */
+  Notification feed(uint8_t value);
+
+  /** Number of bytes of the given notification. */
+  static uint8_t length(Notification notification);
+
+  /** Number of bytes at the end of the partial match so far that are the
+   start of the given notification, i.e. that may still turn out to be that
+   notification.
+   */
+  uint8_t matchedLength(Notification notification) const;
+
+private:
+  /** Index of the notification that is currently being matched. */
+  uint8_t candidate;
+  /** Number of bytes of `candidate` that have been matched so far. */
+  uint8_t matched;
+
+  /** Find the longest prefix of any notification that is a suffix of the
+   first `textLength` bytes of notification `pattern`, followed by `value` if
+   it is not negative. Only prefixes shorter than `limit` are considered.
+   */
+  void fallBack(uint8_t pattern, uint8_t textLength, int value, uint8_t limit);
+};
+
+#endif
@@ -0,0 +1,175 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "MHRingBuffer.h"
+
+/** Internal helper: reverse the bytes in `[first, last)`. */
+static void reverseBytes(uint8_t * first, uint8_t * last)
+{
+  while (first < last) {
+    --last;
+    uint8_t value = *first;
+    *first = *last;
+    *last = value;
+    ++first;
+  }
+}
+
+
+MHRingBuffer::MHRingBuffer(uint8_t * storage, unsigned int capacity) :
+  storage(storage),
+  size(capacity),
+  head(0),
+  count(0)
+{
+}
+
+void MHRingBuffer::clear()
+{
+  head = 0;
+  count = 0;
+}
+
+bool MHRingBuffer::push(uint8_t value)
+{
+  if (size == 0) {
+    return true;
+  }
+
+  if (count == size) {
+    // Overwrite the oldest byte, the new oldest one is right behind it.
+    storage[head] = value;
+    head = physicalIndex(1);
+    return true;
+  }
+
+  storage[physicalIndex(count)] = value;
+  ++count;
+  return false;
+}
+
+uint8_t MHRingBuffer::operator[](unsigned int index) const
+{
+  return storage[physicalIndex(index)];
+}
+
+void MHRingBuffer::removeFirst(unsigned int n)
+{
+  if (n >= count) {
+    clear();
+    return;
+  }
+
+  head = physicalIndex(n);
+  count -= n;
+}
+
+void MHRingBuffer::removeLast(unsigned int n)
+{
+  if (n >= count) {
+    clear();
+    return;
+  }
+
+  count -= n;
+}
+
+const uint8_t * MHRingBuffer::linearize()
+{
+  if (head + count > size) {
+    // The content wraps around. Rotate the storage left by `head` so that the
+    // oldest byte ends up at index 0, using the three-reversals trick to avoid
+    // needing a second buffer.
+    reverseBytes(storage, storage + head);
+    reverseBytes(storage + head, storage + size);
+    reverseBytes(storage, storage + size);
+    head = 0;
+  }
+
+  return storage + head;
+}
+
+bool MHRingBuffer::startsWith(const __FlashStringHelper * text) const
+{
+  PGM_P pText = reinterpret_cast<PGM_P>(text);
+  unsigned int textLength = strlen_P(pText);
+
+  return textLength <= count && matchesAt(0, pText, textLength);
+}
+
+bool MHRingBuffer::endsWith(const __FlashStringHelper * text) const
+{
+  PGM_P pText = reinterpret_cast<PGM_P>(text);
+  unsigned int textLength = strlen_P(pText);
+
+  return textLength <= count && matchesAt(count - textLength, pText, textLength);
+}
+
+int MHRingBuffer::indexOf(const __FlashStringHelper * text) const
+{
+  PGM_P pText = reinterpret_cast<PGM_P>(text);
+  unsigned int textLength = strlen_P(pText);
+
+  if (textLength > count) {
+    return -1;
+  }
+
+  for (unsigned int index = 0; index <= count - textLength; ++index) {
+    if (matchesAt(index, pText, textLength)) {
+      return index;
+    }
+  }
+
+  return -1;
+}
+
+
+/*******************************************************************************
+ * Private section
+ ******************************************************************************/
+
+unsigned int MHRingBuffer::physicalIndex(unsigned int index) const
+{
+  // Avoid the modulo operator, division is expensive on small MCUs.
+  unsigned int position = head + index;
+  if (position >= size) {
+    position -= size;
+  }
+  return position;
+}
+
+bool MHRingBuffer::matchesAt(
+  unsigned int index,
+  PGM_P text,
+  unsigned int textLength
+) const
+{
+  for (unsigned int i = 0; i < textLength; ++i) {
+    if ((*this)[index + i] != pgm_read_byte(text + i)) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,120 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef MHRINGBUFFER_H
+#define MHRINGBUFFER_H
+
+#include "MHGroveBLEHal.h"
+
+/** Fixed-capacity circular byte buffer.
+
+ The buffer does not own its storage: the memory is passed in by the owner and
+ must stay valid for the lifetime of the buffer. Appending a byte and
+ discarding the oldest byte are O(1). Where a contiguous view of the content is
+ needed, `linearize()` rotates the content in place.
+ */
+class MHRingBuffer {
+
+public:
+  /** Constructor.
+
+   @param storage Memory for the buffer content. Must be at least `capacity`
+    bytes long.
+   @param capacity Maximum number of bytes the buffer can hold.
+   */
+  MHRingBuffer(uint8_t * storage, unsigned int capacity);
+
+  /** Number of bytes currently in the buffer. */
+  unsigned int length() const { return count; }
+
+  /** Maximum number of bytes the buffer can hold. */
+  unsigned int capacity() const { return size; }
+
+  /** Whether the buffer holds no data. */
+  bool isEmpty() const { return count == 0; }
+
+  /** Whether the buffer cannot take more data without overwriting. */
+  bool isFull() const { return count == size; }
+
+  /** Number of bytes that can be appended without overwriting. */
+  unsigned int freeSpace() const { return size - count; }
+
+  /** Discard all data. */
+  void clear();
+
+  /** Append a byte. If the buffer is full, the oldest byte is overwritten.
+
+   @return Whether the oldest byte was overwritten.
+   */
+  bool push(uint8_t value);
+
+  /** Get the byte at `index`, counting from the oldest byte. */
+  uint8_t operator[](unsigned int index) const;
+
+  /** Discard the `n` oldest bytes. */
+  void removeFirst(unsigned int n);
+
+  /** Discard the `n` newest bytes. */
+  void removeLast(unsigned int n);
+
+  /** Get a contiguous view of the content.
+
+   Rotates the content in place if it currently wraps around the end of the
+   storage. The pointer is valid until the buffer is modified.
+   */
+  const uint8_t * linearize();
+
+  /** Whether the content starts with the given flash string. */
+  bool startsWith(const __FlashStringHelper * text) const;
+
+  /** Whether the content ends with the given flash string. */
+  bool endsWith(const __FlashStringHelper * text) const;
+
+  /** Find the first occurrence of the given flash string.
+
+   @return The index of the first match or -1 if there is none.
+   */
+  int indexOf(const __FlashStringHelper * text) const;
+
+private:
+  /** Memory for the buffer content. */
+  uint8_t * storage;
+  /** Size of `storage`. */
+  unsigned int size;
+  /** Index of the oldest byte in `storage`. */
+  unsigned int head;
+  /** Number of bytes in the buffer. */
+  unsigned int count;
+
+  /** Map a logical index to an index in `storage`. */
+  unsigned int physicalIndex(unsigned int index) const;
+
+  /** Whether the content at `index` matches the flash string of length
+   `textLength`.
+   */
+  bool matchesAt(unsigned int index, PGM_P text, unsigned int textLength) const;
+};
+
+#endif
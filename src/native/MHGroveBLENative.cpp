@@ -0,0 +1,68 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#ifdef MHGROVEBLE_NATIVE
+
+#include "MHGroveBLENative.h"
+
+#include <chrono>
+
+/** The clock set with `setNativeClock`, or null. */
+static unsigned long long (*customClock) () = nullptr;
+
+/** Microseconds since the first call. */
+static unsigned long long defaultClock()
+{
+  typedef std::chrono::steady_clock Clock;
+  static const Clock::time_point start = Clock::now();
+
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    Clock::now() - start
+  ).count();
+}
+
+/** The current time in microseconds. */
+static unsigned long long now()
+{
+  return customClock ? customClock() : defaultClock();
+}
+
+unsigned long millis()
+{
+  return (unsigned long)(now() / 1000);
+}
+
+unsigned long micros()
+{
+  return (unsigned long)now();
+}
+
+void setNativeClock(unsigned long long (*clock) ())
+{
+  customClock = clock;
+}
+
+#endif
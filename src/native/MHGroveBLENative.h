@@ -0,0 +1,187 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#ifndef MHGROVEBLENATIVE_H
+#define MHGROVEBLENATIVE_H
+
+/*
+Stand-in for the parts of the Arduino core used by MHGroveBLE, for building
+it on platforms other than Arduino. Only included if `MHGROVEBLE_NATIVE` is
+defined, see `MHGroveBLEHal.h`.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+// Flash strings are plain strings.
+class __FlashStringHelper;
+#define F(text) (reinterpret_cast<const __FlashStringHelper *>(text))
+#define PROGMEM
+#define PSTR(text) (text)
+typedef const char * PGM_P;
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define pgm_read_dword(address) (*(const uint32_t *)(address))
+#define pgm_read_ptr(address) (*(void * const *)(address))
+#define strlen_P strlen
+#define strncmp_P strncmp
+#define memcpy_P memcpy
+
+/** Milliseconds since the clock started. */
+unsigned long millis();
+
+/** Microseconds since the clock started. */
+unsigned long micros();
+
+/** Replace the clock, e.g. with a simulated one.
+
+ By default, a monotonic clock starting at 0 when the program starts is used.
+
+ @param clock Function returning the time in microseconds, or null to use the
+  default clock.
+ */
+void setNativeClock(unsigned long long (*clock) ());
+
+/** Subset of the Arduino `String` class. */
+class String {
+
+public:
+  String() {}
+  String(const char * text) : text(text) {}
+  String(const __FlashStringHelper * text) :
+    text(reinterpret_cast<const char *>(text))
+  {
+  }
+  String(int value) : text(std::to_string(value)) {}
+  String(long value) : text(std::to_string(value)) {}
+  String(unsigned int value) : text(std::to_string(value)) {}
+  String(unsigned long value) : text(std::to_string(value)) {}
+
+  unsigned int length() const { return text.size(); }
+  const char * c_str() const { return text.c_str(); }
+  unsigned char reserve(unsigned int size) { text.reserve(size); return 1; }
+  char operator[](unsigned int index) const { return text[index]; }
+  bool operator==(const String & other) const { return text == other.text; }
+  bool operator!=(const String & other) const { return text != other.text; }
+
+  String & operator+=(char value) { text += value; return *this; }
+  String & operator+=(const char * value) { text += value; return *this; }
+  String & operator+=(const String & value) { text += value.text; return *this; }
+  String & operator+=(const __FlashStringHelper * value)
+  {
+    text += reinterpret_cast<const char *>(value);
+    return *this;
+  }
+  String & operator+=(int value) { text += std::to_string(value); return *this; }
+  String & operator+=(long value) { text += std::to_string(value); return *this; }
+  String & operator+=(unsigned int value) { text += std::to_string(value); return *this; }
+  String & operator+=(unsigned long value) { text += std::to_string(value); return *this; }
+
+private:
+  std::string text;
+};
+
+class Print;
+
+/** Objects that can print themselves. */
+class Printable {
+
+public:
+  virtual ~Printable() {}
+  virtual size_t printTo(Print & output) const = 0;
+};
+
+/** Subset of the Arduino `Print` class. */
+class Print {
+
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t value) = 0;
+
+  virtual size_t write(const uint8_t * data, size_t length)
+  {
+    size_t written = 0;
+    while (length--) {
+      written += write(*data++);
+    }
+    return written;
+  }
+
+  size_t write(const char * text)
+  {
+    return write(reinterpret_cast<const uint8_t *>(text), strlen(text));
+  }
+
+  size_t print(const String & text)
+  {
+    return write(reinterpret_cast<const uint8_t *>(text.c_str()), text.length());
+  }
+  size_t print(const char * text) { return write(text); }
+  size_t print(const __FlashStringHelper * text)
+  {
+    return write(reinterpret_cast<const char *>(text));
+  }
+  size_t print(const Printable & value) { return value.printTo(*this); }
+  size_t print(char value) { return write((uint8_t)value); }
+  size_t print(int value) { return print(String(value)); }
+  size_t print(long value) { return print(String(value)); }
+  size_t print(unsigned int value) { return print(String(value)); }
+  size_t print(unsigned long value) { return print(String(value)); }
+  size_t println() { return write((uint8_t)'\n'); }
+};
+
+/** Subset of the Arduino `Stream` class. */
+class Stream : public Print {
+
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  virtual size_t readBytes(uint8_t * buffer, size_t length)
+  {
+    size_t count = 0;
+    while (count < length) {
+      int value = read();
+      if (value < 0) {
+        break;
+      }
+      buffer[count++] = (uint8_t)value;
+    }
+    return count;
+  }
+
+  size_t readBytes(char * buffer, size_t length)
+  {
+    return readBytes(reinterpret_cast<uint8_t *>(buffer), length);
+  }
+};
+
+#endif
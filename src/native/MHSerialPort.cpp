@@ -0,0 +1,167 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#if defined(MHGROVEBLE_NATIVE) && defined(__unix__)
+
+#include "MHSerialPort.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+/** Get the termios constant for a baud rate, or 0 if not supported. */
+static speed_t speedForBaudRate(unsigned long baud)
+{
+  switch (baud) {
+    case 1200: return B1200;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    default: return 0;
+  }
+}
+
+MHSerialPort::MHSerialPort() :
+  fd(-1),
+  peeked(-1)
+{
+}
+
+MHSerialPort::~MHSerialPort()
+{
+  end();
+}
+
+bool MHSerialPort::begin(const char * path, unsigned long baud)
+{
+  end();
+
+  fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    return false;
+  }
+  if (!begin(baud)) {
+    end();
+    return false;
+  }
+  return true;
+}
+
+bool MHSerialPort::begin(unsigned long baud)
+{
+  speed_t speed = speedForBaudRate(baud);
+  struct termios options;
+
+  if (fd < 0 || speed == 0 || tcgetattr(fd, &options) != 0) {
+    return false;
+  }
+
+  cfmakeraw(&options);
+  options.c_cflag |= CLOCAL | CREAD;
+  options.c_cflag &= ~(CSTOPB | PARENB);
+  options.c_cc[VMIN] = 0;
+  options.c_cc[VTIME] = 0;
+  cfsetispeed(&options, speed);
+  cfsetospeed(&options, speed);
+
+  // Anything buffered was sent or received at the old baud rate.
+  tcflush(fd, TCIOFLUSH);
+  peeked = -1;
+  return tcsetattr(fd, TCSANOW, &options) == 0;
+}
+
+void MHSerialPort::end()
+{
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  peeked = -1;
+}
+
+bool MHSerialPort::isOpen() const
+{
+  return fd >= 0;
+}
+
+int MHSerialPort::available()
+{
+  int count = 0;
+  if (fd < 0 || ioctl(fd, FIONREAD, &count) != 0) {
+    count = 0;
+  }
+  return count + (peeked >= 0 ? 1 : 0);
+}
+
+int MHSerialPort::read()
+{
+  int value = peek();
+  peeked = -1;
+  return value;
+}
+
+int MHSerialPort::peek()
+{
+  if (peeked < 0 && fd >= 0) {
+    uint8_t value;
+    if (::read(fd, &value, 1) == 1) {
+      peeked = value;
+    }
+  }
+  return peeked;
+}
+
+size_t MHSerialPort::write(uint8_t value)
+{
+  return write(&value, 1);
+}
+
+size_t MHSerialPort::write(const uint8_t * data, size_t length)
+{
+  size_t written = 0;
+
+  while (fd >= 0 && written < length) {
+    ssize_t result = ::write(fd, data + written, length - written);
+    if (result > 0) {
+      written += result;
+    } else if (result < 0 && errno != EAGAIN && errno != EINTR) {
+      break;
+    } else {
+      // The output buffer is full, wait until it has been sent.
+      tcdrain(fd);
+    }
+  }
+  return written;
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+MIT License
+
+Copyright (c) 2017 Marc Haisenko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#ifndef MHSERIALPORT_H
+#define MHSERIALPORT_H
+
+#include "MHGroveBLENative.h"
+
+/** A `Stream` for a serial port on POSIX systems, e.g. a USB-UART adapter at
+ "/dev/ttyUSB0". Reading never blocks.
+
+ Only available with `MHGROVEBLE_NATIVE`.
+ */
+class MHSerialPort : public Stream {
+
+public:
+  /** Constructor. The port is not opened yet. */
+  MHSerialPort();
+
+  /** Destructor. Closes the port. */
+  ~MHSerialPort();
+
+  MHSerialPort(const MHSerialPort &) = delete;
+  MHSerialPort & operator=(const MHSerialPort &) = delete;
+
+  /** Open the port in raw mode, 8N1.
+
+   @param path Path of the device.
+   @param baud The baud rate.
+   @return Whether the port has been opened and configured.
+   */
+  bool begin(const char * path, unsigned long baud);
+
+  /** Switch an open port to another baud rate, e.g. from the handler set
+   with `MHGroveBLE::setOnBaudRateChange`.
+
+   @return Whether the baud rate is supported and has been set.
+   */
+  bool begin(unsigned long baud);
+
+  /** Close the port. */
+  void end();
+
+  /** Whether the port is open. */
+  bool isOpen() const;
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t value) override;
+  size_t write(const uint8_t * data, size_t length) override;
+  using Print::write;
+
+private:
+  /** File descriptor of the port, or -1. */
+  int fd;
+  /** Byte read by `peek()` but not by `read()` yet, or -1. */
+  int peeked;
+};
+
+#endif